@@ -0,0 +1,1060 @@
+// bcache.c - Block buffer cache
+//
+
+#ifndef TRACE
+#ifdef BCACHE_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef BCACHE_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "bcache.h"
+#include "console.h"
+#include "error.h"
+#include "halt.h"
+#include "io.h"
+#include "memory.h"
+#include "string.h"
+#include "thread.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL CONSTANT DEFINITIONS
+//
+
+// Number of hash buckets; must be a power of two.
+
+#define BCACHE_NBUCKET 64
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char bcache_initialized = 0;
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct bcache_blk blks[BCACHE_NBLK];
+static struct bcache_blk * buckets[BCACHE_NBUCKET];
+
+// LRU list: lru_head is the most recently used block, lru_tail the least.
+
+static struct bcache_blk * lru_head;
+static struct bcache_blk * lru_tail;
+
+static struct bcache_stats stats;
+
+// Asynchronous fills started by bcache_prefetch. A fill reads a stretch of
+// blocks straight into their pages with one device request, whose segments
+// are the pages, and keeps the blocks pinned and marked filling until it is
+// reaped. The request may complete in an ISR, which only sets req.complete and
+// broadcasts fill_done; the blocks are made valid by fill_reap in thread
+// context, since the hash table and LRU list are not protected against
+// interrupts.
+
+struct bcache_fill {
+    struct io_request req;
+    struct io_intf * dev;
+    struct bcache_blk * blks[BCACHE_RUN_MAX];
+    uint32_t cnt;
+    int busy;
+    struct io_seg segs[BCACHE_RUN_MAX];
+};
+
+static struct bcache_fill fills[BCACHE_NFILL];
+static struct condition fill_done;
+static uint32_t fill_pinned; // blocks held by busy fills
+
+// Write-backs started by bcache_flush. A write-back writes a run of dirty
+// blocks straight from their pages with one device request, whose segments
+// are the pages; the blocks stay pinned until it is reaped. Only bcache_flush
+// uses them, while it holds flush_lock.
+
+struct bcache_wb {
+    struct io_request req;
+    struct bcache_blk ** blks; // the run, in bcache_flush's list
+    uint32_t cnt;
+    int busy;
+    struct io_seg segs[BCACHE_RUN_MAX];
+};
+
+static struct bcache_wb wbs[BCACHE_NFLUSH];
+static struct lock flush_lock;
+
+// Broadcast when a request submitted by dev_rw_segs or bcache_flush completes.
+
+static struct condition io_done;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static inline unsigned int bucket_of(const struct io_intf * dev, uint64_t blkno);
+
+static struct bcache_blk * lookup(const struct io_intf * dev, uint64_t blkno);
+static struct bcache_blk * lookup_wait(struct io_intf * dev, uint64_t blkno);
+static struct bcache_blk * evict(void);
+
+static struct bcache_fill * fill_of(const struct bcache_blk * blk);
+static void fill_reap(void);
+static void fill_wait(const struct io_intf * dev);
+
+static void flush_reap(struct bcache_wb * wb, int * errptr);
+
+static void hash_insert(struct bcache_blk * blk);
+static void hash_remove(struct bcache_blk * blk);
+
+static void lru_remove(struct bcache_blk * blk);
+static void lru_push_front(struct bcache_blk * blk);
+static void lru_push_back(struct bcache_blk * blk);
+
+static int dev_read_blk(struct io_intf * dev, uint64_t blkno, void * buf);
+static int dev_read_blks (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt, void * buf);
+static int dev_write_blk(struct io_intf * dev, uint64_t blkno, const void * buf);
+static int dev_rw (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt, void * buf, int write);
+static int dev_rw_segs (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt,
+    const struct io_seg * segs, int write);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void bcache_init(void) {
+    // input: none
+    //
+    // output: none
+    //
+    // side effect:
+    //  Allocates a page for every cache block and puts all blocks on the LRU
+    //  list as invalid (free) blocks.
+
+    int i;
+
+    trace("%s()", __func__);
+    assert (!bcache_initialized);
+
+    lru_head = NULL;
+    lru_tail = NULL;
+
+    for (i = 0; i < BCACHE_NBUCKET; i++)
+        buckets[i] = NULL;
+
+    for (i = 0; i < BCACHE_NBLK; i++) {
+        blks[i] = (struct bcache_blk){ 0 };
+        blks[i].data = memory_alloc_page();
+        lru_push_back(&blks[i]);
+    }
+
+    for (i = 0; i < BCACHE_NFILL; i++)
+        fills[i].busy = 0;
+
+    fill_pinned = 0;
+    stats = (struct bcache_stats){ 0 };
+    for (i = 0; i < BCACHE_NFLUSH; i++)
+        wbs[i].busy = 0;
+
+    lock_init(&flush_lock, "bcache_flush");
+    condition_init(&fill_done, "bcache_fill");
+    condition_init(&io_done, "bcache_io");
+    bcache_initialized = 1;
+}
+
+struct bcache_blk * bcache_get(struct io_intf * dev, uint64_t blkno) {
+    // input:
+    //  dev: the io interface of the block device
+    //  blkno: the block number, in units of BCACHE_BLKSZ
+    //
+    // output:
+    //  return the pinned cache block on success, NULL on failure
+    //
+    // side effect:
+    //  May evict the least recently used unpinned block (writing it back first
+    //  if it is dirty) and read the requested block from the device, or wait
+    //  for an asynchronous fill of the block. Moves the block to the front of
+    //  the LRU list.
+
+    struct bcache_blk * blk;
+    struct bcache_blk * other;
+    int result;
+
+    trace("%s(dev=%p,blkno=%lu)", __func__, dev, (unsigned long)blkno);
+
+    blk = lookup_wait(dev, blkno);
+
+    if (blk != NULL) {
+        stats.hits++;
+    } else {
+        stats.misses++;
+        blk = evict();
+        if (blk == NULL) {
+            kprintf("bcache_get: no free block\n");
+            return NULL;
+        }
+
+        // Keep the victim pinned while we sleep in the driver, and check
+        // again afterwards: another thread may have cached the block meanwhile.
+
+        blk->refcnt = 1;
+        result = dev_read_blk(dev, blkno, blk->data);
+        other = lookup_wait(dev, blkno);
+        blk->refcnt = 0;
+
+        if (result != 0 || other != NULL) {
+            // leave the block invalid at the back of the list for reuse
+            lru_remove(blk);
+            lru_push_back(blk);
+            if (other == NULL)
+                return NULL;
+            blk = other;
+        } else {
+            blk->dev = dev;
+            blk->blkno = blkno;
+            blk->valid = 1;
+            blk->dirty = 0;
+            hash_insert(blk);
+        }
+    }
+
+    blk->refcnt++;
+    lru_remove(blk);
+    lru_push_front(blk);
+    return blk;
+}
+
+struct bcache_blk * bcache_get_zeroed(struct io_intf * dev, uint64_t blkno) {
+    // input:
+    //  dev: the io interface of the block device
+    //  blkno: the block number, in units of BCACHE_BLKSZ
+    //
+    // output:
+    //  return the pinned cache block on success, NULL on failure
+    //
+    // side effect:
+    //  Like bcache_get, but clears the block instead of reading it from the
+    //  device. The block is not marked dirty; the caller does that once it
+    //  has written its data.
+
+    struct bcache_blk * blk;
+    struct bcache_blk * other;
+
+    trace("%s(dev=%p,blkno=%lu)", __func__, dev, (unsigned long)blkno);
+
+    blk = lookup_wait(dev, blkno);
+
+    if (blk != NULL) {
+        stats.hits++;
+    } else {
+        blk = evict();
+        if (blk == NULL) {
+            kprintf("bcache_get_zeroed: no free block\n");
+            return NULL;
+        }
+
+        // evict may have slept writing back a dirty victim
+
+        blk->refcnt = 1;
+        other = lookup_wait(dev, blkno);
+        blk->refcnt = 0;
+
+        if (other != NULL) {
+            lru_remove(blk);
+            lru_push_back(blk);
+            blk = other;
+        } else {
+            blk->dev = dev;
+            blk->blkno = blkno;
+            blk->valid = 1;
+            blk->dirty = 0;
+            hash_insert(blk);
+        }
+    }
+
+    memset(blk->data, 0, BCACHE_BLKSZ);
+    stats.zeroed++;
+
+    blk->refcnt++;
+    lru_remove(blk);
+    lru_push_front(blk);
+    return blk;
+}
+
+int bcache_read_run(struct io_intf * dev, uint64_t blkno, uint32_t cnt) {
+    // input:
+    //  dev: the io interface of the block device
+    //  blkno: the first block number of the run
+    //  cnt: the number of blocks in the run
+    //
+    // output:
+    //  return 0 on success, relative errcode on failure
+    //
+    // side effect:
+    //  Reads every stretch of uncached blocks in the run with one device
+    //  request straight into the pages of the victim blocks and installs the
+    //  blocks in the cache as most recently used. Blocks being filled
+    //  asynchronously count as cached.
+
+    struct bcache_blk * victims[BCACHE_RUN_MAX];
+    struct io_seg segs[BCACHE_RUN_MAX];
+    struct bcache_blk * blk;
+    uint32_t i, j, k;
+    int result;
+
+    trace("%s(dev=%p,blkno=%lu,cnt=%u)", __func__,
+        dev, (unsigned long)blkno, (unsigned int)cnt);
+
+    if (BCACHE_RUN_MAX < cnt)
+        cnt = BCACHE_RUN_MAX;
+
+    i = 0;
+    while (i < cnt) {
+        if (lookup(dev, blkno + i) != NULL) {
+            i++;
+            continue;
+        }
+
+        // blocks i..j-1 are missing
+
+        j = i + 1;
+        while (j < cnt && lookup(dev, blkno + j) == NULL)
+            j++;
+
+        // Pick the victims first, since writing back a dirty victim may
+        // sleep. They stay pinned while the device reads into them.
+
+        for (k = i; k < j; k++) {
+            blk = evict();
+            if (blk == NULL)
+                break;
+            blk->refcnt = 1;
+            victims[k - i] = blk;
+            segs[k - i] = (struct io_seg){ blk->data, BCACHE_BLKSZ };
+        }
+
+        if (k < j) {
+            while (i < k)
+                victims[--k - i]->refcnt = 0;
+            return -EBUSY;
+        }
+
+        result = dev_rw_segs(dev, blkno + i, j - i, segs, 0);
+
+        for (k = i; k < j; k++) {
+            blk = victims[k - i];
+            blk->refcnt = 0;
+            lru_remove(blk);
+
+            // another thread may have cached the block while we slept
+            if (result != 0 || lookup(dev, blkno + k) != NULL) {
+                lru_push_back(blk);
+                continue;
+            }
+
+            blk->dev = dev;
+            blk->blkno = blkno + k;
+            blk->valid = 1;
+            blk->dirty = 0;
+            hash_insert(blk);
+            lru_push_front(blk);
+            stats.prefetched++;
+        }
+
+        if (result != 0)
+            return result;
+
+        i = j;
+    }
+
+    return 0;
+}
+
+int bcache_prefetch(struct io_intf * dev, uint64_t blkno, uint32_t cnt) {
+    // input:
+    //  dev: the io interface of the block device
+    //  blkno: the first block number of the run
+    //  cnt: the number of blocks in the run
+    //
+    // output:
+    //  return 0 if every stretch was started, relative errcode otherwise
+    //
+    // side effect:
+    //  Claims a fill for every stretch of uncached blocks in the run, enters
+    //  its victim blocks in the cache as filling and submits one device read
+    //  for the stretch. The blocks become valid when the fill is reaped.
+
+    struct bcache_fill * fill;
+    struct bcache_blk * blk;
+    uint32_t i, j, k, n;
+    int result;
+
+    trace("%s(dev=%p,blkno=%lu,cnt=%u)", __func__,
+        dev, (unsigned long)blkno, (unsigned int)cnt);
+
+    if (BCACHE_RUN_MAX < cnt)
+        cnt = BCACHE_RUN_MAX;
+
+    fill_reap();
+
+    i = 0;
+    while (i < cnt) {
+        if (lookup(dev, blkno + i) != NULL) {
+            i++;
+            continue;
+        }
+
+        // blocks i..j-1 are missing
+
+        j = i + 1;
+        while (j < cnt && lookup(dev, blkno + j) == NULL)
+            j++;
+
+        // Fills may hold at most half of the cache, so that bcache_get always
+        // finds a victim.
+
+        if (BCACHE_NBLK / 2 < fill_pinned + (j - i))
+            return -EBUSY;
+
+        for (k = 0; k < BCACHE_NFILL; k++) {
+            if (!fills[k].busy)
+                break;
+        }
+
+        if (k == BCACHE_NFILL)
+            return -EBUSY;
+
+        // Claim the fill and pick the victims first, since writing back a
+        // dirty victim may sleep.
+
+        fill = &fills[k];
+        fill->busy = 1;
+        fill->req.complete = 0;
+        fill->dev = dev;
+        fill->cnt = j - i;
+        fill_pinned += j - i;
+
+        for (n = 0; n < fill->cnt; n++) {
+            blk = evict();
+            if (blk == NULL)
+                break;
+            blk->refcnt = 1;
+            fill->blks[n] = blk;
+        }
+
+        // another thread may have cached a block of the stretch while we slept
+
+        for (k = i; k < j && n == fill->cnt; k++) {
+            if (lookup(dev, blkno + k) != NULL)
+                break;
+        }
+
+        if (n < fill->cnt || k < j) {
+            while (0 < n)
+                fill->blks[--n]->refcnt = 0;
+            fill_pinned -= fill->cnt;
+            fill->busy = 0;
+            return -EBUSY;
+        }
+
+        for (k = i; k < j; k++) {
+            blk = fill->blks[k - i];
+            blk->dev = dev;
+            blk->blkno = blkno + k;
+            blk->valid = 0;
+            blk->dirty = 0;
+            blk->filling = 1;
+            hash_insert(blk);
+            fill->segs[k - i] = (struct io_seg){ blk->data, BCACHE_BLKSZ };
+        }
+
+        fill->req = (struct io_request){
+            .op = IO_REQ_READ,
+            .pos = (blkno + i) * BCACHE_BLKSZ,
+            .segs = fill->segs,
+            .nsegs = j - i,
+            .len = (j - i) * BCACHE_BLKSZ,
+            .cond = &fill_done
+        };
+
+        stats.dev_reads++;
+        result = iosubmit(dev, &fill->req);
+
+        // a request that was not started is reaped as a failed fill
+        if (result != 0) {
+            iocomplete(&fill->req, result);
+            return result;
+        }
+
+        i = j;
+    }
+
+    return 0;
+}
+
+int bcache_read_direct (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt, void * buf)
+{
+    // input:
+    //  dev: the io interface of the block device
+    //  blkno: the first block number to read
+    //  cnt: the number of blocks to read
+    //  buf: the destination, cnt * BCACHE_BLKSZ bytes
+    //
+    // output:
+    //  return 0 on success, relative errcode on failure
+    //
+    // side effect:
+    //  Cached blocks are copied from the cache so that the caller sees the
+    //  latest data, including dirty blocks not yet written back; the rest is
+    //  read from the device directly into buf.
+
+    struct bcache_blk * blk;
+    uint32_t i, j, k;
+    int result;
+
+    trace("%s(dev=%p,blkno=%lu,cnt=%u,buf=%p)", __func__,
+        dev, (unsigned long)blkno, (unsigned int)cnt, buf);
+
+    i = 0;
+    while (i < cnt) {
+        blk = lookup_wait(dev, blkno + i);
+        if (blk != NULL) {
+            stats.hits++;
+            memcpy(buf + i * BCACHE_BLKSZ, blk->data, BCACHE_BLKSZ);
+            i++;
+            continue;
+        }
+
+        // blocks i..j-1 are not cached
+
+        j = i + 1;
+        while (j < cnt && lookup(dev, blkno + j) == NULL)
+            j++;
+
+        result = dev_read_blks(dev, blkno + i, j - i, buf + i * BCACHE_BLKSZ);
+        if (result != 0)
+            return result;
+
+        // A block may have been cached and dirtied while we slept; the cached
+        // copy is newer than what the device returned.
+
+        for (k = i; k < j; k++) {
+            blk = lookup(dev, blkno + k);
+            if (blk != NULL && blk->dirty)
+                memcpy(buf + k * BCACHE_BLKSZ, blk->data, BCACHE_BLKSZ);
+        }
+
+        stats.direct += j - i;
+        i = j;
+    }
+
+    return 0;
+}
+
+void bcache_release(struct bcache_blk * blk) {
+    // input:
+    //  blk: a block returned by bcache_get
+    //
+    // output: none
+    //
+    // side effect:
+    //  Decrements the pin count of the block.
+
+    assert (blk != NULL && blk->refcnt > 0);
+    blk->refcnt--;
+}
+
+void bcache_mark_dirty(struct bcache_blk * blk) {
+    // input:
+    //  blk: a pinned cache block whose data was modified
+    //
+    // output: none
+    //
+    // side effect:
+    //  The block will be written to the device by the next bcache_flush or
+    //  when it is evicted.
+
+    assert (blk != NULL && blk->refcnt > 0 && blk->valid);
+    blk->dirty = 1;
+}
+
+int bcache_write(struct bcache_blk * blk) {
+    // input:
+    //  blk: a pinned cache block
+    //
+    // output:
+    //  return 0 on success, relative errcode on failure
+    //
+    // side effect:
+    //  Writes the block contents to the device immediately (write-through)
+    //  and clears its dirty flag.
+
+    int result;
+
+    assert (blk != NULL && blk->refcnt > 0 && blk->valid);
+
+    blk->dirty = 0;
+    result = dev_write_blk(blk->dev, blk->blkno, blk->data);
+    if (result != 0)
+        blk->dirty = 1;
+
+    return result;
+}
+
+int bcache_flush(struct io_intf * dev) {
+    // input:
+    //  dev: the io interface of the block device, or NULL for all devices
+    //
+    // output:
+    //  return 0 on success, the first errcode encountered on failure
+    //
+    // side effect:
+    //  Writes every dirty block back to its device. Dirty blocks are sorted by
+    //  block number and each run of consecutive blocks is written with a
+    //  single device request, submitted through iosubmit with up to
+    //  BCACHE_NFLUSH requests in flight. Blocks that fail to write stay dirty.
+
+    struct bcache_blk * list[BCACHE_NBLK];
+    struct bcache_blk * blk;
+    struct bcache_wb * wb;
+    uint32_t n, i, j, k, w;
+    int result;
+    int err;
+
+    trace("%s(dev=%p)", __func__, dev);
+
+    if (!bcache_initialized)
+        return 0;
+
+    lock_acquire(&flush_lock);
+    fill_wait(dev);
+
+    // collect and pin the dirty blocks, in block order (insertion sort)
+
+    n = 0;
+    for (i = 0; i < BCACHE_NBLK; i++) {
+        blk = &blks[i];
+        if (!blk->valid || !blk->dirty || (dev != NULL && blk->dev != dev))
+            continue;
+
+        blk->refcnt++;
+        for (j = n; 0 < j; j--) {
+            if (list[j-1]->dev < blk->dev || (list[j-1]->dev == blk->dev
+                && list[j-1]->blkno < blk->blkno))
+                break;
+            list[j] = list[j-1];
+        }
+        list[j] = blk;
+        n++;
+    }
+
+    err = 0;
+    w = 0;
+    i = 0;
+    while (i < n) {
+        j = i + 1;
+        while (j < n && j - i < BCACHE_RUN_MAX
+            && list[j]->dev == list[i]->dev
+            && list[j]->blkno == list[i]->blkno + (j - i))
+        {
+            j++;
+        }
+
+        // Take the write-backs in turn, waiting for the oldest one if all
+        // are in flight. A block modified while its write is in flight is
+        // dirtied again and written by a later flush.
+
+        wb = &wbs[w];
+        w = (w + 1) % BCACHE_NFLUSH;
+
+        if (wb->busy)
+            flush_reap(wb, &err);
+
+        for (k = i; k < j; k++) {
+            wb->segs[k - i] = (struct io_seg){ list[k]->data, BCACHE_BLKSZ };
+            list[k]->dirty = 0;
+        }
+
+        wb->blks = list + i;
+        wb->cnt = j - i;
+        wb->busy = 1;
+        wb->req = (struct io_request){
+            .op = IO_REQ_WRITE,
+            .pos = list[i]->blkno * BCACHE_BLKSZ,
+            .segs = wb->segs,
+            .nsegs = j - i,
+            .len = (j - i) * BCACHE_BLKSZ,
+            .cond = &io_done
+        };
+
+        stats.dev_writes++;
+        result = iosubmit(list[i]->dev, &wb->req);
+
+        // a request that was not started is reaped as a failed write-back
+        if (result != 0)
+            iocomplete(&wb->req, result);
+
+        i = j;
+    }
+
+    for (w = 0; w < BCACHE_NFLUSH; w++) {
+        if (wbs[w].busy)
+            flush_reap(&wbs[w], &err);
+    }
+
+    for (i = 0; i < n; i++)
+        list[i]->refcnt--;
+
+    lock_release(&flush_lock);
+    return err;
+}
+
+void bcache_invalidate(struct io_intf * dev) {
+    // input:
+    //  dev: the io interface of the block device
+    //
+    // output: none
+    //
+    // side effect:
+    //  Marks every unpinned clean block of the device invalid and moves it to
+    //  the back of the LRU list so it is reused first, after waiting for the
+    //  asynchronous fills of the device. Dirty blocks are kept; call
+    //  bcache_flush first to drop them as well.
+
+    int i;
+
+    fill_wait(dev);
+
+    for (i = 0; i < BCACHE_NBLK; i++) {
+        if (blks[i].valid && blks[i].dev == dev
+            && blks[i].refcnt == 0 && !blks[i].dirty)
+        {
+            hash_remove(&blks[i]);
+            blks[i].valid = 0;
+            lru_remove(&blks[i]);
+            lru_push_back(&blks[i]);
+        }
+    }
+}
+
+void bcache_get_stats(struct bcache_stats * out) {
+    *out = stats;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static inline unsigned int bucket_of(const struct io_intf * dev, uint64_t blkno) {
+    return (((uintptr_t)dev >> 4) ^ blkno) & (BCACHE_NBUCKET-1);
+}
+
+struct bcache_blk * lookup(const struct io_intf * dev, uint64_t blkno) {
+    struct bcache_blk * blk;
+
+    for (blk = buckets[bucket_of(dev, blkno)]; blk != NULL; blk = blk->hash_next) {
+        if (blk->dev == dev && blk->blkno == blkno)
+            return blk;
+    }
+
+    return NULL;
+}
+
+struct bcache_blk * lookup_wait(struct io_intf * dev, uint64_t blkno) {
+    // Like lookup, but waits for a block that is being filled, so that the
+    // block returned (if any) holds valid data.
+
+    struct bcache_blk * blk;
+
+    for (;;) {
+        fill_reap();
+        blk = lookup(dev, blkno);
+        if (blk == NULL || !blk->filling)
+            return blk;
+
+        stats.fill_waits++;
+        condition_wait_until(&fill_done, &fill_of(blk)->req.complete);
+    }
+}
+
+struct bcache_blk * evict(void) {
+    // Returns the least recently used unpinned block, removed from the hash
+    // table. A dirty victim is written back first. Returns NULL if every block
+    // is pinned or the write-back fails.
+
+    struct bcache_blk * blk;
+    int result;
+
+    fill_reap();
+
+    for (;;) {
+        for (blk = lru_tail; blk != NULL; blk = blk->lru_prev) {
+            if (blk->refcnt == 0)
+                break;
+        }
+
+        if (blk == NULL)
+            return NULL;
+
+        if (!blk->valid || !blk->dirty)
+            break;
+
+        // Pin the victim while it is written back. We may sleep, so the block
+        // may be used or dirtied again meanwhile; look for a victim again.
+
+        blk->refcnt++;
+        blk->dirty = 0;
+        result = dev_write_blk(blk->dev, blk->blkno, blk->data);
+        blk->refcnt--;
+
+        if (result != 0) {
+            kprintf("bcache: write-back of block %lu failed (%d)\n",
+                (unsigned long)blk->blkno, result);
+            blk->dirty = 1;
+            return NULL;
+        }
+
+        stats.writebacks++;
+    }
+
+    if (blk->valid) {
+        stats.evictions++;
+        hash_remove(blk);
+        blk->valid = 0;
+    }
+
+    return blk;
+}
+
+struct bcache_fill * fill_of(const struct bcache_blk * blk) {
+    // Returns the fill that holds the filling block /blk/.
+
+    uint32_t i, k;
+
+    for (i = 0; i < BCACHE_NFILL; i++) {
+        if (!fills[i].busy)
+            continue;
+        for (k = 0; k < fills[i].cnt; k++) {
+            if (fills[i].blks[k] == blk)
+                return &fills[i];
+        }
+    }
+
+    panic("bcache: filling block without a fill");
+}
+
+void fill_reap(void) {
+    // Makes the blocks of every completed fill valid, or drops them if the
+    // read failed, and frees the fill.
+
+    struct bcache_fill * fill;
+    struct bcache_blk * blk;
+    uint32_t i, k;
+    int ok;
+
+    for (i = 0; i < BCACHE_NFILL; i++) {
+        fill = &fills[i];
+        if (!fill->busy || !fill->req.complete)
+            continue;
+
+        ok = (fill->req.result == (long)fill->cnt * BCACHE_BLKSZ);
+        if (!ok) {
+            debug("bcache: fill of block %lu failed (%ld)",
+                (unsigned long)fill->blks[0]->blkno, (long)fill->req.result);
+        }
+
+        for (k = 0; k < fill->cnt; k++) {
+            blk = fill->blks[k];
+            blk->filling = 0;
+            blk->refcnt--;
+            lru_remove(blk);
+
+            if (ok) {
+                blk->valid = 1;
+                lru_push_front(blk);
+                stats.prefetched++;
+            } else {
+                hash_remove(blk);
+                lru_push_back(blk);
+            }
+        }
+
+        fill_pinned -= fill->cnt;
+        fill->busy = 0;
+    }
+}
+
+void fill_wait(const struct io_intf * dev) {
+    // Waits until every fill of /dev/ (of all devices if NULL) has completed
+    // and reaps them.
+
+    uint32_t i;
+
+    for (i = 0; i < BCACHE_NFILL; i++) {
+        if (fills[i].busy && (dev == NULL || fills[i].dev == dev))
+            condition_wait_until(&fill_done, &fills[i].req.complete);
+    }
+
+    fill_reap();
+}
+
+void flush_reap(struct bcache_wb * wb, int * errptr) {
+    // Waits for write-back /wb/ to complete and frees it. Its blocks are
+    // dirtied again if the write failed, and the error is stored in *errptr
+    // unless an earlier one is there.
+
+    uint32_t k;
+
+    condition_wait_until(&io_done, &wb->req.complete);
+
+    if (wb->req.result == (long)wb->cnt * BCACHE_BLKSZ) {
+        stats.writebacks += wb->cnt;
+    } else {
+        for (k = 0; k < wb->cnt; k++)
+            wb->blks[k]->dirty = 1;
+        if (*errptr == 0)
+            *errptr = (wb->req.result < 0) ? wb->req.result : -EIO;
+    }
+
+    wb->busy = 0;
+}
+
+void hash_insert(struct bcache_blk * blk) {
+    struct bcache_blk ** const head = &buckets[bucket_of(blk->dev, blk->blkno)];
+
+    blk->hash_next = *head;
+    *head = blk;
+}
+
+void hash_remove(struct bcache_blk * blk) {
+    struct bcache_blk ** pp = &buckets[bucket_of(blk->dev, blk->blkno)];
+
+    while (*pp != NULL && *pp != blk)
+        pp = &(*pp)->hash_next;
+
+    if (*pp != NULL)
+        *pp = blk->hash_next;
+
+    blk->hash_next = NULL;
+}
+
+void lru_remove(struct bcache_blk * blk) {
+    if (blk->lru_prev != NULL)
+        blk->lru_prev->lru_next = blk->lru_next;
+    else
+        lru_head = blk->lru_next;
+
+    if (blk->lru_next != NULL)
+        blk->lru_next->lru_prev = blk->lru_prev;
+    else
+        lru_tail = blk->lru_prev;
+
+    blk->lru_prev = NULL;
+    blk->lru_next = NULL;
+}
+
+void lru_push_front(struct bcache_blk * blk) {
+    blk->lru_prev = NULL;
+    blk->lru_next = lru_head;
+
+    if (lru_head != NULL)
+        lru_head->lru_prev = blk;
+    else
+        lru_tail = blk;
+
+    lru_head = blk;
+}
+
+void lru_push_back(struct bcache_blk * blk) {
+    blk->lru_next = NULL;
+    blk->lru_prev = lru_tail;
+
+    if (lru_tail != NULL)
+        lru_tail->lru_next = blk;
+    else
+        lru_head = blk;
+
+    lru_tail = blk;
+}
+
+int dev_read_blk(struct io_intf * dev, uint64_t blkno, void * buf) {
+    return dev_read_blks(dev, blkno, 1, buf);
+}
+
+int dev_read_blks (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt, void * buf)
+{
+    return dev_rw(dev, blkno, cnt, buf, 0);
+}
+
+int dev_write_blk(struct io_intf * dev, uint64_t blkno, const void * buf) {
+    return dev_rw(dev, blkno, 1, (void *)buf, 1);
+}
+
+int dev_rw (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt, void * buf, int write)
+{
+    // Transfers /cnt/ blocks starting at /blkno/ with a single positional
+    // request, so that threads sharing the device never race on its seek
+    // position.
+
+    long result;
+
+    if (write)
+        stats.dev_writes++;
+    else
+        stats.dev_reads++;
+
+    if (write)
+        result = iowriteat(dev, blkno * BCACHE_BLKSZ, buf, cnt * BCACHE_BLKSZ);
+    else
+        result = ioreadat(dev, blkno * BCACHE_BLKSZ, buf, cnt * BCACHE_BLKSZ);
+
+    if (result < 0)
+        return result;
+    if (result != cnt * BCACHE_BLKSZ)
+        return -EIO;
+
+    return 0;
+}
+
+int dev_rw_segs (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt,
+    const struct io_seg * segs, int write)
+{
+    // Like dev_rw, but transfers the blocks to or from /cnt/ segments of one
+    // block each, with a single request submitted through iosubmit and waited
+    // for.
+
+    struct io_request req = {
+        .op = write ? IO_REQ_WRITE : IO_REQ_READ,
+        .pos = blkno * BCACHE_BLKSZ,
+        .segs = segs,
+        .nsegs = cnt,
+        .len = cnt * BCACHE_BLKSZ,
+        .cond = &io_done
+    };
+    int result;
+
+    if (write)
+        stats.dev_writes++;
+    else
+        stats.dev_reads++;
+
+    result = iosubmit(dev, &req);
+    if (result != 0)
+        return result;
+
+    condition_wait_until(&io_done, &req.complete);
+
+    if (req.result < 0)
+        return req.result;
+    if (req.result != cnt * BCACHE_BLKSZ)
+        return -EIO;
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+// bcache.h - Block buffer cache
+//
+
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include "io.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// BCACHE_NBLK is the number of blocks held by the cache. Each block occupies
+// one physical page.
+
+#ifndef BCACHE_NBLK
+#define BCACHE_NBLK 64
+#endif
+
+// BCACHE_RUN_MAX is the largest number of blocks fetched from the device by a
+// single coalesced read (see bcache_read_run).
+
+#ifndef BCACHE_RUN_MAX
+#define BCACHE_RUN_MAX 16
+#endif
+
+// BCACHE_NFILL is the number of asynchronous fills (see bcache_prefetch) that
+// can be in flight at a time. A fill reads straight into the pages of the
+// blocks it fills.
+
+#ifndef BCACHE_NFILL
+#define BCACHE_NFILL 4
+#endif
+
+// BCACHE_NFLUSH is the number of write requests bcache_flush keeps in flight
+// at a time, one per run of consecutive dirty blocks.
+
+#ifndef BCACHE_NFLUSH
+#define BCACHE_NFLUSH 4
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+#define BCACHE_BLKSZ 4096
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A cached block of a block device. The /dev/ and /blkno/ members identify the
+// block; /blkno/ is in units of BCACHE_BLKSZ bytes. A block returned by
+// bcache_get is pinned (refcnt > 0) and will not be evicted until it is
+// released with bcache_release. A dirty block holds data that has not been
+// written to the device yet. A filling block is being read by an asynchronous
+// fill; it is already in the hash table, pinned by the fill, but its data is
+// not valid until the fill completes.
+
+struct bcache_blk {
+    struct io_intf * dev;
+    uint64_t blkno;
+    uint32_t refcnt;
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t filling;
+
+    struct bcache_blk * lru_prev; // towards most recently used
+    struct bcache_blk * lru_next; // towards least recently used
+    struct bcache_blk * hash_next;
+
+    char * data; // BCACHE_BLKSZ bytes, page-aligned
+};
+
+// Cache statistics, returned by the IOCTL_GETBCSTATS ioctl.
+
+struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t prefetched; // blocks brought in by bcache_read_run and bcache_prefetch
+    uint64_t fill_waits; // lookups that waited for an asynchronous fill
+    uint64_t direct;     // blocks read by bcache_read_direct bypassing the cache
+    uint64_t zeroed;     // blocks bcache_get_zeroed cleared instead of reading
+    uint64_t dev_reads;  // read requests issued to devices
+    uint64_t dev_writes; // write requests issued to devices
+    uint64_t writebacks; // dirty blocks written back
+};
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+extern char bcache_initialized;
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void bcache_init(void)
+// Initializes the block cache. Must be called after memory_init, since the
+// block buffers are allocated from the physical page allocator.
+
+extern void bcache_init(void);
+
+// struct bcache_blk * bcache_get(struct io_intf * dev, uint64_t blkno)
+// Returns the pinned cache block holding block /blkno/ of device /dev/,
+// reading it from the device if it is not cached. Returns NULL if no block
+// can be evicted or the device read fails.
+
+extern struct bcache_blk * bcache_get(struct io_intf * dev, uint64_t blkno);
+
+// struct bcache_blk * bcache_get_zeroed(struct io_intf * dev, uint64_t blkno)
+// Like bcache_get, but never reads the block: its data is cleared to zeroes,
+// whether or not it was cached. For a caller about to overwrite the block, or
+// one whose old contents are meaningless. Returns NULL if no block can be
+// evicted.
+
+extern struct bcache_blk * bcache_get_zeroed(struct io_intf * dev, uint64_t blkno);
+
+// int bcache_read_run(struct io_intf * dev, uint64_t blkno, uint32_t cnt)
+// Makes sure blocks /blkno/ to /blkno/+/cnt/-1 of device /dev/ are cached.
+// Each stretch of consecutive blocks that are not cached is fetched with a
+// single device read. At most BCACHE_RUN_MAX blocks are considered. Returns 0
+// on success or a negative error code.
+
+extern int bcache_read_run(struct io_intf * dev, uint64_t blkno, uint32_t cnt);
+
+// int bcache_prefetch(struct io_intf * dev, uint64_t blkno, uint32_t cnt)
+// Starts reading the blocks among /blkno/ to /blkno/+/cnt/-1 of device /dev/
+// that are not cached and returns without waiting for them. Each stretch of
+// consecutive uncached blocks is read with one asynchronous device request
+// (see iosubmit). The blocks are entered in the cache right away, and
+// bcache_get and bcache_read_direct wait for a block that is still being read.
+// At most BCACHE_RUN_MAX blocks are considered. Returns 0 if every stretch was
+// started, -EBUSY if no fill or no block was free for one, or another negative
+// error code.
+
+extern int bcache_prefetch(struct io_intf * dev, uint64_t blkno, uint32_t cnt);
+
+// int bcache_read_direct (
+//     struct io_intf * dev, uint64_t blkno, uint32_t cnt, void * buf)
+// Reads blocks /blkno/ to /blkno/+/cnt/-1 of device /dev/ into /buf/, which
+// must hold cnt*BCACHE_BLKSZ bytes. Blocks that are cached are copied from the
+// cache; each stretch of uncached blocks is read from the device straight into
+// /buf/ with a single request and is not added to the cache. Returns 0 on
+// success or a negative error code.
+
+extern int bcache_read_direct (
+    struct io_intf * dev, uint64_t blkno, uint32_t cnt, void * buf);
+
+// void bcache_release(struct bcache_blk * blk)
+// Unpins a block returned by bcache_get.
+
+extern void bcache_release(struct bcache_blk * blk);
+
+// void bcache_mark_dirty(struct bcache_blk * blk)
+// Marks a pinned cache block as modified. The block is written back to its
+// device by bcache_flush or when it is evicted.
+
+extern void bcache_mark_dirty(struct bcache_blk * blk);
+
+// int bcache_write(struct bcache_blk * blk)
+// Writes the contents of a pinned cache block back to its device right away.
+// Returns 0 on success or a negative error code.
+
+extern int bcache_write(struct bcache_blk * blk);
+
+// int bcache_flush(struct io_intf * dev)
+// Waits for the asynchronous fills of device /dev/ (of all devices if /dev/ is
+// NULL) and writes all its dirty blocks back, coalescing consecutive blocks
+// into one asynchronous request (see iosubmit) and keeping up to BCACHE_NFLUSH
+// requests in flight. Returns when every write has completed, with 0 on
+// success or a negative error code.
+
+extern int bcache_flush(struct io_intf * dev);
+
+// void bcache_invalidate(struct io_intf * dev)
+// Drops all unpinned clean cached blocks of device /dev/, e.g. when a new file
+// system is mounted on it.
+
+extern void bcache_invalidate(struct io_intf * dev);
+
+// void bcache_get_stats(struct bcache_stats * stats)
+// Copies the current cache counters into /stats/.
+
+extern void bcache_get_stats(struct bcache_stats * stats);
+
+#endif // _BCACHE_H_
@@ -29,6 +29,8 @@
 #define USER_START_VMA  0xC0000000UL // User programs loaded here
 #define USER_END_VMA    0xD0000000UL // End of user program space
 #define USER_STACK_VMA  USER_END_VMA // starting user stack pointer
+#define USER_MMAP_VMA   0xC8000000UL // memory-mapped files are placed here
+#define USER_MMAP_END_VMA 0xCC000000UL // end of the memory-mapped file area
 
 #define UART0_IOBASE 0x10000000 // PMA
 #define UART1_IOBASE 0x10000100 // PMA
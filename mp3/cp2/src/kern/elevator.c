@@ -0,0 +1,464 @@
+// elevator.c - Block request scheduler
+//
+
+#ifndef TRACE
+#ifdef ELEVATOR_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef ELEVATOR_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "elevator.h"
+#include "config.h"
+#include "console.h"
+#include "error.h"
+#include "intr.h"
+#include "io.h"
+#include "string.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void elv_close(struct io_intf * io);
+static long elv_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static long elv_write(struct io_intf * io, const void * buf, unsigned long n);
+static int elv_ioctl(struct io_intf * io, int cmd, void * arg);
+static long elv_readat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz);
+static long elv_writeat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long n);
+static int elv_submit(struct io_intf * io, struct io_request * req);
+
+static long elv_rw (
+    struct elevator * elv, int op, uint64_t pos, void * buf, unsigned long len);
+
+static int elv_in_ram(const void * buf, unsigned long len);
+static void elv_enqueue(struct elevator * elv, struct elv_req * req);
+static void elv_insert(struct elevator * elv, struct elv_req * req);
+static struct elv_req ** elv_pick(struct elevator * elv);
+static void elv_dispatch(struct elevator * elv);
+static void elv_run_done(struct io_request * ioreq);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+struct io_intf * elevator_init(struct elevator * elv, struct io_intf * dev) {
+    // input:
+    //  elv: the elevator to initialize
+    //  dev: the io interface of the block device to schedule
+    //
+    // output:
+    //  return the io interface of the elevator
+    //
+    // side effect:
+    //  Reads the block size of the device; requests that are not aligned to
+    //  it are passed to the device without scheduling.
+
+    static const struct io_ops ops = {
+        .close = elv_close,
+        .read = elv_read,
+        .write = elv_write,
+        .ctl = elv_ioctl,
+        .readat = elv_readat,
+        .writeat = elv_writeat,
+        .submit = elv_submit
+    };
+
+    int i;
+
+    trace("%s(dev=%p)", __func__, dev);
+
+    elv->io_intf.ops = &ops;
+    elv->dev = dev;
+    if (ioctl(dev, IOCTL_GETBLKSZ, &elv->blksz) != 0 || elv->blksz == 0)
+        elv->blksz = 512;
+
+    elv->queue = NULL;
+    elv->queued = 0;
+    elv->next_pos = 0;
+    elv->dispatching = 0;
+    elv->inflight = 0;
+    condition_init(&elv->changed, "elevator");
+
+    for (i = 0; i < ELV_MAX_INFLIGHT; i++)
+        elv->runs[i] = (struct elv_run){ .elv = elv };
+
+    elv->async_free = NULL;
+    for (i = 0; i < ELV_NASYNC; i++) {
+        elv->async[i].next = elv->async_free;
+        elv->async_free = &elv->async[i];
+    }
+
+    elv->stats = (struct elevator_stats){ 0 };
+    return &elv->io_intf;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void elv_close(struct io_intf * io) {
+    struct elevator * const elv = (void*)io - offsetof(struct elevator, io_intf);
+    ioclose(elv->dev);
+}
+
+// Sequential reads and writes use the position of the device and are not
+// scheduled.
+
+long elv_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct elevator * const elv = (void*)io - offsetof(struct elevator, io_intf);
+    return ioread(elv->dev, buf, bufsz);
+}
+
+long elv_write(struct io_intf * io, const void * buf, unsigned long n) {
+    struct elevator * const elv = (void*)io - offsetof(struct elevator, io_intf);
+    return iowrite(elv->dev, buf, n);
+}
+
+int elv_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct elevator * const elv = (void*)io - offsetof(struct elevator, io_intf);
+
+    if (cmd == IOCTL_GETELVSTATS) {
+        *(struct elevator_stats *)arg = elv->stats;
+        return 0;
+    }
+
+    return ioctl(elv->dev, cmd, arg);
+}
+
+long elv_readat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz)
+{
+    struct elevator * const elv = (void*)io - offsetof(struct elevator, io_intf);
+    return elv_rw(elv, IO_REQ_READ, pos, buf, bufsz);
+}
+
+long elv_writeat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long n)
+{
+    struct elevator * const elv = (void*)io - offsetof(struct elevator, io_intf);
+    return elv_rw(elv, IO_REQ_WRITE, pos, (void *)buf, n);
+}
+
+int elv_submit(struct io_intf * io, struct io_request * req) {
+    // input:
+    //  io: the io interface of the elevator
+    //  req: the asynchronous request to start
+    //
+    // output:
+    //  return 0 if the request was started, relative errcode otherwise
+    //
+    // side effect:
+    //  Queues the request in an entry of the elevator, where it is sorted and
+    //  merged like a synchronous one, and completes it when its run
+    //  completes. Requests that cannot be queued (unaligned, with data
+    //  outside RAM, or finding every entry taken) go to the device as they
+    //  are.
+
+    struct elevator * const elv = (void*)io - offsetof(struct elevator, io_intf);
+    struct elv_req * areq;
+    unsigned int i;
+    int ok;
+    int s;
+
+    ok = ((req->op == IO_REQ_READ || req->op == IO_REQ_WRITE) && req->len != 0
+        && req->pos % elv->blksz == 0 && req->len % elv->blksz == 0);
+
+    if (req->nsegs == 0)
+        ok = ok && elv_in_ram(req->buf, req->len);
+    for (i = 0; ok && i < req->nsegs; i++)
+        ok = elv_in_ram(req->segs[i].buf, req->segs[i].len);
+
+    s = intr_disable();
+
+    areq = elv->async_free;
+    if (!ok || areq == NULL) {
+        elv->stats.bypassed++;
+        intr_restore(s);
+        return iosubmit(elv->dev, req);
+    }
+
+    elv->async_free = areq->next;
+    *areq = (struct elv_req){
+        .op = req->op,
+        .pos = req->pos,
+        .buf = req->buf,
+        .segs = req->segs,
+        .nsegs = req->nsegs,
+        .len = req->len,
+        .deadline = tick_10Hz_count
+            + ((req->op == IO_REQ_READ) ? ELV_READ_EXPIRE : ELV_WRITE_EXPIRE),
+        .ioreq = req
+    };
+
+    elv_enqueue(elv, areq);
+    intr_restore(s);
+    return 0;
+}
+
+long elv_rw (
+    struct elevator * elv, int op, uint64_t pos, void * buf, unsigned long len)
+{
+    // input:
+    //  elv: the elevator
+    //  op: IO_REQ_READ or IO_REQ_WRITE
+    //  pos: the byte offset on the device
+    //  buf: the buffer to read into or write from
+    //  len: the number of bytes to transfer
+    //
+    // output:
+    //  return the number of bytes transferred or a negative error code
+    //
+    // side effect:
+    //  Queues the request and sleeps until it is done. The queue is dispatched
+    //  by the threads that queue requests and by the completion of each
+    //  request, so no thread is dedicated to the elevator.
+
+    struct elv_req req;
+    int s;
+
+    // A merged request hands the device the buffers of all its members, and
+    // the thread that dispatches it need not be the one that owns them, so
+    // only buffers every thread can address are queued. User buffers (read
+    // straight into by bcache_read_direct) and unaligned requests go to the
+    // device as they are.
+
+    if (len == 0 || pos % elv->blksz != 0 || len % elv->blksz != 0
+        || !elv_in_ram(buf, len))
+    {
+        elv->stats.bypassed++;
+        if (op == IO_REQ_READ)
+            return ioreadat(elv->dev, pos, buf, len);
+        else
+            return iowriteat(elv->dev, pos, buf, len);
+    }
+
+    req = (struct elv_req){
+        .op = op,
+        .pos = pos,
+        .buf = buf,
+        .len = len,
+        .deadline = tick_10Hz_count
+            + ((op == IO_REQ_READ) ? ELV_READ_EXPIRE : ELV_WRITE_EXPIRE)
+    };
+
+    s = intr_disable();
+
+    elv_enqueue(elv, &req);
+    while (!req.done)
+        condition_wait(&elv->changed);
+
+    intr_restore(s);
+    return req.result;
+}
+
+int elv_in_ram(const void * buf, unsigned long len) {
+    return (RAM_START <= buf && buf < RAM_END
+        && len <= (unsigned long)(RAM_END - buf));
+}
+
+void elv_enqueue(struct elevator * elv, struct elv_req * req) {
+    // Counts and queues a request, with interrupts disabled. A request that
+    // finds the device idle, or no other request queued, is dispatched at
+    // once. Otherwise the device is busy and the queue is plugged: the
+    // request waits for others to merge with until ELV_PLUG_MAX requests are
+    // queued or a request completes and dispatches the queue.
+
+    if (req->op == IO_REQ_READ)
+        elv->stats.reads++;
+    else
+        elv->stats.writes++;
+    elv_insert(elv, req);
+
+    if (elv->inflight == 0 || elv->queued == 1 || ELV_PLUG_MAX <= elv->queued)
+        elv_dispatch(elv);
+}
+
+void elv_insert(struct elevator * elv, struct elv_req * req) {
+    // Keeps the queue sorted by position; requests for the same position
+    // stay in the order they arrived.
+
+    struct elv_req ** link = &elv->queue;
+
+    while (*link != NULL && (*link)->pos <= req->pos)
+        link = &(*link)->next;
+
+    req->next = *link;
+    *link = req;
+    elv->queued++;
+}
+
+struct elv_req ** elv_pick(struct elevator * elv) {
+    // Returns the link to the request to dispatch next: the expired request
+    // with the earliest deadline, reads before writes, or else the first
+    // request at or past the sweep position, wrapping around to the lowest.
+
+    const uint64_t now = tick_10Hz_count;
+    struct elv_req ** best = NULL;
+    struct elv_req ** link;
+    int op;
+
+    for (op = IO_REQ_READ; op <= IO_REQ_WRITE; op++) {
+        for (link = &elv->queue; *link != NULL; link = &(*link)->next) {
+            if ((*link)->op == op && (*link)->deadline <= now
+                && (best == NULL || (*link)->deadline < (*best)->deadline))
+            {
+                best = link;
+            }
+        }
+
+        if (best != NULL) {
+            elv->stats.expired++;
+            return best;
+        }
+    }
+
+    for (link = &elv->queue; *link != NULL; link = &(*link)->next) {
+        if ((*link)->pos >= elv->next_pos)
+            return link;
+    }
+
+    return &elv->queue;
+}
+
+void elv_dispatch(struct elevator * elv) {
+    // Hands queued requests to the device until it has ELV_MAX_INFLIGHT of
+    // ours. Each request is extended with the queued requests of the same
+    // kind that continue it, up to ELV_MERGE_MAX bytes and ELV_MAX_SEGS
+    // buffers. Called with interrupts disabled, also from the completion of a
+    // run; a call made while the queue is being dispatched returns at once,
+    // since the loop of the dispatching call picks up the change.
+
+    struct elv_req ** link;
+    struct elv_req * first;
+    struct elv_req * last;
+    struct elv_req * req;
+    struct elv_run * run;
+    unsigned long len;
+    unsigned int nsegs;
+    int i;
+
+    if (elv->dispatching)
+        return;
+
+    elv->dispatching = 1;
+
+    while (elv->queue != NULL && elv->inflight < ELV_MAX_INFLIGHT) {
+        link = elv_pick(elv);
+        first = *link;
+        last = first;
+        len = first->len;
+        nsegs = (first->nsegs != 0) ? first->nsegs : 1;
+
+        while (last->next != NULL && last->next->op == first->op
+            && last->next->pos == first->pos + len
+            && last->next->len <= ELV_MERGE_MAX - len
+            && nsegs + ((last->next->nsegs != 0) ? last->next->nsegs : 1)
+                <= ELV_MAX_SEGS)
+        {
+            last = last->next;
+            len += last->len;
+            nsegs += (last->nsegs != 0) ? last->nsegs : 1;
+            elv->queued--;
+            elv->stats.merged++;
+        }
+
+        *link = last->next;
+        last->next = NULL;
+        elv->next_pos = first->pos + len;
+
+        for (i = 0; elv->runs[i].members != NULL; i++)
+            continue;
+        run = &elv->runs[i];
+        run->members = first;
+        elv->queued--;
+        elv->inflight++;
+
+        run->req = (struct io_request){
+            .op = first->op,
+            .pos = first->pos,
+            .len = len,
+            .done = elv_run_done,
+            .aux = run
+        };
+
+        if (first == last) {
+            run->req.buf = first->buf;
+            run->req.segs = first->segs;
+            run->req.nsegs = first->nsegs;
+        } else {
+            for (req = first, i = 0; req != NULL; req = req->next) {
+                if (req->nsegs == 0) {
+                    run->segs[i++] = (struct io_seg){
+                        .buf = req->buf,
+                        .len = req->len
+                    };
+                } else {
+                    memcpy(&run->segs[i], req->segs,
+                        req->nsegs * sizeof(struct io_seg));
+                    i += req->nsegs;
+                }
+            }
+            run->req.segs = run->segs;
+            run->req.nsegs = i;
+        }
+
+        elv->stats.dispatched++;
+
+        i = iosubmit(elv->dev, &run->req);
+        if (i != 0)
+            iocomplete(&run->req, i);
+    }
+
+    elv->dispatching = 0;
+}
+
+void elv_run_done(struct io_request * ioreq) {
+    // Completion of a run, possibly in an ISR. Splits the result among the
+    // members, completes the asynchronous ones and returns their entries,
+    // wakes the threads of the others and dispatches the queue.
+
+    struct elv_run * const run = ioreq->aux;
+    struct elevator * const elv = run->elv;
+    const long result = ioreq->result;
+    struct elv_req * req;
+    struct elv_req * next;
+    unsigned long off;
+
+    for (req = run->members; req != NULL; req = next) {
+        next = req->next;
+        off = req->pos - ioreq->pos;
+
+        if (result < 0)
+            req->result = result;
+        else if ((unsigned long)result <= off)
+            req->result = 0;
+        else if ((unsigned long)result - off < req->len)
+            req->result = result - off;
+        else
+            req->result = req->len;
+
+        if (req->ioreq != NULL) {
+            iocomplete(req->ioreq, req->result);
+            req->next = elv->async_free;
+            elv->async_free = req;
+        } else {
+            req->done = 1;
+        }
+    }
+
+    run->members = NULL;
+    elv->inflight--;
+
+    condition_broadcast(&elv->changed);
+    elv_dispatch(elv);
+}
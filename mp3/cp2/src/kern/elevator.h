@@ -0,0 +1,142 @@
+// elevator.h - Block request scheduler
+//
+// An elevator sits between a file system and its block device. Reads and
+// writes from different threads, and asynchronous requests such as block
+// cache fills, are queued in sector order, requests that continue one
+// another are merged into a single device request, and the queue is
+// dispatched in one sweep across the disk (C-SCAN). Every request
+// carries a deadline, reads a much shorter one than writes, and a request
+// whose deadline has passed is dispatched next, so that a steady stream of
+// write-back cannot starve readers.
+
+#ifndef _ELEVATOR_H_
+#define _ELEVATOR_H_
+
+#include "io.h"
+#include "thread.h"
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// ELV_MERGE_MAX is the largest number of bytes dispatched by one merged
+// request, and ELV_MAX_SEGS the largest number of buffer segments it
+// gathers. A merged request hands the device the buffers of its members as
+// they are, so nothing is copied.
+
+#ifndef ELV_MERGE_MAX
+#define ELV_MERGE_MAX (16 * 4096)
+#endif
+
+#ifndef ELV_MAX_SEGS
+#define ELV_MAX_SEGS 16
+#endif
+
+// ELV_MAX_INFLIGHT is the number of requests handed to the device at a time.
+// Further requests wait in the elevator, where they can still be merged and
+// sorted.
+
+#ifndef ELV_MAX_INFLIGHT
+#define ELV_MAX_INFLIGHT 4
+#endif
+
+// ELV_PLUG_MAX bounds plugging: while the device is busy, a request that
+// finds others queued is held back for merging until this many requests are
+// queued or a request completes.
+
+#ifndef ELV_PLUG_MAX
+#define ELV_PLUG_MAX 8
+#endif
+
+// ELV_NASYNC is the number of asynchronous requests that can be queued at a
+// time. Further ones go to the device as they are.
+
+#ifndef ELV_NASYNC
+#define ELV_NASYNC 16
+#endif
+
+// Deadlines of reads and writes, in ticks of the 10 Hz timer.
+
+#ifndef ELV_READ_EXPIRE
+#define ELV_READ_EXPIRE 5
+#endif
+
+#ifndef ELV_WRITE_EXPIRE
+#define ELV_WRITE_EXPIRE 50
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// Scheduler statistics, returned by the IOCTL_GETELVSTATS ioctl.
+
+struct elevator_stats {
+    uint64_t reads;      // read requests queued, synchronous or not
+    uint64_t writes;     // write requests queued, synchronous or not
+    uint64_t merged;     // requests merged into another request
+    uint64_t dispatched; // requests issued to the device
+    uint64_t expired;    // dispatches started by a missed deadline
+    uint64_t bypassed;   // requests passed straight to the device
+};
+
+// A read or write waiting in the elevator. A synchronous request lives on
+// the stack of the thread that issued it, which sleeps until /done/ is set.
+// An asynchronous request /ioreq/ is queued in an entry taken from the
+// elevator, and is completed when its run completes.
+
+struct elv_req {
+    int op;
+    uint64_t pos;
+    void * buf;
+    const struct io_seg * segs; // the data, if nsegs is not 0
+    unsigned int nsegs;
+    unsigned long len;
+    uint64_t deadline; // in ticks of the 10 Hz timer
+    struct io_request * ioreq;  // NULL for a synchronous request
+
+    struct elv_req * next;
+    long result;
+    int done;
+};
+
+// A merged request in flight. The /req/ member is submitted to the device;
+// its data is the buffers of the members, listed in /segs/.
+
+struct elv_run {
+    struct io_request req;
+    struct elevator * elv;
+    struct elv_req * members; // in sector order
+    struct io_seg segs[ELV_MAX_SEGS];
+};
+
+struct elevator {
+    struct io_intf io_intf;
+    struct io_intf * dev;
+    uint32_t blksz;
+
+    struct elv_req * queue; // in sector order
+    uint32_t queued;        // requests in the queue
+    uint64_t next_pos;      // where the sweep continues
+    int dispatching;
+    int inflight;
+    struct condition changed;
+
+    struct elv_run runs[ELV_MAX_INFLIGHT];
+    struct elv_req async[ELV_NASYNC];
+    struct elv_req * async_free;
+
+    struct elevator_stats stats;
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// struct io_intf * elevator_init(struct elevator * elv, struct io_intf * dev)
+// Initializes an elevator in front of block device /dev/ and returns its I/O
+// interface, which is used in place of the device's. Closing the elevator
+// closes the device.
+
+extern struct io_intf * elevator_init(struct elevator * elv, struct io_intf * dev);
+
+#endif // _ELEVATOR_H_
@@ -2,6 +2,7 @@
 //
 
 #include "trap.h"
+#include "config.h"
 #include "csr.h"
 #include "halt.h"
 #include "memory.h"
@@ -46,6 +47,24 @@ static const char * const excp_names[] = {
 
 void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
     trace("smode_excp_handler(%d, %p)", code, tfr);
+    const uintptr_t addr = csrr_stval();
+
+    // The kernel reads and writes user buffers in place (sstatus.SUM is set),
+    // so it faults on the pages the process has not touched yet, and on the
+    // read-only pages of private file mappings. They are handled as if the
+    // process had faulted; the trap returns to the faulting instruction.
+    switch (code) {
+        case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+        case RISCV_SCAUSE_STORE_PAGE_FAULT:
+            if (USER_START_VMA <= addr && addr < USER_END_VMA) {
+                memory_handle_page_fault((void*)addr);
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+
 	default_excp_handler(code, tfr);
 }
 
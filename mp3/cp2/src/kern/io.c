@@ -4,6 +4,7 @@
 #include "io.h"
 #include "string.h"
 #include "error.h"
+#include "thread.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -30,6 +31,10 @@ static void iolit_close(struct io_intf * io);
 static long iolit_read(struct io_intf * io, void * buf, size_t len);
 static long iolit_write(struct io_intf * io, const void * buf, size_t len);
 static int iolit_ioctl(struct io_intf * io, int cmd, void * arg);
+static long iolit_readat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long len);
+static long iolit_writeat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long len);
 
 //           EXPORTED FUNCTION DEFINITIONS
 //          
@@ -70,6 +75,92 @@ long iowrite(struct io_intf * io, const void * buf, unsigned long n) {
     return acc;
 }
 
+long ioreadat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz)
+{
+    long cnt, acc = 0;
+
+    if (io->ops->readat == NULL)
+        return -ENOTSUP;
+
+    while (acc < bufsz) {
+        cnt = io->ops->readat(io, pos+acc, buf+acc, bufsz-acc);
+        if (cnt < 0)
+            return cnt;
+        else if (cnt == 0)
+            return acc;
+        acc += cnt;
+    }
+
+    return acc;
+}
+
+long iowriteat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long n)
+{
+    long cnt, acc = 0;
+
+    if (io->ops->writeat == NULL)
+        return -ENOTSUP;
+
+    while (acc < n) {
+        cnt = io->ops->writeat(io, pos+acc, buf+acc, n-acc);
+        if (cnt < 0)
+            return cnt;
+        else if (cnt == 0)
+            return acc;
+        acc += cnt;
+    }
+
+    return acc;
+}
+
+int iosubmit(struct io_intf * io, struct io_request * req) {
+    const struct io_seg whole = { .buf = req->buf, .len = req->len };
+    const struct io_seg * const segs = (req->nsegs != 0) ? req->segs : &whole;
+    const unsigned int nsegs = (req->nsegs != 0) ? req->nsegs : 1;
+    unsigned int i;
+    long result, cnt;
+
+    req->complete = 0;
+    if (io->ops->submit != NULL)
+        return io->ops->submit(io, req);
+    if (req->op != IO_REQ_READ && req->op != IO_REQ_WRITE)
+        return -EINVAL;
+
+    //           no asynchronous I/O: transfer the data now, a segment at a time, and
+    //           complete at once. A short transfer or an error ends the request.
+    result = 0;
+    for (i = 0; i < nsegs; i++) {
+        if (req->op == IO_REQ_READ)
+            cnt = ioreadat(io, req->pos + result, segs[i].buf, segs[i].len);
+        else
+            cnt = iowriteat(io, req->pos + result, segs[i].buf, segs[i].len);
+
+        if (cnt == -ENOTSUP)
+            return cnt;
+        if (cnt < 0) {
+            result = cnt;
+            break;
+        }
+        result += cnt;
+        if (cnt != segs[i].len)
+            break;
+    }
+
+    iocomplete(req, result);
+    return 0;
+}
+
+void iocomplete(struct io_request * req, long result) {
+    req->result = result;
+    req->complete = 1;
+    if (req->done != NULL)
+        req->done(req);
+    if (req->cond != NULL)
+        condition_broadcast(req->cond);
+}
+
 //           Initialize an io_lit. This function should be called with an io_lit, a buffer, and the size of the device.
 //           It should set up all fields within the io_lit struct so that I/O operations can be performed on the io_lit
 //           through the io_intf interface. This function should return a pointer to an io_intf object that can be used 
@@ -83,7 +174,9 @@ struct io_intf * iolit_init (
         .close = iolit_close,
         .read = iolit_read,
         .write = iolit_write,
-        .ctl = iolit_ioctl
+        .ctl = iolit_ioctl,
+        .readat = iolit_readat,
+        .writeat = iolit_writeat
     };
     lit->buf = buf;
     lit->size = size;
@@ -98,27 +191,55 @@ void iolit_close(struct io_intf * io) {
 }
 
 long iolit_read(struct io_intf * io, void * buf, size_t len) {
+    struct io_lit * const lit = (void*)io - offsetof(struct io_lit, io_intf);
+    long n;
+
+    n = iolit_readat(io, lit->pos, buf, len);
+    if (n > 0)
+        lit->pos += n;
+
+    return n;
+}
+
+long iolit_write(struct io_intf * io, const void * buf, size_t len) {
+    struct io_lit * const lit = (void*)io - offsetof(struct io_lit, io_intf);
+    long n;
+
+    n = iolit_writeat(io, lit->pos, buf, len);
+    if (n > 0)
+        lit->pos += n;
+
+    return n;
+}
+
+long iolit_readat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long len)
+{
     struct io_lit * const lit = (void*)io - offsetof(struct io_lit, io_intf);
     size_t n = len;
 
-    if (lit->pos + n > lit->size)
-        n = lit->size - lit->pos;
+    if (pos > lit->size)
+        return -EINVAL;
+    if (pos + n > lit->size)
+        n = lit->size - pos;
 
-    memcpy(buf, lit->buf + lit->pos, n);
-    lit->pos += n;
+    memcpy(buf, lit->buf + pos, n);
 
     return n;
 }
 
-long iolit_write(struct io_intf * io, const void * buf, size_t len) {
+long iolit_writeat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long len)
+{
     struct io_lit * const lit = (void*)io - offsetof(struct io_lit, io_intf);
     size_t n = len;
 
-    if (lit->pos + n > lit->size)
-        n = lit->size - lit->pos;
+    if (pos > lit->size)
+        return -EINVAL;
+    if (pos + n > lit->size)
+        n = lit->size - pos;
 
-    memcpy(lit->buf + lit->pos, buf, n);
-    lit->pos += n;
+    memcpy(lit->buf + pos, buf, n);
 
     return n;
 }
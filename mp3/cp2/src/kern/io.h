@@ -19,6 +19,8 @@
 
 //           forward decl.
 struct io_intf;
+struct io_request;
+struct condition;
 
 //           I/O operations provided by the interface. Do not call these directly, use the
 //           function below instead (e.g. ioread). The /read/ function is allowed to read
@@ -26,19 +28,70 @@ struct io_intf;
 //           from /read/ indicates an end-of-file condition. The /write/ function is
 //           allowed to write fewer than /n/ bytes, but must write at least one. A return
 //           value of 0 from /write/ indicates an end-of-file condition (for files that
-//           cannot grow).
+//           cannot grow). The optional /readat/ and /writeat/ functions behave like
+//           /read/ and /write/, but transfer data at offset /pos/ and neither use nor
+//           update the current position of the object. The optional /submit/ function
+//           starts an asynchronous transfer (see struct io_request below) and returns
+//           without waiting for it: 0 if the request was queued, in which case it is
+//           completed later with iocomplete, or a negative error code if it was not.
 
 struct io_ops {
 	void (*close)(struct io_intf * io);
 	long (*read)(struct io_intf * io, void * buf, unsigned long bufsz);
 	long (*write)(struct io_intf * io, const void * buf, unsigned long n);
 	int (*ctl)(struct io_intf * io, int cmd, void * arg);
+	long (*readat)(struct io_intf * io, uint64_t pos,
+		void * buf, unsigned long bufsz);
+	long (*writeat)(struct io_intf * io, uint64_t pos,
+		const void * buf, unsigned long n);
+	int (*submit)(struct io_intf * io, struct io_request * req);
 };
 
 struct io_intf {
 	const struct io_ops * ops;
 };
 
+//           A segment of the data of a request: /len/ bytes at /buf/.
+
+struct io_seg {
+    void * buf;
+    unsigned long len;
+};
+
+//           An asynchronous transfer of /len/ bytes at offset /pos/, started with
+//           iosubmit. The data is at /buf/ or, if /nsegs/ is not 0, in the /nsegs/
+//           segments /segs/ in order, whose lengths add up to /len/; segments let one
+//           request gather buffers that are not contiguous, such as cache blocks. The
+//           submitter fills in the fields up to /cond/ and keeps the request, the segments
+//           and the data alive until /complete/ is set. On completion /result/ holds the
+//           number of bytes transferred or a negative error code, /complete/ is set, /done/
+//           is called if it is not NULL and /cond/ is broadcast if it is not NULL.
+//           Completion may run in an ISR, so /done/ must not sleep and the data must be at
+//           kernel addresses rather than user ones.
+
+struct io_request {
+    int op;                 //           IO_REQ_READ or IO_REQ_WRITE
+    uint64_t pos;
+    void * buf;
+    unsigned long len;
+    const struct io_seg * segs;
+    unsigned int nsegs;
+    void (*done)(struct io_request * req);
+    void * aux;             //           for the submitter's use
+    struct condition * cond;
+
+    volatile long result;
+    volatile int complete;
+
+    //           for the use of the driver the request is submitted to
+    struct io_request * next;
+    unsigned long queued;
+    unsigned int inflight;
+};
+
+#define IO_REQ_READ     0
+#define IO_REQ_WRITE    1
+
 struct io_lit {
     struct io_intf io_intf;
     void * buf;
@@ -71,9 +124,34 @@ struct io_term {
 //             some devices (e.g. UART). See ioseek() functions, which is a wrapper around
 //             this ioctl operation.
 //          
-//             IOCTL_FLUSH - Current not supported (do not need to implement).
+//             IOCTL_FLUSH - Writes buffered data back to the underlying device. Files
+//             cache writes until they are flushed, closed or evicted from the cache.
 //          
 //             IOCTL_GETBLKSZ - Returns the block size. Optional.
+//          
+//             IOCTL_GETBCSTATS - Returns the block cache hit/miss counters (see
+//             bcache.h). Supported by files.
+//          
+//             IOCTL_GETRA - Gets the maximum readahead window of a file, in blocks.
+//          
+//             IOCTL_SETRA - Sets the maximum readahead window of a file, in blocks. A value
+//             of 0 disables readahead.
+//          
+//             IOCTL_GETPOLL - Gets the polling budget of a block device, in spin iterations.
+//          
+//             IOCTL_SETPOLL - Sets the polling budget of a block device. A thread waiting
+//             for a request polls the device for up to that many iterations before it
+//             sleeps until the completion interrupt. A value of 0 (the default) always
+//             sleeps.
+//          
+//             IOCTL_GETPOLLSTATS - Returns the polling counters of a block device (see
+//             struct io_poll_stats below).
+//             The three polling ioctls are also accepted by files, which pass them on to
+//             the device of their file system.
+//          
+//             IOCTL_GETELVSTATS - Returns the request merging and dispatch counters of a
+//             block device scheduled by an elevator (see elevator.h). Files pass it on to
+//             the device of their file system.
 
 //           arg is pointer to uint64_t
 #define IOCTL_GETLEN        1
@@ -87,6 +165,30 @@ struct io_term {
 #define IOCTL_FLUSH         5
 //           arg is pointer to uint32_t
 #define IOCTL_GETBLKSZ      6
+//           arg is pointer to struct bcache_stats
+#define IOCTL_GETBCSTATS    8
+//           arg is pointer to uint32_t
+#define IOCTL_GETRA         9
+//           arg is pointer to uint32_t
+#define IOCTL_SETRA         10
+//           arg is pointer to uint32_t
+#define IOCTL_GETPOLL       11
+//           arg is pointer to uint32_t
+#define IOCTL_SETPOLL       12
+//           arg is pointer to struct io_poll_stats
+#define IOCTL_GETPOLLSTATS  13
+//           arg is pointer to struct elevator_stats
+#define IOCTL_GETELVSTATS   14
+
+//           Counters of a block device's polled waits (IOCTL_GETPOLLSTATS).
+
+struct io_poll_stats {
+    uint64_t polls;         //           waits that started by polling
+    uint64_t poll_hits;     //           of those, completed while polling
+    uint64_t poll_misses;   //           of those, fell back to sleeping
+    uint64_t spins;         //           polling iterations, over all polls
+    uint64_t sleeps;        //           waits that slept, with or without polling
+};
 
 //           EXPORTED FUNCTION DECLARATIONS
 //          
@@ -132,6 +234,48 @@ extern long
 __attribute__ ((nonnull(1,2)))
 iowrite(struct io_intf * io, const void * buf, unsigned long n);
 
+//           The ioreadat and iowriteat functions read and write data at offset /pos/ of
+//           the I/O object without using its current position, so that several threads
+//           can share the object without seeking. They do not return until /bufsz/
+//           (/n/) bytes are transferred or the end of file is reached. Negative return
+//           values signal an error; -ENOTSUP if the object has no positional I/O.
+
+extern long
+__attribute__ ((nonnull(1,3)))
+ioreadat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz);
+
+extern long
+__attribute__ ((nonnull(1,3)))
+iowriteat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long n);
+
+//           The iosubmit function starts the asynchronous transfer /req/ and returns
+//           without waiting for it to finish. It returns 0 if the request was started, in
+//           which case its completion is always signaled, or a negative error code if it
+//           was not. Objects without a /submit/ operation but with positional I/O
+//           transfer the data synchronously and complete the request before returning.
+//           The iocomplete function is called by drivers (including from an ISR) to
+//           signal the completion of a request with the given result.
+
+extern int
+__attribute__ ((nonnull(1,2)))
+iosubmit(struct io_intf * io, struct io_request * req);
+
+extern void
+__attribute__ ((nonnull(1)))
+iocomplete(struct io_request * req, long result);
+
+//           The ioseg_at function returns the address of byte /off/ of the data held by the
+//           segments /segs/, in order, and stores in /*lenptr/ the number of bytes that
+//           follow it in the same segment. /off/ must be less than the total length of the
+//           segments.
+
+static inline void *
+__attribute__ ((nonnull(1,3)))
+ioseg_at (
+    const struct io_seg * segs, unsigned long off, unsigned long * lenptr);
+
 //           The ioctl function invokes special functions on the I/O object. See the IOCTL
 //           numbers defined above.
 
@@ -234,6 +378,16 @@ static inline int ioseek(struct io_intf * io, uint64_t pos) {
     return ioctl(io, IOCTL_SETPOS, &pos);
 }
 
+static inline void * ioseg_at (
+    const struct io_seg * segs, unsigned long off, unsigned long * lenptr)
+{
+    while (segs->len <= off)
+        off -= (segs++)->len;
+
+    *lenptr = segs->len - off;
+    return segs->buf + off;
+}
+
 static inline int ioputc(struct io_intf * io, char c) {
     long wlen;
 
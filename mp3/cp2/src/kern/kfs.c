@@ -8,6 +8,10 @@
 #include "kfs.h"
 #include "console.h"
 #include "heap.h"
+#include "memory.h"
+#include "bcache.h"
+#include "thread.h"
+#include "timer.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -22,10 +26,26 @@ const struct io_ops fs_io_ops = {
     .ctl = fs_ioctl
 };
 static struct fs fs;
-static struct file_desc file_descs[MAX_FILE_DESC];
-static uint64_t start_of_data_blks;
+static struct file_desc* free_descs;  // unused entries of the file_desc pool
+static uint32_t mount_gen;              // bumped by every fs_mount
+static struct fs_page page_cache[FS_PAGE_CACHE_SIZE];
+static uint32_t page_clock;             // next page_cache slot to consider for reuse
+static uint64_t start_of_data_blks;    // block number of data block 0
+static char flusher_started;
 //           INTERNAL FUNCTION DECLARATIONS
 //          
+static uint32_t name_hash(const char* name, size_t* len);
+static void fs_flusher(void* arg);
+static long fs_read_locked(struct file_desc* desc, void* buf, unsigned long n);
+static long fs_write_locked(struct file_desc* desc, const void* buf, unsigned long n);
+static long fs_read_compressed(struct file_desc* desc, void* buf, unsigned long n);
+static int read_stored(const struct inode_info* inode, uint32_t pos, void* dst, uint32_t len);
+static long lz4_decompress(const uint8_t* src, uint32_t srclen, uint8_t* dst, uint32_t dstlen);
+static uint64_t inode_bmap(const struct inode_info* inode, uint32_t fblk, uint32_t* run);
+static int add_extent(struct inode_info* info, uint32_t start, uint32_t len);
+static uint32_t alloc_at(uint32_t start, uint32_t want);
+static uint32_t alloc_any(uint32_t want, uint32_t* start);
+static void mark_blks(uint32_t start, uint32_t len, int used);
 
 
 //           EXPORTED FUNCTION DEFINITIONS
@@ -38,6 +58,7 @@ extern void fs_init(void){
     //     none
     // side effect:
     // Initializes the filesystem. This function should be called once at boot time.
+    lock_init(&fs.lock, "kfs");
     fs_initialized = FS_INITIALIZED;
     kprintf("fs_init: fs initialized\n");
 }
@@ -45,28 +66,104 @@ extern int fs_mount(struct io_intf* io){
     // input:
     //     io: the io interface to the block device
     // output:
-    //     return 0 on success, -1 on failure
+    //     return 0 on success, relative errcode on failure
     // side effect:
     // Takes an io intf* to the filesystem provider and sets up the filesystem for future fs open operations.
     // Once you complete this checkpoint, io will come from the vioblk device struct.
 
-    if(io == NULL || io->ops == NULL || io->ops->ctl == NULL|| io->ops->read == NULL || io->ops->write == NULL){
+    if(io == NULL || io->ops == NULL || io->ops->ctl == NULL|| io->ops->readat == NULL || io->ops->writeat == NULL){
         kprintf("fs_mount: invalid io\n");
         return -EINVAL;
     }
-    // initialize the device
-    struct boot_blk boot_blk;
-    uint64_t pos = POS_BOOT_BLK;
-    ioseek(io, pos);
-    ioread_full(io, (void*)&boot_blk, SIZE_OF_4K_BLK);
+    // all block I/O goes through the block cache; write back and drop anything
+    // left over from a previous mount of the same device
+    if (!bcache_initialized)
+        bcache_init();
+    bcache_flush(io);
+    bcache_invalidate(io);
+
+    // the new tables are built aside and only replace those of the mounted
+    // fs once all of them are loaded, so a failed mount changes nothing; the
+    // boot block stays pinned in the cache until then
+    struct bcache_blk * blk = bcache_get(io, POS_BOOT_BLK);
+    if (blk == NULL){
+        kprintf("fs_mount: failed to read boot block\n");
+        return -EIO;
+    }
+    const struct boot_blk* boot = (const struct boot_blk*)blk->data;
+
+    // v1 images have one 4K inode per file, v2 images pack several inodes
+    // into a block; the data blocks follow the inodes
+    uint32_t version;
+    uint64_t data_start;
+    if (boot->magic != KFS_MAGIC){
+        version = 1;
+        data_start = START_IDX_OF_INODE + boot->num_inodes;
+    }else if (boot->version == KFS_VERSION_2){
+        version = KFS_VERSION_2;
+        data_start = START_IDX_OF_INODE +
+            (boot->num_inodes + KFS2_INODES_PER_BLK - 1) / KFS2_INODES_PER_BLK;
+    }else{
+        kprintf("fs_mount: unknown kfs version %d\n", (int)boot->version);
+        bcache_release(blk);
+        return -EBADFMT;
+    }
+
+    struct inode_info* inodes = NULL;
+    uint16_t* dir_index = NULL;
+    uint32_t dir_index_mask = 0;
+    uint8_t* blk_map = NULL;
+    uint32_t map_nblks = 0;
+    int result = load_inode_table(io, boot, version, &inodes);
+    if (result != 0){
+        kprintf("fs_mount: failed to load inodes\n");
+        bcache_release(blk);
+        return result;
+    }
+    result = build_dir_index(boot, &dir_index, &dir_index_mask);
+    if (result == 0){
+        result = load_blk_map(io, boot, data_start, inodes, &blk_map, &map_nblks);
+    }
+    if (result != 0){
+        kprintf("fs_mount: failed to build the directory index or block map\n");
+        kfree(dir_index);
+        free_inode_table(inodes, boot->num_inodes);
+        bcache_release(blk);
+        return result;
+    }
 
-    // create a new fs based on the boot block
+    // replace the tables of the previous mount
+    if (fs.inodes != NULL){
+        free_inode_table(fs.inodes, fs.boot_blk.num_inodes);
+    }
+    kfree(fs.dir_index);
+    kfree(fs.blk_map);
     fs.dev_io_intf = io;
-    fs.boot_blk = boot_blk;
-    start_of_data_blks = (fs.boot_blk.num_inodes+1) * SIZE_OF_4K_BLK;
-    for(int i = 0; i < MAX_FILE_DESC; i++){
-        file_descs[i] = (struct file_desc){0};
+    memcpy(&fs.boot_blk, boot, sizeof(struct boot_blk));
+    bcache_release(blk);
+    fs.version = version;
+    start_of_data_blks = data_start;
+    fs.inodes = inodes;
+    fs.dir_index = dir_index;
+    fs.dir_index_mask = dir_index_mask;
+    fs.blk_map = blk_map;
+    fs.map_nblks = map_nblks;
+    for (int i = 0; i < NEG_CACHE_SIZE; i++){
+        fs.neg_cache[i].valid = 0;
+    }
+    // files still open from an earlier mount become stale, and so do cached
+    // pages; pages still mapped are dropped when they are released
+    mount_gen++;
+    for(int i = 0; i < FS_PAGE_CACHE_SIZE; i++){
+        if (page_cache[i].page != NULL && page_cache[i].refcnt == 0){
+            memory_free_page(page_cache[i].page);
+            page_cache[i].page = NULL;
+        }
+        page_cache[i].ino = UINT32_MAX;
     }
+    // dirty blocks are written back periodically by a kernel thread
+    if (!flusher_started && thread_spawn("kfs_flush", fs_flusher, NULL) >= 0)
+        flusher_started = 1;
     //fs_initialized = FS_INITIALIZED;
     kprintf("fs_mount: fs mounted successfully\n");
     return 0;
@@ -88,33 +185,36 @@ extern int fs_open(const char* name, struct io_intf** io){
         return -EINVAL;
     }
     #endif
+    #ifdef KFS_ACCESS_TRACE
+    // open order, to be fed to mkfs -t
+    kprintf("kfs_trace: %s\n", name);
+    #endif
     // find the inode of the file
     uint32_t inodes = find_inode_by_name(name);
-    if(inodes == fs.boot_blk.num_inodes){
+    if(inodes >= fs.boot_blk.num_inodes){
         kprintf("fs_open: file not found\n");
         return -EBADFD;
     }
-    // read it
-    struct inode inode;
-    uint64_t inode_pos = SIZE_OF_4K_BLK * (START_IDX_OF_INODE + inodes);
-    ioseek(fs.dev_io_intf, inode_pos);
-    ioread_full(fs.dev_io_intf, (void*)&inode, SIZE_OF_4K_BLK);
-
-    // create a new file descriptor
-    struct io_intf* io_intf = (struct io_intf*)kmalloc(sizeof(struct io_intf));
-    if (io_intf == NULL){
-        kprintf("fs_open: kmalloc failed\n");
-        return -EINVAL;
+    // create a new file descriptor, the io_intf handed out is embedded in it
+    struct file_desc* desc = alloc_file_desc();
+    if (desc == NULL){
+        kprintf("fs_open: no free file descriptor\n");
+        return -EMFILE;
     }
-    io_intf->ops = &fs_io_ops;
-    int i = find_idle_file_desc();
-    file_descs[i].io_intf = io_intf;
-    file_descs[i].pos = FILE_START;
-    file_descs[i].size = (uint64_t)inode.length;
-    file_descs[i].inodes = (uint64_t)inodes;
-    file_descs[i].flag = FILE_IN_USE;
+    desc->io_intf.ops = &fs_io_ops;
+    desc->mount_gen = mount_gen;
+    desc->pos = FILE_START;
+    desc->inodes = (uint64_t)inodes;
+    desc->flag = FILE_IN_USE;
+    desc->ra_pos = FILE_START;
+    desc->ra_win = 0;
+    desc->ra_max = RA_DEFAULT_MAX_BLKS;
+    desc->ra_next = 0;
+    desc->ra_end = 0;
+    desc->wr_end = FILE_START;
+    fs.inodes[inodes].opens++;
     
-    *io = io_intf;
+    *io = &desc->io_intf;
     kprintf("fs_open: file opened successfully\n");
     return 0;
 }
@@ -125,25 +225,32 @@ void fs_close(struct io_intf* io){
     // output:
     //     none
     // side effect:
-    // Marks the file struct associated with io as unused
+    // Marks the file struct associated with io as unused and writes back the
+    // dirty blocks of the file system. The last close of a file returns the
+    // blocks reserved for its appends.
     /*
     if (fs_initialized != FS_INITIALIZED){
         kprintf("fs_close: fs not initialized");
         return;
     }*/
 
-    int current = find_file_desc_by_io(io);
-    if (current != MAX_FILE_DESC){
-        file_descs[current].flag = FILE_NOT_IN_USE;
-        // do we need to free the io_intf and desc?
-        kfree(file_descs[current].io_intf);
-        file_descs[current].io_intf = NULL;
+    // a file left open across a remount is still returned to the pool
+    struct file_desc* desc = (void*)io - offsetof(struct file_desc, io_intf);
+    if (desc->flag == FILE_IN_USE){
+        if (desc->mount_gen == mount_gen){
+            if (--fs.inodes[desc->inodes].opens == 0){
+                release_prealloc(desc->inodes);
+            }
+            if (bcache_flush(fs.dev_io_intf) != 0)
+                kprintf("fs_close: failed to write back dirty blocks\n");
+        }
+        free_file_desc(desc);
         
         kprintf("fs_close: file closed successfully\n");
         return;
     }
 
-    kprintf("fs_close: file with given io not found\n");
+    kprintf("fs_close: file with given io not open\n");
     return;
 }
 
@@ -164,21 +271,34 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n){
     }
 */
     // check if the file exists
-    int current = find_file_desc_by_io(io);
-    if (current == MAX_FILE_DESC){
-        kprintf("fs_read: file not found\n");
+    struct file_desc* desc = file_desc_of(io);
+    if (desc == NULL){
+        kprintf("fs_read: file not open\n");
         return -EBADFD;
     }
 
-    // check if the file is in use
-    if (file_descs[current].flag == FILE_NOT_IN_USE){
-        kprintf("fs_read: file not in use\n");
-        return -EIO;
-    }
+    // the inode lock serializes reads and writes of one file; different files
+    // are accessed concurrently
+    struct inode_info* inode = &fs.inodes[desc->inodes];
+    lock_acquire(&inode->lock);
+    long result = fs_read_locked(desc, buf, n);
+    lock_release(&inode->lock);
+    return result;
+}
+
+static long fs_read_locked(struct file_desc* desc, void* buf, unsigned long n){
+    // input:
+    //     desc: the open file to read, its inode lock held
+    //     buf: the buffer to read into
+    //     n: the number of bytes to read
+    // output:
+    //     return the number of bytes read on success, relative errcode on failure
+    // side effect:
+    // reads n bytes at the file position into buf and advances the position.
 
-    uint32_t inodes = file_descs[current].inodes;
-    uint32_t pos = file_descs[current].pos;
-    uint32_t size = file_descs[current].size;
+    uint32_t inodes = desc->inodes;
+    uint32_t pos = desc->pos;
+    uint32_t size = fs.inodes[inodes].length;
 
     // sanity check
     if (pos > size){
@@ -188,52 +308,139 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n){
         n = size - pos;
     }
 
-    // read the data blk index from the inode
-    struct inode inode;
-    uint64_t inode_pos = SIZE_OF_4K_BLK * (START_IDX_OF_INODE + inodes);
-    ioseek(fs.dev_io_intf, inode_pos);
-    ioread_full(fs.dev_io_intf, (void*)&inode, SIZE_OF_4K_BLK);
-    
     // get the index for the data blocks and offset
-    // also, the physical location for data blocks is hashed in inode.data_blks,
-    // not in order, access by reading the list
-    uint32_t num_blks = inode.length / SIZE_OF_4K_BLK + 1; // upper bound (e.g. if length < 4096)
-    // prevent unaligned warning
-    uint32_t data_blk_array[num_blks];
-    for (int i = 0; i < num_blks; i++){
-        data_blk_array[i] = inode.data_blks[i];
-    }
+    // the physical location of a block is found through the extents of the
+    // in-memory inode table
+    const struct inode_info* inode = &fs.inodes[inodes];
+    uint32_t num_blks = inode->num_blks;
     if(n == 0){
         return EOF;
     }
+    if (inode->flags & KFS2_INODE_COMPRESSED){
+        return fs_read_compressed(desc, buf, n);
+    }
     uint32_t start_blk = pos / SIZE_OF_4K_BLK;
     uint32_t start_offset = pos % SIZE_OF_4K_BLK;
     uint32_t end_blk = (pos + n - 1) / SIZE_OF_4K_BLK;
-    uint32_t end_offset = (pos + n - 1) % SIZE_OF_4K_BLK;
     // again, sanity check
     if (start_blk >= num_blks || end_blk >= num_blks){
         kprintf("fs_read: start_blk or end_blk >= num_blks\n");
         return -EINVAL;
     }
-    // read the data blocks one by one and copy the data to the buffer based on offset
-    long bytes_read = 0;    // this records the number of bytes read, as index in buf, incrment after each read
-    for(int i = start_blk; i <= end_blk; i++){
-        uint64_t data_blk_pos = start_of_data_blks + data_blk_array[i] * SIZE_OF_4K_BLK;
-        struct data_blk data_blk_crt;
-        ioseek(fs.dev_io_intf, data_blk_pos);
-        ioread_full(fs.dev_io_intf, (void*)&data_blk_crt, SIZE_OF_4K_BLK);
-            for(int j = start_offset; j < SIZE_OF_4K_BLK; j++){
-                // check if finish
-                if(i == end_blk && j == end_offset + 1){
-                    // break after last byte
+    fs_readahead(desc, pos, end_blk);
+
+    // whole blocks are read straight into buf, only a partial head or tail
+    // block is copied out of the block cache
+    long bytes_read = 0;    // this records the number of bytes read, as index in buf
+    uint32_t i = start_blk;
+    while (i <= end_blk){
+        uint32_t blk_offset = (i == start_blk) ? start_offset : 0;
+        uint32_t blk_bytes = SIZE_OF_4K_BLK - blk_offset;
+        if (blk_bytes > n - bytes_read){
+            blk_bytes = n - bytes_read;
+        }
+
+        uint32_t ext_run;
+        uint64_t dev_blk = inode_bmap(inode, i, &ext_run);
+        if (blk_bytes == SIZE_OF_4K_BLK){
+            // extend over the whole blocks left in this extent and read them
+            // with one request
+            uint32_t run = 1;
+            while (run < ext_run && i + run <= end_blk &&
+                   (run + 1) * SIZE_OF_4K_BLK <= n - bytes_read){
+                run++;
+            }
+            if (bcache_read_direct(fs.dev_io_intf, dev_blk, run, buf + bytes_read) != 0){
+                kprintf("fs_read: failed to read data blocks\n");
+                break;
+            }
+            bytes_read += run * SIZE_OF_4K_BLK;
+            i += run;
+        }else{
+            struct bcache_blk * blk = bcache_get(fs.dev_io_intf, dev_blk);
+            if (blk == NULL){
+                kprintf("fs_read: failed to read data block\n");
+                break;
+            }
+            memcpy(buf + bytes_read, blk->data + blk_offset, blk_bytes);
+            bcache_release(blk);
+            bytes_read += blk_bytes;
+            i++;
+        }
+    }
+    if (bytes_read == 0){
+        return -EIO;
+    }
+    desc->pos += bytes_read;
+    desc->ra_pos = desc->pos;
+    return bytes_read;
+}
+
+static long fs_read_compressed(struct file_desc* desc, void* buf, unsigned long n){
+    // input:
+    //     desc: the open compressed file to read, its inode lock held
+    //     buf: the buffer to read into
+    //     n: the number of bytes to read, non-zero and within the file
+    // output:
+    //     return the number of bytes read on success, relative errcode on failure
+    // side effect:
+    // reads n bytes at the file position into buf, decompressing the chunks
+    // they fall in, and advances the position. Whole chunks are decompressed
+    // straight into buf; a partially read chunk goes through the inode's zbuf
+    // so that small sequential reads decompress each chunk only once.
+
+    uint32_t ino = desc->inodes;
+    struct inode_info* inode = &fs.inodes[ino];
+    uint32_t pos = desc->pos;
+
+    if (inode->chunk_off == NULL){
+        int result = load_chunk_table(ino);
+        if (result != 0){
+            return result;
+        }
+    }
+    uint32_t first = pos / KFS_ZCHUNK_SIZE;
+    uint32_t last = (pos + n - 1) / KFS_ZCHUNK_SIZE;
+    // readahead works on the stored blocks, which the chunks map to in order
+    fs_readahead(desc, pos, (inode->chunk_off[last + 1] - 1) / SIZE_OF_4K_BLK);
+
+    long bytes_read = 0;
+    int result = 0;
+    for (uint32_t c = first; c <= last; c++){
+        uint32_t offset = (c == first) ? pos % KFS_ZCHUNK_SIZE : 0;
+        uint32_t len = KFS_ZCHUNK_SIZE - offset;
+        if (len > n - bytes_read){
+            len = n - bytes_read;
+        }
+
+        if (len == KFS_ZCHUNK_SIZE){
+            result = read_chunk(ino, c, buf + bytes_read);
+            if (result != 0){
+                break;
+            }
+        }else{
+            if (inode->zbuf == NULL){
+                inode->zbuf = memory_alloc_page();
+                inode->zbuf_chunk = UINT32_MAX;
+            }
+            if (inode->zbuf_chunk != c){
+                inode->zbuf_chunk = UINT32_MAX;
+                result = read_chunk(ino, c, inode->zbuf);
+                if (result != 0){
                     break;
                 }
-                *(char*)(buf + bytes_read) = data_blk_crt.data[j];
-                bytes_read++;
+                inode->zbuf_chunk = c;
             }
-            start_offset = 0; // reset the start offset for reading next block
+            memcpy(buf + bytes_read, inode->zbuf + offset, len);
+        }
+        bytes_read += len;
+    }
+    // a failure after some chunks were read shows up on the next read
+    if (bytes_read == 0){
+        return result;
     }
-    file_descs[current].pos += bytes_read;
+    desc->pos += bytes_read;
+    desc->ra_pos = desc->pos;
     return bytes_read;
 }
 
@@ -254,119 +461,132 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n){
     // }
 
     // check if the file exists
-    int current = find_file_desc_by_io(io);
-    if (current == MAX_FILE_DESC){
-        kprintf("fs_write: file not found\n");
+    struct file_desc* desc = file_desc_of(io);
+    if (desc == NULL){
+        kprintf("fs_write: file not open\n");
         return -EBADFD;
     }
 
-    // check if the file is in use
-    if (file_descs[current].flag == FILE_NOT_IN_USE){
-        kprintf("fs_write: file not in use\n");
-        return -EIO;
-    }
+    struct inode_info* inode = &fs.inodes[desc->inodes];
+    lock_acquire(&inode->lock);
+    long result = fs_write_locked(desc, buf, n);
+    lock_release(&inode->lock);
+    return result;
+}
+
+static long fs_write_locked(struct file_desc* desc, const void* buf, unsigned long n){
+    // input:
+    //     desc: the open file to write, its inode lock held
+    //     buf: the buffer to write from
+    //     n: the number of bytes to write
+    // output:
+    //     return the number of bytes written on success, relative errcode on failure
+    // side effect:
+    // writes n bytes from buf at the file position, growing the file if needed,
+    // and advances the position.
 
-    uint32_t inodes = file_descs[current].inodes;
-    uint32_t pos = file_descs[current].pos;
-    uint32_t size = file_descs[current].size;
+    uint32_t inodes = desc->inodes;
+    uint32_t pos = desc->pos;
+    uint32_t size = fs.inodes[inodes].length;
 
-    // extend size
     if(pos > size){
         kprintf("fs_write: pos > size\n");
         return -EINVAL;
-    }else if(pos + n > size){
-        n = size - pos;
-    }
-    // extend the data blocks if needed
-    // int new_data_blks = size / SIZE_OF_4K_BLK + 1;
-    // if(new_data_blks > MAX_DATA_BLKS){
-    //     kprintf("fs_write: file too large\n");
-    //     return -EIO;
-    // }
-    // read the data blk index from the inode
-    struct inode inode;
-    uint64_t inode_pos = SIZE_OF_4K_BLK * (START_IDX_OF_INODE + inodes);
-    ioseek(fs.dev_io_intf, inode_pos);
-    ioread_full(fs.dev_io_intf, (void*)&inode, SIZE_OF_4K_BLK);
-    
-    // get the index for the data blocks and offset
-    // also, the physical location for data blocks is hashed in inode.data_blks,
-    // not in order, access by reading the list
-    uint32_t num_blks = inode.length / SIZE_OF_4K_BLK + 1; // upper bound (e.g. if length < 4096)
-    // uint32_t data_blk_array[new_data_blks];
-    // // if new data blocks are needed, try to allocate new one
-    // // compare with max capacity
-    // uint64_t capacity;
-    // fs.dev_io_intf->ops->ctl(fs.dev_io_intf, IOCTL_GETLEN, &capacity);
-    // if(new_data_blks > num_blks){
-    //     if((fs.boot_blk.num_data_blks + 1) * SIZE_OF_4K_BLK + start_of_data_blks >= capacity){
-    //         kprintf("fs_write: no more space\n");
-    //         return -EIO;
-    //     }
-    //     uint32_t new_blk_idx = fs.boot_blk.num_data_blks;
-    //     fs.boot_blk.num_data_blks++;
-    //     data_blk_array[num_blks - 1] = new_blk_idx;
-    // }
-    // // copy the old data blocks
-    // for (int i = 0; i < num_blks; i++){
-    //     data_blk_array[i] = inode.data_blks[i];
-    // }
-    // // prepare the structure and send back
-    // ioseek(fs.dev_io_intf, POS_BOOT_BLK);
-    // iowrite(fs.dev_io_intf, (void*)&fs.boot_blk, SIZE_OF_4K_BLK);
-    // struct inode updated_node= {
-    //     .length = size
-    // };
-    // for (int i = 0; i < new_data_blks; i++){
-    //     updated_node.data_blks[i] = data_blk_array[i];
-    // }
-    // ioseek(fs.dev_io_intf, inode_pos);
-    // iowrite(fs.dev_io_intf, (void*)&updated_node, SIZE_OF_4K_BLK);
-    
-    // // write the data blocks
-    // // file_descs[current].size = size;
-
-    // prevent unaligned warning
-    uint32_t data_blk_array[num_blks];
-    for (int i = 0; i < num_blks; i++){
-        data_blk_array[i] = inode.data_blks[i];
     }
     if(n == 0){
         return EOF;
     }
+    // compressed files are read-only
+    if (fs.inodes[inodes].flags & KFS2_INODE_COMPRESSED){
+        kprintf("fs_write: file is compressed\n");
+        return -ENOTSUP;
+    }
+    // writing past the end grows the file; allocate the missing blocks,
+    // reserving some more when the file is being appended to sequentially
+    struct inode_info* inode = &fs.inodes[inodes];
+    uint64_t new_size = (uint64_t)pos + n;
+    if (new_size > UINT32_MAX){
+        new_size = UINT32_MAX;
+        n = new_size - pos;
+    }
+    uint32_t new_blks = (new_size + SIZE_OF_4K_BLK - 1) / SIZE_OF_4K_BLK;
+    if (new_blks > inode->num_blks){
+        uint32_t prealloc = 0;
+        if (pos == size && pos == desc->wr_end){
+            prealloc = PREALLOC_BLKS;
+        }
+        int result = grow_file(inodes, new_blks, prealloc);
+        if (result != 0){
+            // write as much as fits into the blocks we have
+            if ((uint64_t)inode->num_blks * SIZE_OF_4K_BLK <= pos){
+                kprintf("fs_write: no space left\n");
+                return result;
+            }
+            n = (uint64_t)inode->num_blks * SIZE_OF_4K_BLK - pos;
+        }
+    }
+    uint32_t num_blks = inode->num_blks;
+
     uint32_t start_blk = pos / SIZE_OF_4K_BLK;
     uint32_t start_offset = pos % SIZE_OF_4K_BLK;
     uint32_t end_blk = (pos + n - 1) / SIZE_OF_4K_BLK;
     uint32_t end_offset = (pos + n - 1) % SIZE_OF_4K_BLK;
     // again, sanity check
     if (start_blk >= num_blks || end_blk >= num_blks){
-        kprintf("fs_read: start_blk or end_blk >= num_blks\n");
+        kprintf("fs_write: start_blk or end_blk >= num_blks\n");
         return -EINVAL;
     }
 
     // read the data blocks one by one and copy the data to the buffer based on offset
     long bytes_written = 0;
     for(int i = start_blk; i <= end_blk; i++){
-        // prepare the 4k blk to write
-        uint64_t data_blk_pos = start_of_data_blks + data_blk_array[i] * SIZE_OF_4K_BLK;
-        struct data_blk data_blk_crt;
-        ioseek(fs.dev_io_intf, data_blk_pos);
-        ioread_full(fs.dev_io_intf, (void*)&data_blk_crt, SIZE_OF_4K_BLK);
+        // prepare the 4k blk to write; a block we overwrite completely, or one
+        // past the old end of the file, holds nothing worth reading first
+        uint32_t ext_run;
+        uint64_t dev_blk = inode_bmap(inode, i, &ext_run);
+        struct bcache_blk * blk;
+        if ((start_offset == 0 && (i != end_blk || end_offset == SIZE_OF_4K_BLK - 1))
+            || (uint64_t)i * SIZE_OF_4K_BLK >= size){
+            blk = bcache_get_zeroed(fs.dev_io_intf, dev_blk);
+        }else{
+            blk = bcache_get(fs.dev_io_intf, dev_blk);
+        }
+        if (blk == NULL){
+            kprintf("fs_write: failed to read data block\n");
+            break;
+        }
+        struct data_blk * data_blk_crt = (struct data_blk*)blk->data;
+        long written_in_blk = 0;
         for(int j = start_offset; j < SIZE_OF_4K_BLK; j++){
             if(i == end_blk && j == end_offset+1){
                 // break at last byte
                 break;
             }
             
-            data_blk_crt.data[j] = *(char*)(buf + bytes_written);
-            bytes_written++;
+            data_blk_crt->data[j] = *(char*)(buf + bytes_written + written_in_blk);
+            written_in_blk++;
         }
-        // write the 4k blk back
-        fs.dev_io_intf->ops->ctl(fs.dev_io_intf, IOCTL_SETPOS, &data_blk_pos);
-        iowrite(fs.dev_io_intf, (void*)&data_blk_crt, SIZE_OF_4K_BLK);
+        // the block is written back on flush or eviction
+        bcache_mark_dirty(blk);
+        bcache_release(blk);
+        bytes_written += written_in_blk;
         start_offset = 0; // reset the start offset for reading next block
     }
-    file_descs[current].pos += bytes_written;
+    if (bytes_written == 0){
+        return -EIO;
+    }
+    desc->pos += bytes_written;
+    desc->wr_end = desc->pos;
+
+    // record the new length in the inode, shared by all open files of it
+    if (desc->pos > inode->length){
+        inode->length = desc->pos;
+        if (write_inode(inodes) != 0){
+            kprintf("fs_write: failed to update inode\n");
+        }
+    }
+    // keep memory mappings of the file up to date
+    fs_sync_pages(inodes, start_blk, (pos + bytes_written - 1) / SIZE_OF_4K_BLK);
     return bytes_written;
 }
 
@@ -387,48 +607,58 @@ int fs_ioctl(struct io_intf* io, int cmd, void* arg){
     // }
 
     // check if the file exists
-    int current = find_file_desc_by_io(io);
-    if (current == MAX_FILE_DESC){
-        kprintf("fs_ioctl: file not found\n");
-        return -EIO;
-    }
-
-    if (file_descs[current].flag == FILE_NOT_IN_USE){
-        kprintf("fs_ioctl: file desc not in use\n");
+    struct file_desc* desc = file_desc_of(io);
+    if (desc == NULL){
+        kprintf("fs_ioctl: file not open\n");
         return -EBADFD;
     }
-    // check the command
+    // none of these sleep, so they need not take the inode lock
     switch(cmd){
         case IOCTL_GETLEN:
-            return fs_getlen(current, arg);
+            return fs_getlen(desc, arg);
         case IOCTL_GETPOS:
-            return fs_getpos(current, arg);
+            return fs_getpos(desc, arg);
         case IOCTL_SETPOS:
-            return fs_setpos(current, arg);
+            return fs_setpos(desc, arg);
         case IOCTL_GETBLKSZ:
-            return fs_getblksize(current, arg);
+            return fs_getblksize(desc, arg);
+        case IOCTL_FLUSH:
+            return bcache_flush(fs.dev_io_intf);
+        case IOCTL_GETBCSTATS:
+            bcache_get_stats((struct bcache_stats*)arg);
+            return 0;
+        // counters and settings of the device the file system is mounted on
+        case IOCTL_GETELVSTATS:
+        case IOCTL_GETPOLL:
+        case IOCTL_SETPOLL:
+        case IOCTL_GETPOLLSTATS:
+            return ioctl(fs.dev_io_intf, cmd, arg);
+        case IOCTL_GETRA:
+            return fs_getra(desc, arg);
+        case IOCTL_SETRA:
+            return fs_setra(desc, arg);
         default:
             kprintf("fs_ioctl: invalid cmd\n");
             return -ENOTSUP;
     }
 }
 
-int fs_getlen(int fd, void* arg){
+int fs_getlen(struct file_desc* desc, void* arg){
     // input:
-    //     file: the file descriptor to the file to read
+    //     desc: the file descriptor to the file to read
     //     arg: pointer to return value
     // output:
     //     return 0 on success, relative errcode on failure
     // side effect:
     //      Returns the length of the file associated with io in pointer.
 
-    *(uint64_t*)arg = file_descs[fd].size;
+    *(uint64_t*)arg = fs.inodes[desc->inodes].length;
     return 0;
 }
 
-int fs_setpos(int fd, void* arg){
+int fs_setpos(struct file_desc* desc, void* arg){
     // input:
-    //     file: the file descriptor to the file to read
+    //     desc: the file descriptor to the file to read
     //     arg: pointer contains the position to set
     // output:
     //     return 0 on success, relative errcode on failure
@@ -436,32 +666,33 @@ int fs_setpos(int fd, void* arg){
     //      Sets the position of the file associated with io.
 
     uint64_t pos = *(uint64_t*)arg;
-    if(pos > file_descs[fd].size){
+    uint64_t size = fs.inodes[desc->inodes].length;
+    if(pos > size){
         kprintf("fs_setpos: pos > size\n");
-        file_descs[fd].pos = file_descs[fd].size;
+        desc->pos = size;
         return 0;
     }
 
-    file_descs[fd].pos = pos;
+    desc->pos = pos;
     return 0;
 }
 
-int fs_getpos(int fd, void* arg){
+int fs_getpos(struct file_desc* desc, void* arg){
     // input:
-    //     file: the file descriptor to the file to read
+    //     desc: the file descriptor to the file to read
     //     arg: pointer to return value
     // output:
     //     return 0 on success, relative errcode on failure
     // side effect:
     //      Gets the position of the file associated with io in pointer.
 
-    *(uint64_t*)arg = file_descs[fd].pos;
+    *(uint64_t*)arg = desc->pos;
     return 0;
 }
 
-int fs_getblksize(int fd, void* arg){
+int fs_getblksize(struct file_desc* desc, void* arg){
     // input:
-    //     file: the file descriptor to the file to read
+    //     desc: the file descriptor to the file to read
     //     arg: pointer to return value
     // output:
     //     return 0 on success, relative errcode on failure
@@ -472,6 +703,503 @@ int fs_getblksize(int fd, void* arg){
     return 0;
 }
 
+int fs_getra(struct file_desc* desc, void* arg){
+    // input:
+    //     desc: the file descriptor to the file
+    //     arg: pointer to return value
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    //      Gets the maximum readahead window of the file, in blocks.
+
+    *(uint32_t*)arg = desc->ra_max;
+    return 0;
+}
+
+int fs_setra(struct file_desc* desc, void* arg){
+    // input:
+    //     desc: the file descriptor to the file
+    //     arg: pointer contains the maximum readahead window, in blocks
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    //      Sets the maximum readahead window of the file. 0 disables readahead.
+
+    uint32_t ra_max = *(uint32_t*)arg;
+    if (ra_max > RA_MAX_BLKS){
+        kprintf("fs_setra: window too large\n");
+        return -EINVAL;
+    }
+    desc->ra_max = ra_max;
+    if (desc->ra_win > ra_max){
+        desc->ra_win = ra_max;
+    }
+    return 0;
+}
+
+void fs_readahead(struct file_desc* desc, uint64_t pos, uint32_t end_blk){
+    // input:
+    //     desc: the file descriptor being read
+    //     pos: the file position the read starts at
+    //     end_blk: the last file block touched by the read
+    // output:
+    //     none
+    // side effect:
+    // Tracks the access pattern of the file. While reads are sequential, a
+    // window of ra_win blocks ahead of the reader is prefetched into the block
+    // cache with asynchronous fills, and the next window is started as soon as
+    // the reader enters the previous one, so the device works ahead of the
+    // reader instead of stalling it. The first window starts at the last block
+    // of the read with RA_MIN_BLKS blocks; the window doubles up to ra_max with
+    // every further one. A non-sequential read turns readahead off until the
+    // reads become sequential again.
+
+    const struct inode_info* inode = &fs.inodes[desc->inodes];
+
+    if (pos != desc->ra_pos || desc->ra_max == 0){
+        desc->ra_win = 0;
+        desc->ra_next = 0;
+        desc->ra_end = 0;
+        return;
+    }
+    // the reader has not reached the window started last time
+    if (desc->ra_win != 0 && end_blk < desc->ra_next){
+        return;
+    }
+
+    uint32_t blk = end_blk;
+    if (desc->ra_win == 0){
+        desc->ra_win = RA_MIN_BLKS;
+    }else{
+        if (desc->ra_win * 2 <= desc->ra_max){
+            desc->ra_win *= 2;
+        }else{
+            desc->ra_win = desc->ra_max;
+        }
+        if (blk < desc->ra_end){
+            blk = desc->ra_end;
+        }
+    }
+
+    uint32_t last = blk + desc->ra_win - 1;
+    if (last >= inode->num_blks){
+        last = inode->num_blks - 1;
+    }
+    desc->ra_next = blk;
+    desc->ra_end = last + 1;
+
+    // one asynchronous fill per extent, at most BCACHE_RUN_MAX blocks each
+    while (blk <= last){
+        uint32_t run;
+        uint64_t dev_blk = inode_bmap(inode, blk, &run);
+        if (run > last - blk + 1){
+            run = last - blk + 1;
+        }
+        if (run > BCACHE_RUN_MAX){
+            run = BCACHE_RUN_MAX;
+        }
+        if (bcache_prefetch(fs.dev_io_intf, dev_blk, run) != 0){
+            // the read path will fetch what it needs on its own
+            return;
+        }
+        blk += run;
+    }
+}
+
+int load_inode_table(struct io_intf* io, const struct boot_blk* boot, uint32_t version,
+                     struct inode_info** inodes){
+    // input:
+    //     io: the device being mounted
+    //     boot: its boot block
+    //     version: 1 or KFS_VERSION_2
+    //     inodes: returns the inode table, boot->num_inodes entries
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Reads every inode of the fs once and keeps its length and extents in the
+    // returned table, so that reads and writes do not have to fetch the inode
+    // block again. Nothing is left allocated on failure.
+
+    uint32_t num_inodes = boot->num_inodes;
+    struct inode_info* table = kcalloc(num_inodes, sizeof(struct inode_info));
+    if (table == NULL){
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < num_inodes; i++){
+        lock_init(&table[i].lock, "kfs_inode");
+        int result = (version == KFS_VERSION_2) ?
+            load_inode_v2(io, boot, i, &table[i]) : load_inode_v1(io, i, &table[i]);
+        if (result != 0){
+            free_inode_table(table, i);
+            return result;
+        }
+    }
+    *inodes = table;
+    return 0;
+}
+
+void free_inode_table(struct inode_info* inodes, uint32_t num_inodes){
+    // input:
+    //     inodes: an inode table from load_inode_table
+    //     num_inodes: the number of entries loaded into it
+    // output:
+    //     none
+    // side effect:
+    // Frees the table, the extent arrays of its inodes and the chunk tables
+    // and decompression pages of compressed files.
+
+    for (uint32_t i = 0; i < num_inodes; i++){
+        kfree(inodes[i].extents);
+        kfree(inodes[i].chunk_off);
+        if (inodes[i].zbuf != NULL){
+            memory_free_page(inodes[i].zbuf);
+        }
+        if (inodes[i].zscratch != NULL){
+            memory_free_page(inodes[i].zscratch);
+        }
+    }
+    kfree(inodes);
+}
+
+int load_inode_v1(struct io_intf* io, uint32_t ino, struct inode_info* info){
+    // input:
+    //     io: the device being mounted
+    //     ino: the inode number
+    //     info: the entry of the inode table to fill
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Loads a v1 inode (a 4K block holding a list of data blocks) into info,
+    // merging consecutive data blocks into extents.
+
+    struct bcache_blk * blk = bcache_get(io, START_IDX_OF_INODE + ino);
+    if (blk == NULL){
+        return -EIO;
+    }
+    struct inode * inode = (struct inode*)blk->data;
+    uint32_t length = inode->length;
+    uint32_t num_blks = (length + SIZE_OF_4K_BLK - 1) / SIZE_OF_4K_BLK;
+    if (num_blks > MAX_DATA_BLKS){
+        bcache_release(blk);
+        return -EBADFMT;
+    }
+
+    uint32_t num_extents = 0;
+    for (uint32_t j = 0; j < num_blks; j++){
+        if (j == 0 || inode->data_blks[j] != inode->data_blks[j - 1] + 1){
+            num_extents++;
+        }
+    }
+    // kmalloc cannot hand out more than a page
+    if (num_extents * sizeof(struct extent_info) > SIZE_OF_4K_BLK){
+        kprintf("load_inode_v1: inode %d too fragmented\n", (int)ino);
+        bcache_release(blk);
+        return -EBADFMT;
+    }
+
+    info->length = length;
+    info->num_blks = num_blks;
+    info->num_extents = num_extents;
+    info->extents = NULL;
+    if (num_extents != 0){
+        info->extents = kmalloc(num_extents * sizeof(struct extent_info));
+        if (info->extents == NULL){
+            bcache_release(blk);
+            return -ENOMEM;
+        }
+        int k = -1;
+        for (uint32_t j = 0; j < num_blks; j++){
+            if (j == 0 || inode->data_blks[j] != inode->data_blks[j - 1] + 1){
+                k++;
+                info->extents[k].fblk = j;
+                info->extents[k].start = inode->data_blks[j];
+                info->extents[k].len = 0;
+            }
+            info->extents[k].len++;
+        }
+    }
+    bcache_release(blk);
+    return 0;
+}
+
+int load_inode_v2(struct io_intf* io, const struct boot_blk* boot, uint32_t ino,
+                  struct inode_info* info){
+    // input:
+    //     io: the device being mounted
+    //     boot: its boot block
+    //     ino: the inode number
+    //     info: the entry of the inode table to fill
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Loads a v2 inode (a list of extents, KFS2_INODES_PER_BLK inodes per block)
+    // into info. The inode block is shared, so it usually comes from the block
+    // cache.
+
+    struct bcache_blk * blk = bcache_get(io, START_IDX_OF_INODE + ino / KFS2_INODES_PER_BLK);
+    if (blk == NULL){
+        return -EIO;
+    }
+    const struct inode_v2 * inode =
+        (const struct inode_v2*)blk->data + ino % KFS2_INODES_PER_BLK;
+    uint32_t length = inode->length;
+    uint32_t num_blks = (length + SIZE_OF_4K_BLK - 1) / SIZE_OF_4K_BLK;
+    uint32_t num_extents = inode->num_extents;
+    if (num_extents > KFS2_MAX_EXTENTS){
+        bcache_release(blk);
+        return -EBADFMT;
+    }
+
+    info->length = length;
+    info->num_blks = num_blks;
+    info->flags = inode->flags;
+    info->num_extents = num_extents;
+    info->extents = NULL;
+    if (num_extents != 0){
+        info->extents = kmalloc(num_extents * sizeof(struct extent_info));
+        if (info->extents == NULL){
+            bcache_release(blk);
+            return -ENOMEM;
+        }
+    }
+
+    // the extents must cover the file exactly and stay inside the data area
+    uint32_t fblk = 0;
+    for (uint32_t k = 0; k < num_extents; k++){
+        const struct extent* ext = &inode->extents[k];
+        if (ext->len == 0 || ext->start >= boot->num_data_blks ||
+            ext->len > boot->num_data_blks - ext->start){
+            bcache_release(blk);
+            kfree(info->extents);
+            info->extents = NULL;
+            return -EBADFMT;
+        }
+        info->extents[k].fblk = fblk;
+        info->extents[k].start = ext->start;
+        info->extents[k].len = ext->len;
+        fblk += ext->len;
+    }
+    bcache_release(blk);
+    // the stored data of a compressed file is shorter than its length
+    if (info->flags & KFS2_INODE_COMPRESSED){
+        info->num_blks = fblk;
+        info->num_chunks = (length + KFS_ZCHUNK_SIZE - 1) / KFS_ZCHUNK_SIZE;
+    }else if (fblk != num_blks){
+        kfree(info->extents);
+        info->extents = NULL;
+        return -EBADFMT;
+    }
+    return 0;
+}
+
+int load_blk_map(struct io_intf* io, const struct boot_blk* boot, uint64_t data_start,
+                 const struct inode_info* inodes, uint8_t** map, uint32_t* map_nblks){
+    // input:
+    //     io: the device being mounted
+    //     boot: its boot block
+    //     data_start: the device block holding data block 0
+    //     inodes: the inode table of the fs
+    //     map: returns the bitmap
+    //     map_nblks: returns the number of data blocks it covers
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Builds the free-space bitmap of the data area, which runs from the end of
+    // the inodes to the end of the device, from the extents of all inodes. At
+    // most MAX_MAP_BLKS data blocks are managed.
+
+    uint64_t capacity;
+    uint32_t nblks = boot->num_data_blks;
+    if (ioctl(io, IOCTL_GETLEN, &capacity) == 0 &&
+        capacity / SIZE_OF_4K_BLK > data_start + nblks){
+        nblks = capacity / SIZE_OF_4K_BLK - data_start;
+    }
+    if (nblks > MAX_MAP_BLKS){
+        kprintf("load_blk_map: only the first %d data blocks are used\n", MAX_MAP_BLKS);
+        nblks = MAX_MAP_BLKS;
+    }
+
+    uint8_t* bits = kcalloc(1, (nblks + 7) / 8);
+    if (bits == NULL){
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < boot->num_inodes; i++){
+        for (uint32_t k = 0; k < inodes[i].num_extents; k++){
+            const struct extent_info* ext = &inodes[i].extents[k];
+            for (uint32_t b = ext->start; b < ext->start + ext->len && b < nblks; b++){
+                bits[b / 8] |= 1 << (b % 8);
+            }
+        }
+    }
+    *map = bits;
+    *map_nblks = nblks;
+    return 0;
+}
+
+int grow_file(uint32_t ino, uint32_t new_blks, uint32_t prealloc){
+    // input:
+    //     ino: the inode number
+    //     new_blks: the number of blocks the file needs
+    //     prealloc: the number of blocks to reserve beyond new_blks
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Allocates data blocks until the file has new_blks of them. Blocks are taken
+    // from the reservation first, then right after the last extent, and only
+    // then from a new extent, which is placed in the first free run large enough
+    // (or the largest run if none is). On failure the file keeps the blocks
+    // allocated so far. Raises boot_blk.num_data_blks past the new blocks.
+    // Holds fs.lock, since files of the same fs allocate from one bitmap.
+
+    struct inode_info* info = &fs.inodes[ino];
+    lock_acquire(&fs.lock);
+    uint32_t old_data_blks = fs.boot_blk.num_data_blks;
+    int result = 0;
+
+    // a v1 inode holds a fixed-size block list
+    if (fs.version != KFS_VERSION_2 && new_blks > MAX_DATA_BLKS){
+        new_blks = MAX_DATA_BLKS;
+        result = -ENOSPC;
+    }
+
+    while (info->num_blks < new_blks){
+        uint32_t need = new_blks - info->num_blks;
+        uint32_t got = 0;
+        struct extent_info* last = NULL;
+        if (info->num_extents != 0){
+            last = &info->extents[info->num_extents - 1];
+            if (info->prealloc != 0){
+                got = (need < info->prealloc) ? need : info->prealloc;
+                info->prealloc -= got;
+            }else{
+                got = alloc_at(last->start + last->len, need);
+            }
+            last->len += got;
+        }
+        if (got == 0){
+            uint32_t start;
+            got = alloc_any(need, &start);
+            if (got == 0){
+                result = -ENOSPC;
+                break;
+            }
+            if (add_extent(info, start, got) != 0){
+                mark_blks(start, got, 0);
+                result = -ENOSPC;
+                break;
+            }
+            last = &info->extents[info->num_extents - 1];
+        }
+        info->num_blks += got;
+        if (last->start + last->len > fs.boot_blk.num_data_blks){
+            fs.boot_blk.num_data_blks = last->start + last->len;
+        }
+    }
+
+    if (result == 0 && prealloc != 0 && info->prealloc == 0 && info->num_extents != 0){
+        struct extent_info* last = &info->extents[info->num_extents - 1];
+        if (fs.version != KFS_VERSION_2 && info->num_blks + prealloc > MAX_DATA_BLKS){
+            prealloc = MAX_DATA_BLKS - info->num_blks;
+        }
+        info->prealloc = alloc_at(last->start + last->len, prealloc);
+    }
+
+    if (fs.boot_blk.num_data_blks != old_data_blks && write_boot_blk() != 0){
+        result = -EIO;
+    }
+    lock_release(&fs.lock);
+    return result;
+}
+
+void release_prealloc(uint32_t ino){
+    // input:
+    //     ino: the inode number
+    // output:
+    //     none
+    // side effect:
+    // Returns the blocks reserved after the last extent of the file to the free
+    // space bitmap.
+
+    struct inode_info* info = &fs.inodes[ino];
+    lock_acquire(&fs.lock);
+    if (info->prealloc != 0){
+        struct extent_info* last = &info->extents[info->num_extents - 1];
+        mark_blks(last->start + last->len, info->prealloc, 0);
+        info->prealloc = 0;
+    }
+    lock_release(&fs.lock);
+}
+
+int write_inode(uint32_t ino){
+    // input:
+    //     ino: the inode number
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Stores the length and the blocks of fs.inodes[ino] in the on-disk inode
+    // through the block cache. Only the blocks holding data up to the length
+    // are recorded; blocks allocated beyond it are freed again on next mount.
+
+    const struct inode_info* info = &fs.inodes[ino];
+    uint32_t needed = (info->length + SIZE_OF_4K_BLK - 1) / SIZE_OF_4K_BLK;
+    struct bcache_blk * blk;
+
+    if (fs.version == KFS_VERSION_2){
+        blk = bcache_get(fs.dev_io_intf, START_IDX_OF_INODE + ino / KFS2_INODES_PER_BLK);
+        if (blk == NULL){
+            return -EIO;
+        }
+        struct inode_v2 * inode = (struct inode_v2*)blk->data + ino % KFS2_INODES_PER_BLK;
+        memset(inode, 0, sizeof(struct inode_v2));
+        inode->length = info->length;
+        uint32_t covered = 0;
+        for (uint32_t k = 0; k < info->num_extents && covered < needed; k++){
+            uint32_t len = info->extents[k].len;
+            if (len > needed - covered){
+                len = needed - covered;
+            }
+            inode->extents[k].start = info->extents[k].start;
+            inode->extents[k].len = len;
+            inode->num_extents++;
+            covered += len;
+        }
+    }else{
+        blk = bcache_get(fs.dev_io_intf, START_IDX_OF_INODE + ino);
+        if (blk == NULL){
+            return -EIO;
+        }
+        struct inode * inode = (struct inode*)blk->data;
+        inode->length = info->length;
+        uint32_t j = 0;
+        for (uint32_t k = 0; k < info->num_extents && j < needed; k++){
+            for (uint32_t b = 0; b < info->extents[k].len && j < needed; b++){
+                inode->data_blks[j++] = info->extents[k].start + b;
+            }
+        }
+    }
+    bcache_mark_dirty(blk);
+    bcache_release(blk);
+    return 0;
+}
+
+int write_boot_blk(void){
+    // input:
+    //     none
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Stores the in-memory boot block through the block cache.
+
+    struct bcache_blk * blk = bcache_get(fs.dev_io_intf, POS_BOOT_BLK);
+    if (blk == NULL){
+        return -EIO;
+    }
+    memcpy(blk->data, &fs.boot_blk, sizeof(struct boot_blk));
+    bcache_mark_dirty(blk);
+    bcache_release(blk);
+    return 0;
+}
+
 uint32_t find_inode_by_name(const char* name){
     // input:
     //     name: the name of the file to find
@@ -481,42 +1209,712 @@ uint32_t find_inode_by_name(const char* name){
     // Takes the name of the file to be found and returns the inode of the file if found, NULL if not found.
     // This function should be used to find the inode of a file given its name.
 
-    for (int i = 0; i < fs.boot_blk.num_entries; i++){
-        if (strcmp(fs.boot_blk.entries[i].name, name) == 0){
-            return fs.boot_blk.entries[i].inode;
+    size_t len;
+    uint32_t hash = name_hash(name, &len);
+    if (len > MAX_FINENAME){
+        return fs.boot_blk.num_inodes;
+    }
+
+    // names that missed before are answered from the negative cache
+    struct neg_entry* neg = &fs.neg_cache[hash & (NEG_CACHE_SIZE - 1)];
+    if (neg->valid && neg->hash == hash && strncmp(neg->name, name, MAX_FINENAME) == 0){
+        return fs.boot_blk.num_inodes;
+    }
+
+    // linear probing, an empty slot ends the chain
+    for (uint32_t slot = hash & fs.dir_index_mask; fs.dir_index[slot] != 0; slot = (slot + 1) & fs.dir_index_mask){
+        struct entry* entry = &fs.boot_blk.entries[fs.dir_index[slot] - 1];
+        if (strncmp(entry->name, name, MAX_FINENAME) == 0){
+            return entry->inode;
         }
     }
+
+    neg->hash = hash;
+    neg->valid = 1;
+    strncpy(neg->name, name, MAX_FINENAME);
     return fs.boot_blk.num_inodes;
 }
 
-int find_file_desc_by_io(struct io_intf* io){
+int fs_readdir(uint32_t* cookie, struct fs_dirent* ents, uint32_t max){
+    // input:
+    //     cookie: the directory entry to continue at, 0 for the first call
+    //     ents: the records to fill
+    //     max: the number of records ents has room for
+    // output:
+    //     return the number of records filled, 0 at the end of the directory,
+    //     relative errcode on failure
+    // side effect:
+    // Copies up to max entries of the directory, starting at *cookie, with the
+    // name, inode and length of each file, and advances *cookie past them.
+    // Unused entries are skipped.
+
+    if (fs.dev_io_intf == NULL){
+        return -EINVAL;
+    }
+    uint32_t i = *cookie;
+    uint32_t cnt = 0;
+    while (i < fs.boot_blk.num_entries && i < MAX_FILES && cnt < max){
+        const struct entry* entry = &fs.boot_blk.entries[i++];
+        if (entry->name[0] == '\0' || entry->inode >= fs.boot_blk.num_inodes){
+            continue;
+        }
+        memcpy(ents[cnt].name, entry->name, MAX_FINENAME);
+        ents[cnt].name[MAX_FINENAME] = '\0';
+        ents[cnt].inode = entry->inode;
+        ents[cnt].size = fs.inodes[entry->inode].length;
+        cnt++;
+    }
+    *cookie = i;
+    return cnt;
+}
+
+int build_dir_index(const struct boot_blk* boot, uint16_t** index, uint32_t* mask){
+    // input:
+    //     boot: the boot block holding the directory
+    //     index: returns the index
+    //     mask: returns the number of slots of the index minus one
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Builds the name hash index over the directory entries. The index has at
+    // least twice as many slots as there are entries so probe chains stay short.
+
+    uint32_t size = MIN_DIR_INDEX_SIZE;
+    while (size < 2 * boot->num_entries){
+        size *= 2;
+    }
+    uint16_t* slots = kcalloc(size, sizeof(uint16_t));
+    if (slots == NULL){
+        return -ENOMEM;
+    }
+
+    for (uint32_t i = 0; i < boot->num_entries; i++){
+        const char* name = boot->entries[i].name;
+        uint32_t slot = name_hash(name, NULL) & (size - 1);
+        // keep the first of duplicate names, as the linear scan used to
+        while (slots[slot] != 0 &&
+               strncmp(boot->entries[slots[slot] - 1].name, name, MAX_FINENAME) != 0){
+            slot = (slot + 1) & (size - 1);
+        }
+        if (slots[slot] == 0){
+            slots[slot] = i + 1;
+        }
+    }
+    *index = slots;
+    *mask = size - 1;
+    return 0;
+}
+
+int load_chunk_table(uint32_t ino){
+    // input:
+    //     ino: the inode number of a compressed file, its inode lock held
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Reads the chunk table at the start of the stored data into
+    // fs.inodes[ino].chunk_off, checking that it matches the length of the
+    // file and that every chunk lies inside the stored blocks.
+
+    struct inode_info* info = &fs.inodes[ino];
+    struct zchunk_hdr hdr;
+
+    if (info->num_chunks > KFS_MAX_ZCHUNKS){
+        kprintf("load_chunk_table: inode %d has too many chunks\n", (int)ino);
+        return -EBADFMT;
+    }
+    int result = read_stored(info, 0, &hdr, sizeof(hdr));
+    if (result != 0){
+        return result;
+    }
+    if (hdr.chunk_size != KFS_ZCHUNK_SIZE || hdr.num_chunks != info->num_chunks){
+        kprintf("load_chunk_table: bad chunk table in inode %d\n", (int)ino);
+        return -EBADFMT;
+    }
+
+    uint32_t* off = kmalloc((info->num_chunks + 1) * sizeof(uint32_t));
+    if (off == NULL){
+        return -ENOMEM;
+    }
+    result = read_stored(info, sizeof(hdr), off, (info->num_chunks + 1) * sizeof(uint32_t));
+    if (result != 0){
+        kfree(off);
+        return result;
+    }
+    // the offsets must rise and no chunk is stored bigger than it is, so a
+    // chunk spans at most two blocks
+    uint32_t prev = sizeof(hdr) + (info->num_chunks + 1) * sizeof(uint32_t);
+    for (uint32_t k = 0; k <= info->num_chunks; k++){
+        uint32_t max_len = KFS_ZCHUNK_SIZE;
+        if (k == info->num_chunks && info->length % KFS_ZCHUNK_SIZE != 0){
+            max_len = info->length % KFS_ZCHUNK_SIZE;
+        }
+        if (off[k] < prev || (k > 0 && off[k] - prev > max_len)){
+            kprintf("load_chunk_table: bad chunk table in inode %d\n", (int)ino);
+            kfree(off);
+            return -EBADFMT;
+        }
+        prev = off[k];
+    }
+    if (off[info->num_chunks] > info->num_blks * SIZE_OF_4K_BLK){
+        kfree(off);
+        return -EBADFMT;
+    }
+    info->chunk_off = off;
+    return 0;
+}
+
+int read_chunk(uint32_t ino, uint32_t chunk, char* dst){
+    // input:
+    //     ino: the inode number of a compressed file, its inode lock held
+    //     chunk: the chunk to read
+    //     dst: receives the uncompressed chunk, KFS_ZCHUNK_SIZE bytes at most
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Fetches the stored bytes of the chunk through the block cache and
+    // decompresses them into dst. A chunk inside one block is decompressed in
+    // place; one that spans two blocks is first gathered into zscratch.
+
+    struct inode_info* info = &fs.inodes[ino];
+    if (info->chunk_off == NULL){
+        int result = load_chunk_table(ino);
+        if (result != 0){
+            return result;
+        }
+    }
+    if (chunk >= info->num_chunks){
+        return -EINVAL;
+    }
+
+    uint32_t raw_len = info->length - chunk * KFS_ZCHUNK_SIZE;
+    if (raw_len > KFS_ZCHUNK_SIZE){
+        raw_len = KFS_ZCHUNK_SIZE;
+    }
+    uint32_t start = info->chunk_off[chunk];
+    uint32_t zlen = info->chunk_off[chunk + 1] - start;
+    const char* src;
+    struct bcache_blk * blk = NULL;
+
+    if (start % SIZE_OF_4K_BLK + zlen <= SIZE_OF_4K_BLK){
+        uint32_t run;
+        blk = bcache_get(fs.dev_io_intf, inode_bmap(info, start / SIZE_OF_4K_BLK, &run));
+        if (blk == NULL){
+            return -EIO;
+        }
+        src = blk->data + start % SIZE_OF_4K_BLK;
+    }else{
+        if (info->zscratch == NULL){
+            info->zscratch = memory_alloc_page();
+        }
+        int result = read_stored(info, start, info->zscratch, zlen);
+        if (result != 0){
+            return result;
+        }
+        src = info->zscratch;
+    }
+
+    long result;
+    if (zlen == raw_len){
+        // stored as is, it did not compress
+        memcpy(dst, src, raw_len);
+        result = raw_len;
+    }else{
+        result = lz4_decompress((const uint8_t*)src, zlen, (uint8_t*)dst, raw_len);
+    }
+    if (blk != NULL){
+        bcache_release(blk);
+    }
+    if (result != raw_len){
+        kprintf("read_chunk: chunk %d of inode %d is corrupt\n", (int)chunk, (int)ino);
+        return -EBADFMT;
+    }
+    return 0;
+}
+
+int fs_file_ino(struct io_intf* io, uint32_t* ino){
+    // input:
+    //     io: an io interface
+    //     ino: returns the inode number of the file
+    // output:
+    //     return 0 on success, -EINVAL if io is not an open kfs file
+    // side effect:
+    // none
+
+    if (io->ops != &fs_io_ops){
+        return -EINVAL;
+    }
+    struct file_desc* desc = file_desc_of(io);
+    if (desc == NULL){
+        return -EBADFD;
+    }
+    *ino = desc->inodes;
+    return 0;
+}
+
+int fs_get_page(uint32_t ino, uint32_t pgidx, void** pp){
+    // input:
+    //     ino: the inode number
+    //     pgidx: the page of the file, in units of SIZE_OF_4K_BLK
+    //     pp: returns the page
+    // output:
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // Returns a physical page holding the data of the file at pgidx, with the
+    // bytes past the end of the file zeroed. The page comes from the page cache
+    // and is shared by everyone mapping it; it must be released with
+    // fs_put_page and must not be written to. When every slot is in use the
+    // page is a private one that fs_put_page frees.
+
+    if (ino >= fs.boot_blk.num_inodes){
+        return -EINVAL;
+    }
+    for (int i = 0; i < FS_PAGE_CACHE_SIZE; i++){
+        if (page_cache[i].page != NULL && page_cache[i].ino == ino && page_cache[i].pgidx == pgidx){
+            page_cache[i].refcnt++;
+            *pp = page_cache[i].page;
+            return 0;
+        }
+    }
+
+    // reuse an empty or unreferenced slot, going round the cache
+    struct fs_page* slot = NULL;
+    for (int i = 0; i < FS_PAGE_CACHE_SIZE && slot == NULL; i++){
+        struct fs_page* cand = &page_cache[(page_clock + i) % FS_PAGE_CACHE_SIZE];
+        if (cand->page == NULL || cand->refcnt == 0){
+            slot = cand;
+            page_clock = (page_clock + i + 1) % FS_PAGE_CACHE_SIZE;
+        }
+    }
+
+    void* page;
+    if (slot != NULL){
+        // hold the slot while the device read may sleep
+        if (slot->page == NULL){
+            slot->page = memory_alloc_page();
+        }
+        slot->ino = UINT32_MAX;
+        slot->refcnt = 1;
+        page = slot->page;
+    }else{
+        page = memory_alloc_page();
+    }
+
+    struct inode_info* inode = &fs.inodes[ino];
+    memset(page, 0, PAGE_SIZE);
+    if (inode->flags & KFS2_INODE_COMPRESSED){
+        // a page is exactly one chunk
+        int result = 0;
+        if ((uint64_t)pgidx * KFS_ZCHUNK_SIZE < inode->length){
+            lock_acquire(&inode->lock);
+            result = read_chunk(ino, pgidx, page);
+            lock_release(&inode->lock);
+        }
+        if (result != 0){
+            if (slot != NULL){
+                slot->refcnt = 0;
+            }else{
+                memory_free_page(page);
+            }
+            return result;
+        }
+    }else if (pgidx < inode->num_blks && (uint64_t)pgidx * SIZE_OF_4K_BLK < inode->length){
+        uint32_t run;
+        if (bcache_read_direct(fs.dev_io_intf, inode_bmap(inode, pgidx, &run), 1, page) != 0){
+            if (slot != NULL){
+                slot->refcnt = 0;
+            }else{
+                memory_free_page(page);
+            }
+            return -EIO;
+        }
+        uint32_t valid = inode->length - pgidx * SIZE_OF_4K_BLK;
+        if (valid < SIZE_OF_4K_BLK){
+            memset(page + valid, 0, SIZE_OF_4K_BLK - valid);
+        }
+    }
+
+    if (slot != NULL){
+        slot->ino = ino;
+        slot->pgidx = pgidx;
+    }
+    *pp = page;
+    return 0;
+}
+
+void fs_put_page(void* pp){
+    // input:
+    //     pp: a page returned by fs_get_page
+    // output:
+    //     none
+    // side effect:
+    // Drops a reference to the page; pages that are not cached are freed.
+
+    for (int i = 0; i < FS_PAGE_CACHE_SIZE; i++){
+        if (page_cache[i].page == pp){
+            page_cache[i].refcnt--;
+            if (page_cache[i].refcnt == 0 && page_cache[i].ino == UINT32_MAX){
+                // dropped from the cache by a remount while still mapped
+                memory_free_page(pp);
+                page_cache[i].page = NULL;
+            }
+            return;
+        }
+    }
+    memory_free_page(pp);
+}
+
+void fs_sync_pages(uint32_t ino, uint32_t first, uint32_t last){
+    // input:
+    //     ino: the inode number of a file that was written
+    //     first: the first page written
+    //     last: the last page written
+    // output:
+    //     none
+    // side effect:
+    // Copies the new contents of the file into its cached pages, so that shared
+    // mappings see the write.
+
+    const struct inode_info* inode = &fs.inodes[ino];
+    for (int i = 0; i < FS_PAGE_CACHE_SIZE; i++){
+        struct fs_page* p = &page_cache[i];
+        if (p->page == NULL || p->ino != ino || p->pgidx < first || p->pgidx > last){
+            continue;
+        }
+        uint32_t run;
+        struct bcache_blk * blk = bcache_get(fs.dev_io_intf, inode_bmap(inode, p->pgidx, &run));
+        if (blk == NULL){
+            continue;
+        }
+        uint32_t valid = inode->length - p->pgidx * SIZE_OF_4K_BLK;
+        if (valid > SIZE_OF_4K_BLK){
+            valid = SIZE_OF_4K_BLK;
+        }
+        memcpy(p->page, blk->data, valid);
+        bcache_release(blk);
+    }
+}
+
+struct file_desc* file_desc_of(struct io_intf* io){
     // input:
-    //     io: the io interface to the file to find
+    //     io: the io interface returned by fs_open
     // output:
-    //     return the index of file descriptor of the file if found, MAX_FILE_DESC if not found
+    //     return the file descriptor containing io, NULL if the file is not open
+    //     or was opened before the last mount
     // side effect:
     // none
 
-    for (int i = 0; i < MAX_FILE_DESC; i++){
-        if (file_descs[i].io_intf == io){
-            return i;
+    struct file_desc* desc = (void*)io - offsetof(struct file_desc, io_intf);
+    if (desc->flag != FILE_IN_USE || desc->mount_gen != mount_gen){
+        return NULL;
+    }
+    return desc;
+}
+
+struct file_desc* alloc_file_desc(void){
+    // input:
+    //     none
+    // output:
+    //     return an unused file descriptor, NULL if out of memory
+    // side effect:
+    // Takes a descriptor from the pool, refilling the pool with a page worth of
+    // descriptors when it is empty.
+
+    if (free_descs == NULL){
+        struct file_desc* page = memory_alloc_page();
+        if (page == NULL){
+            return NULL;
+        }
+        for (uint32_t i = 0; i < FILE_DESC_PER_PAGE; i++){
+            page[i] = (struct file_desc){0};
+            page[i].next_free = free_descs;
+            free_descs = &page[i];
         }
     }
-    return MAX_FILE_DESC;
+    struct file_desc* desc = free_descs;
+    free_descs = desc->next_free;
+    desc->next_free = NULL;
+    return desc;
 }
 
-int find_idle_file_desc(){
+void free_file_desc(struct file_desc* desc){
     // input:
+    //     desc: a file descriptor from alloc_file_desc
+    // output:
     //     none
+    // side effect:
+    // Marks the descriptor unused and returns it to the pool.
+
+    desc->flag = FILE_NOT_IN_USE;
+    desc->io_intf.ops = NULL;
+    desc->next_free = free_descs;
+    free_descs = desc;
+}
+
+static uint32_t name_hash(const char* name, size_t* len){
+    // input:
+    //     name: a file name, not necessarily NUL-terminated after MAX_FINENAME chars
+    //     len: if not NULL, receives the name length, capped at MAX_FINENAME + 1
+    // output:
+    //     return the FNV-1a hash of the first MAX_FINENAME chars of name
+    // side effect:
+    // none
+
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < MAX_FINENAME && name[i] != '\0'; i++){
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    if (len != NULL){
+        *len = (i == MAX_FINENAME && name[i] != '\0') ? MAX_FINENAME + 1 : i;
+    }
+    return hash;
+}
+
+static void fs_flusher(void* arg){
+    // input:
+    //     arg: unused
+    // output:
+    //     none
+    // side effect:
+    // Kernel thread that writes back the dirty blocks of the mounted file system
+    // every FS_FLUSH_INTERVAL seconds. Relies on the 1 Hz timer tick.
+    for(;;){
+        condition_wait(&tick_1Hz);
+        if (tick_1Hz_count % FS_FLUSH_INTERVAL == 0 && fs.dev_io_intf != NULL)
+            bcache_flush(fs.dev_io_intf);
+    }
+}
+
+static int read_stored(const struct inode_info* inode, uint32_t pos, void* dst, uint32_t len){
+    // input:
+    //     inode: the in-memory inode
+    //     pos: a byte offset into the stored blocks of the file
+    //     dst: the buffer to copy into
+    //     len: the number of bytes to copy
     // output:
-    //     return the index of the first idle file descriptor if found, MAX_FILE_DESC if not found
+    //     return 0 on success, relative errcode on failure
+    // side effect:
+    // copies stored bytes of the file into dst through the block cache,
+    // whatever the file's compression.
+
+    if ((uint64_t)pos + len > (uint64_t)inode->num_blks * SIZE_OF_4K_BLK){
+        return -EBADFMT;
+    }
+    while (len > 0){
+        uint32_t run;
+        uint32_t offset = pos % SIZE_OF_4K_BLK;
+        uint32_t cnt = SIZE_OF_4K_BLK - offset;
+        if (cnt > len){
+            cnt = len;
+        }
+        struct bcache_blk * blk = bcache_get(fs.dev_io_intf, inode_bmap(inode, pos / SIZE_OF_4K_BLK, &run));
+        if (blk == NULL){
+            return -EIO;
+        }
+        memcpy(dst, blk->data + offset, cnt);
+        bcache_release(blk);
+        dst += cnt;
+        pos += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+static long lz4_decompress(const uint8_t* src, uint32_t srclen, uint8_t* dst, uint32_t dstlen){
+    // input:
+    //     src: an LZ4 block
+    //     srclen: the size of the block
+    //     dst: the output buffer
+    //     dstlen: the size of the output buffer
+    // output:
+    //     return the number of bytes produced, -EBADFMT if the block is
+    //     malformed or does not fit into dst
+    // side effect:
+    // decodes the block. Each sequence is a token (literal length in the high
+    // nibble, match length - 4 in the low one, 15 meaning more length bytes
+    // follow), the literals, and a two byte little-endian match offset; the
+    // last sequence has literals only.
+
+    const uint8_t* ip = src;
+    const uint8_t* const iend = src + srclen;
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + dstlen;
+
+    while (ip < iend){
+        uint32_t token = *ip++;
+        uint32_t len = token >> 4;
+        if (len == 15){
+            uint8_t b;
+            do{
+                if (ip == iend){
+                    return -EBADFMT;
+                }
+                b = *ip++;
+                len += b;
+            }while (b == 255);
+        }
+        if (len > (uint32_t)(iend - ip) || len > (uint32_t)(oend - op)){
+            return -EBADFMT;
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend){
+            break;
+        }
+
+        if (iend - ip < 2){
+            return -EBADFMT;
+        }
+        uint32_t offset = ip[0] | (uint32_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)){
+            return -EBADFMT;
+        }
+        len = token & 15;
+        if (len == 15){
+            uint8_t b;
+            do{
+                if (ip == iend){
+                    return -EBADFMT;
+                }
+                b = *ip++;
+                len += b;
+            }while (b == 255);
+        }
+        len += 4;
+        if (len > (uint32_t)(oend - op)){
+            return -EBADFMT;
+        }
+        // the match may overlap the bytes being produced, copy one at a time
+        const uint8_t* match = op - offset;
+        while (len-- > 0){
+            *op++ = *match++;
+        }
+    }
+    return op - dst;
+}
+
+static uint64_t inode_bmap(const struct inode_info* inode, uint32_t fblk, uint32_t* run){
+    // input:
+    //     inode: the in-memory inode
+    //     fblk: a file block number, less than inode->num_blks
+    //     run: returns the number of blocks left in the extent from fblk on
+    // output:
+    //     return the device block number holding file block fblk
     // side effect:
     // none
+    uint32_t lo = 0;
+    uint32_t hi = inode->num_extents;
+    while (hi - lo > 1){
+        uint32_t mid = (lo + hi) / 2;
+        if (inode->extents[mid].fblk <= fblk){
+            lo = mid;
+        }else{
+            hi = mid;
+        }
+    }
+    const struct extent_info* ext = &inode->extents[lo];
+    *run = ext->len - (fblk - ext->fblk);
+    return start_of_data_blks + ext->start + (fblk - ext->fblk);
+}
+
+static int add_extent(struct inode_info* info, uint32_t start, uint32_t len){
+    // input:
+    //     info: the in-memory inode
+    //     start: the first data block of the new extent
+    //     len: the number of blocks
+    // output:
+    //     return 0 on success, -ENOSPC if the inode cannot hold another extent
+    // side effect:
+    // Appends an extent to the file, replacing the extent array with a larger one.
+    uint32_t max = (fs.version == KFS_VERSION_2) ? KFS2_MAX_EXTENTS :
+        SIZE_OF_4K_BLK / sizeof(struct extent_info);
+    if (info->num_extents >= max){
+        return -ENOSPC;
+    }
+    struct extent_info* extents = kmalloc((info->num_extents + 1) * sizeof(struct extent_info));
+    if (extents == NULL){
+        return -ENOSPC;
+    }
+    if (info->num_extents != 0){
+        memcpy(extents, info->extents, info->num_extents * sizeof(struct extent_info));
+    }
+    kfree(info->extents);
+    extents[info->num_extents].fblk = info->num_blks;
+    extents[info->num_extents].start = start;
+    extents[info->num_extents].len = len;
+    info->extents = extents;
+    info->num_extents++;
+    return 0;
+}
 
-    for (int i = 0; i < MAX_FILE_DESC; i++){
-        if (file_descs[i].flag == FILE_NOT_IN_USE){
-            return i;
+static uint32_t alloc_at(uint32_t start, uint32_t want){
+    // input:
+    //     start: the data block to allocate from
+    //     want: the largest number of blocks to allocate
+    // output:
+    //     return the number of free blocks allocated at start, possibly 0
+    // side effect:
+    // Marks the allocated blocks used.
+    uint32_t got = 0;
+    while (got < want && start + got < fs.map_nblks &&
+           !(fs.blk_map[(start + got) / 8] & (1 << ((start + got) % 8)))){
+        got++;
+    }
+    mark_blks(start, got, 1);
+    return got;
+}
+
+static uint32_t alloc_any(uint32_t want, uint32_t* start){
+    // input:
+    //     want: the number of blocks wanted
+    //     start: returns the first allocated block
+    // output:
+    //     return the number of blocks allocated, 0 if the data area is full
+    // side effect:
+    // Allocates the first free run of want blocks, or the largest free run if
+    // there is none that long, and marks it used.
+    uint32_t best = 0;
+    uint32_t best_start = 0;
+    uint32_t b = 0;
+    while (b < fs.map_nblks && best < want){
+        if (fs.blk_map[b / 8] & (1 << (b % 8))){
+            b++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (run < want && b + run < fs.map_nblks &&
+               !(fs.blk_map[(b + run) / 8] & (1 << ((b + run) % 8)))){
+            run++;
+        }
+        if (run > best){
+            best = run;
+            best_start = b;
+        }
+        b += run;
+    }
+    if (best != 0){
+        mark_blks(best_start, best, 1);
+    }
+    *start = best_start;
+    return best;
+}
+
+static void mark_blks(uint32_t start, uint32_t len, int used){
+    // input:
+    //     start: the first data block
+    //     len: the number of blocks
+    //     used: 1 to mark the blocks used, 0 to mark them free
+    // output:
+    //     none
+    // side effect:
+    // Updates the free-space bitmap; blocks outside of it are ignored.
+    for (uint32_t b = start; b < start + len && b < fs.map_nblks; b++){
+        if (used){
+            fs.blk_map[b / 8] |= 1 << (b % 8);
+        }else{
+            fs.blk_map[b / 8] &= ~(1 << (b % 8));
         }
     }
-    return MAX_FILE_DESC;
 }
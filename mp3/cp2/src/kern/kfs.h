@@ -7,6 +7,8 @@
 #include "error.h"
 #include "io.h"
 #include "fs.h"
+#include "bcache.h"
+#include "thread.h"
 
 #define RESERVED_SP_BOOTBLK 52
 #define RESERVED_SP_ENTRY 28
@@ -22,7 +24,23 @@
 #define FILE_NOT_IN_USE 0
 #define START_IDX_OF_INODE 1
 #define POS_BOOT_BLK 0
-#define MAX_FILE_DESC 16
+#define MIN_DIR_INDEX_SIZE 16
+#define RA_MIN_BLKS 2
+#define RA_DEFAULT_MAX_BLKS 8
+#define RA_MAX_BLKS (BCACHE_NBLK / 2)
+#define NEG_CACHE_SIZE 16
+#define FS_FLUSH_INTERVAL 5
+#define PREALLOC_BLKS 16
+#define FS_PAGE_CACHE_SIZE 32
+#define MAX_MAP_BLKS (SIZE_OF_4K_BLK * 8)    // data blocks covered by the free-space bitmap
+#define KFS_MAGIC 0x3253464b          // "KFS2" in the boot block of v2 images
+#define KFS_VERSION_2 2
+#define KFS2_INODE_SIZE 256
+#define KFS2_INODES_PER_BLK (SIZE_OF_4K_BLK / KFS2_INODE_SIZE)
+#define KFS2_MAX_EXTENTS 31
+#define KFS2_INODE_COMPRESSED 0x0001  // inode flag: data stored as compressed chunks
+#define KFS_ZCHUNK_SIZE SIZE_OF_4K_BLK   // bytes of file data per compressed chunk
+#define KFS_MAX_ZCHUNKS (SIZE_OF_4K_BLK / sizeof(uint32_t) - 1)
 
 struct entry{
     char name[MAX_FINENAME];
@@ -30,18 +48,67 @@ struct entry{
     uint8_t preserved[RESERVED_SP_ENTRY];
 }__attribute((packed));
 
+// v1 images leave magic and version zero; v2 images set them to KFS_MAGIC
+// and KFS_VERSION_2
 struct boot_blk{
     uint32_t num_entries;
     uint32_t num_inodes;
     uint32_t num_data_blks;
-    uint8_t preserved[RESERVED_SP_BOOTBLK];
+    uint32_t magic;
+    uint32_t version;
+    uint8_t preserved[RESERVED_SP_BOOTBLK - 8];
     struct entry entries[MAX_FILES];
 
 }__attribute((packed));
 
+// a run of file blocks stored in consecutive data blocks
+struct extent_info{
+    uint32_t fblk;      // first file block of the run
+    uint32_t start;     // first data block of the run
+    uint32_t len;       // number of blocks
+};
+
+// in-memory copy of the part of an on-disk inode needed to access the file,
+// loaded once at mount time and shared by all file descriptors
+struct inode_info{
+    uint32_t length;
+    uint32_t num_blks;
+    uint32_t num_extents;
+    struct extent_info* extents;    // sorted by fblk, covering num_blks blocks
+    uint32_t prealloc;  // blocks reserved right after the last extent
+    uint32_t opens;     // open descriptors, the reservation outlives all but the last
+    struct lock lock;   // held by fs_read and fs_write of the file
+    // compressed files: num_blks counts the stored blocks and length the
+    // uncompressed bytes; the chunk table is read on first access
+    uint16_t flags;             // KFS2_INODE_* flags of the on-disk inode
+    uint32_t num_chunks;
+    uint32_t* chunk_off;        // num_chunks + 1 offsets into the stored data
+    char* zbuf;                 // the chunk decompressed last
+    uint32_t zbuf_chunk;        // chunk held in zbuf, UINT32_MAX if none
+    char* zscratch;             // compressed chunk spanning two blocks
+};
+
+// remembers a name that is known not to be in the directory
+struct neg_entry{
+    uint32_t hash;
+    uint8_t valid;
+    char name[MAX_FINENAME];
+};
+
 struct fs{
     struct io_intf* dev_io_intf;
+    struct lock lock;           // serializes block allocation and the boot block
     struct boot_blk boot_blk;
+    uint32_t version;           // 1 or KFS_VERSION_2
+    struct inode_info* inodes;  // num_inodes entries
+    // open-addressed hash index over boot_blk.entries, holding entry index + 1
+    // (0 marks an empty slot); dir_index_mask + 1 is a power of two
+    uint16_t* dir_index;
+    uint32_t dir_index_mask;
+    // free-space bitmap of the data area, one bit per data block (1 = in use)
+    uint8_t* blk_map;
+    uint32_t map_nblks;
+    struct neg_entry neg_cache[NEG_CACHE_SIZE];
 };
 
 
@@ -50,18 +117,67 @@ struct inode{
     uint32_t data_blks[MAX_DATA_BLKS];
 }__attribute((packed));
 
+// v2 on-disk inode, KFS2_INODES_PER_BLK of them share a block
+struct extent{
+    uint32_t start;     // first data block
+    uint32_t len;       // number of blocks
+}__attribute((packed));
+
+struct inode_v2{
+    uint32_t length;
+    uint16_t num_extents;
+    uint16_t flags;     // KFS2_INODE_*, zero in images without compression
+    struct extent extents[KFS2_MAX_EXTENTS];
+}__attribute((packed));
+
+// start of the stored data of a compressed file, followed by num_chunks + 1
+// byte offsets into the stored data; chunk k occupies [off[k], off[k + 1]),
+// and a chunk whose stored size equals its uncompressed size is kept as is.
+// Compressed chunks are in the LZ4 block format.
+struct zchunk_hdr{
+    uint32_t chunk_size;    // KFS_ZCHUNK_SIZE
+    uint32_t num_chunks;
+}__attribute((packed));
+
 struct data_blk{
     char data[SIZE_OF_4K_BLK];
 }__attribute((packed));
 
+// state of an open file; fs_open hands out a pointer to the embedded io_intf
+// and the fs_* functions recover the descriptor from it with offsetof
 struct file_desc{
-    struct io_intf* io_intf;
+    struct io_intf io_intf;
+    struct file_desc* next_free;    // link in the pool while unused
+    uint32_t mount_gen;             // fs_mount generation the file was opened in
     uint64_t pos;
-    uint64_t size;
     uint64_t inodes;
     uint64_t flag;
+    // readahead state: a read starting at ra_pos continues the previous one
+    uint64_t ra_pos;
+    uint32_t ra_win;    // current window in blocks, 0 while access is random
+    uint32_t ra_max;    // upper bound for ra_win, 0 disables readahead
+    uint32_t ra_next;   // first block of the last window read ahead
+    uint32_t ra_end;    // first file block not yet read ahead
+    uint64_t wr_end;    // end of the previous write, to detect appends
+};
+
+// a directory record returned by fs_readdir
+struct fs_dirent{
+    char name[MAX_FINENAME + 1];    // always NUL-terminated
+    uint32_t inode;
+    uint32_t size;                  // file length in bytes
+};
+
+// a page of file data handed out to memory mappings; refcnt counts the
+// mappings, an unreferenced page stays cached until its slot is reused
+struct fs_page{
+    uint32_t ino;
+    uint32_t pgidx;
+    uint32_t refcnt;
+    void* page;
 };
 
+#define FILE_DESC_PER_PAGE (SIZE_OF_4K_BLK / sizeof(struct file_desc))
 
 extern void fs_init(void);
 extern int fs_mount(struct io_intf* io);
@@ -71,13 +187,36 @@ void fs_close(struct io_intf* io);
 long fs_read(struct io_intf* io, void* buf, unsigned long n);
 long fs_write(struct io_intf* io, const void* buf, unsigned long n);
 int fs_ioctl(struct io_intf* io, int cmd, void* arg);
-int fs_getlen(int fd, void* arg);
-int fs_setpos(int fd, void* arg);
-int fs_getpos(int fd, void* arg);
-int fs_getblksize(int fd, void* arg);
+int fs_getlen(struct file_desc* desc, void* arg);
+int fs_setpos(struct file_desc* desc, void* arg);
+int fs_getpos(struct file_desc* desc, void* arg);
+int fs_getblksize(struct file_desc* desc, void* arg);
+int fs_getra(struct file_desc* desc, void* arg);
+int fs_setra(struct file_desc* desc, void* arg);
+void fs_readahead(struct file_desc* desc, uint64_t pos, uint32_t end_blk);
 
 uint32_t find_inode_by_name(const char* name);
-//struct file_desc* find_last_file_desc_by_io(struct io_intf* io);
-int find_file_desc_by_io(struct io_intf* io);
-int find_idle_file_desc(void);
+int fs_readdir(uint32_t* cookie, struct fs_dirent* ents, uint32_t max);
+int load_inode_table(struct io_intf* io, const struct boot_blk* boot, uint32_t version,
+                     struct inode_info** inodes);
+void free_inode_table(struct inode_info* inodes, uint32_t num_inodes);
+int load_inode_v1(struct io_intf* io, uint32_t ino, struct inode_info* info);
+int load_inode_v2(struct io_intf* io, const struct boot_blk* boot, uint32_t ino,
+                  struct inode_info* info);
+int load_blk_map(struct io_intf* io, const struct boot_blk* boot, uint64_t data_start,
+                 const struct inode_info* inodes, uint8_t** map, uint32_t* map_nblks);
+int grow_file(uint32_t ino, uint32_t new_blks, uint32_t prealloc);
+void release_prealloc(uint32_t ino);
+int write_inode(uint32_t ino);
+int write_boot_blk(void);
+int build_dir_index(const struct boot_blk* boot, uint16_t** index, uint32_t* mask);
+int load_chunk_table(uint32_t ino);
+int read_chunk(uint32_t ino, uint32_t chunk, char* dst);
+int fs_file_ino(struct io_intf* io, uint32_t* ino);
+int fs_get_page(uint32_t ino, uint32_t pgidx, void** pp);
+void fs_put_page(void* pp);
+void fs_sync_pages(uint32_t ino, uint32_t first, uint32_t last);
+struct file_desc* file_desc_of(struct io_intf* io);
+struct file_desc* alloc_file_desc(void);
+void free_file_desc(struct file_desc* desc);
 #endif
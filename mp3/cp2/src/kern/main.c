@@ -23,11 +23,14 @@
 #include "halt.h"
 #include "elf.h"
 #include "fs.h"
+#include "elevator.h"
 #include "string.h"
 #include "process.h"
 #include "config.h"
 
 
+static struct elevator blkelv;
+
 void main(void) {
     struct io_intf * initio;
     struct io_intf * blkio;
@@ -65,7 +68,8 @@ void main(void) {
     if (result != 0)
         panic("device_open failed");
     
-    result = fs_mount(blkio);
+    // the file system reaches the disk through the request scheduler
+    result = fs_mount(elevator_init(&blkelv, blkio));
 
     debug("Mounted blk0");
 
@@ -12,6 +12,7 @@
 #include "halt.h"
 #include "elf.h"
 #include "fs.h"
+#include "elevator.h"
 #include "string.h"
 
 //           end of kernel image (defined in kernel.ld)
@@ -32,6 +33,8 @@ extern char _kimg_end[];
 
 static void shell_main(struct io_intf * termio);
 
+static struct elevator blkelv;
+
 void main(void) {
     struct io_intf * termio;
     struct io_intf * blkio;
@@ -71,7 +74,8 @@ void main(void) {
     if (result != 0)
         panic("device_open failed");
     
-    result = fs_mount(blkio);
+    //           the file system reaches the disk through the request scheduler
+    result = fs_mount(elevator_init(&blkelv, blkio));
 
     debug("Mounted blk0");
 
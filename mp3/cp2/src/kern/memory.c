@@ -24,6 +24,7 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "mmap.h"
 
 #include <stdint.h>
 
@@ -104,6 +105,7 @@ static inline struct pte null_pte(void);
 static inline void sfence_vma(void);
 
 static int free_ptab(struct pte * ptab);
+static struct pte * walk_pte(uintptr_t vma, int create);
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -564,6 +566,86 @@ void memory_unmap_and_free_user(){
     }
 }
 
+void memory_map_page(uintptr_t vma, void * pp, uint_fast8_t rwxug_flags){
+    // input:
+    //  vma: the virtual address of the page to map
+    //  pp: the physical page to map
+    //  rwxug_flags: an OR of the PTE flags
+    //
+    // output: none
+    //
+    // side effect:
+    //  Maps /pp/ at /vma/ in the active memory space, allocating page tables
+    //  as needed. A page previously mapped at /vma/ is not freed.
+
+    trace("%s(%p, %p, %x)", __func__, vma, pp, rwxug_flags);
+    struct pte * pte = walk_pte(round_down_addr(vma, PAGE_SIZE), 1);
+    *pte = leaf_pte(pp, rwxug_flags);
+    sfence_vma();
+}
+
+void * memory_unmap_page(uintptr_t vma, uint_fast8_t * rwxug_flags){
+    // input:
+    //  vma: the virtual address of the page to unmap
+    //  rwxug_flags: returns the flags the page was mapped with, may be NULL
+    //
+    // output:
+    //  return the physical page that was mapped at vma, NULL if none
+    //
+    // side effect:
+    //  Removes the mapping from the active memory space without freeing the
+    //  page; the caller owns it afterwards.
+
+    trace("%s(%p)", __func__, vma);
+    struct pte * pte = walk_pte(round_down_addr(vma, PAGE_SIZE), 0);
+    if (pte == NULL || !(pte->flags & PTE_V))
+        return NULL;
+
+    void * pp = pagenum_to_pageptr(pte->ppn);
+    if (rwxug_flags != NULL)
+        *rwxug_flags = pte->flags & (PTE_R | PTE_W | PTE_X | PTE_U | PTE_G);
+    *pte = null_pte();
+    sfence_vma();
+    return pp;
+}
+
+uintptr_t memory_translate_vptr(const void * vp, uint_fast8_t rwxug_flags){
+    // input:
+    //  vp: a virtual address
+    //  rwxug_flags: the flags the page containing vp must be mapped with
+    //
+    // output:
+    //  return the physical address vp maps to, 0 if it is not mapped with
+    //  the flags
+    //
+    // side effect: none
+
+    const uintptr_t vma = (uintptr_t)vp;
+    struct pte * ptab = active_space_root();
+    struct pte pte;
+    size_t size = GIGA_SIZE;
+
+    if (!wellformed_vma(vma))
+        return 0;
+
+    // descend until a leaf, which has one of R, W and X set
+    pte = ptab[VPN2(vma)];
+    if ((pte.flags & PTE_V) && !(pte.flags & (PTE_R | PTE_W | PTE_X))) {
+        ptab = (struct pte *)pagenum_to_pageptr(pte.ppn);
+        pte = ptab[VPN1(vma)];
+        size = MEGA_SIZE;
+        if ((pte.flags & PTE_V) && !(pte.flags & (PTE_R | PTE_W | PTE_X))) {
+            ptab = (struct pte *)pagenum_to_pageptr(pte.ppn);
+            pte = ptab[VPN0(vma)];
+            size = PAGE_SIZE;
+        }
+    }
+
+    if (!(pte.flags & PTE_V) || (pte.flags & rwxug_flags) != rwxug_flags)
+        return 0;
+    return (uintptr_t)pagenum_to_pageptr(pte.ppn) + (vma & (size - 1));
+}
+
 int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_flags){
     // input:
     //  vp: a pointer to a virtual address
@@ -623,6 +705,55 @@ int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
     return 0;
 }
 
+int memory_fault_in_range(const void * vp, size_t len, uint_fast8_t rwxug_flags){
+    // input:
+    //  vp: the start of a range in the user region
+    //  len: the length of the range
+    //  rwxug_flags: the flags every page of the range must be mapped with
+    //
+    // output:
+    //  return 0 if every page of the range is mapped with the flags, -EINVAL
+    //  if the range leaves the user region, -EACCESS or another negative
+    //  error code if a page cannot be mapped with the flags
+    //
+    // side effect:
+    //  Resolves the faults a user access to the range would take: pages of
+    //  mapped files are filled from the file, a write to a private file page
+    //  copies it, and any other missing page is allocated zero-filled.
+
+    trace("%s(%p, %zu, %x)", __func__, vp, len, rwxug_flags);
+    const uintptr_t end = (uintptr_t)vp + len;
+    uintptr_t vma;
+    int tries;
+    int result;
+
+    if (len == 0)
+        return 0;
+    if ((uintptr_t)vp < USER_START_VMA || end > USER_END_VMA || end < (uintptr_t)vp)
+        return -EINVAL;
+
+    for (vma = round_down_addr((uintptr_t)vp, PAGE_SIZE); vma < end; vma += PAGE_SIZE) {
+        // a write to a private file page that was never touched takes two
+        // faults: one maps the file page, the next copies it
+        for (tries = 0; memory_translate_vptr((void*)vma, rwxug_flags) == 0; tries++) {
+            if (tries == 2)
+                return -EACCESS;
+            result = mmap_handle_fault(vma);
+            if (result < 0)
+                return result;
+            if (result > 0)
+                continue;
+            // not a file page; only a missing page can be supplied
+            if (memory_translate_vptr((void*)vma, 0) != 0)
+                return -EACCESS;
+            void * pp = memory_alloc_page();
+            memset(pp, 0, PAGE_SIZE);
+            memory_map_page(vma, pp, PTE_R | PTE_W | PTE_U);
+        }
+    }
+    return 0;
+}
+
 void memory_handle_page_fault(const void * vptr){
     // input:
     //  vptr: a pointer to the virtual address that caused the page fault
@@ -636,6 +767,14 @@ void memory_handle_page_fault(const void * vptr){
     trace("%s(%p)", __func__, vptr);
     if (((uintptr_t)vptr >= USER_START_VMA) && ((uintptr_t)vptr < USER_END_VMA) 
         && wellformed_vptr(vptr)) {
+        // pages of memory-mapped files are filled from the file
+        int result = mmap_handle_fault((uintptr_t)vptr);
+        if (result > 0)
+            return;
+        if (result < 0) {
+            kprintf("Bad access to mapped file at %p, process exit.\n", vptr);
+            process_exit();
+        }
         const void* vptr1 = round_down_ptr((void*)vptr, PAGE_SIZE);
         // set pointer of pte for 3 levels
         struct pte * ptab2 = active_space_root();
@@ -697,6 +836,45 @@ static int free_ptab(struct pte * ptab) {
     memory_free_page((void *)ptab);
     return 1;
 }
+static struct pte * walk_pte(uintptr_t vma, int create) {
+    // input:
+    //  vma: a page-aligned virtual address
+    //  create: whether to allocate missing page tables
+    //
+    // output:
+    //  the leaf PTE for vma in the active memory space, or NULL if a page
+    //  table is missing and create is 0
+    //
+    // side effect:
+    //  May allocate page tables
+
+    struct pte * ptab2 = active_space_root();
+    struct pte * ptab1;
+    struct pte * ptab0;
+    uintptr_t vpn2 = VPN2(vma);
+    uintptr_t vpn1 = VPN1(vma);
+    uintptr_t vpn0 = VPN0(vma);
+
+    if (!(ptab2[vpn2].flags & PTE_V)) {
+        if (!create)
+            return NULL;
+        ptab1 = memory_alloc_page();
+        memset(ptab1, 0, PAGE_SIZE);
+        ptab2[vpn2] = ptab_pte(ptab1, 0);
+    }
+    ptab1 = (struct pte *)pagenum_to_pageptr(ptab2[vpn2].ppn);
+
+    if (!(ptab1[vpn1].flags & PTE_V)) {
+        if (!create)
+            return NULL;
+        ptab0 = memory_alloc_page();
+        memset(ptab0, 0, PAGE_SIZE);
+        ptab1[vpn1] = ptab_pte(ptab0, 0);
+    }
+    ptab0 = (struct pte *)pagenum_to_pageptr(ptab1[vpn1].ppn);
+    return &ptab0[vpn0];
+}
+
 static inline int wellformed_vma(uintptr_t vma) {
     // Address bits 63:38 must be all 0 or all 1
     uintptr_t const bits = (intptr_t)vma >> 38;
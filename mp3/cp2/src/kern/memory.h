@@ -122,6 +122,29 @@ extern void * memory_alloc_and_map_page (
 extern void * memory_alloc_and_map_range (
     uintptr_t vma, size_t size, uint_fast8_t rwxug_flags);
 
+// void memory_map_page(uintptr_t vma, void * pp, uint_fast8_t rwxug_flags)
+// Maps the existing physical page /pp/ at /vma/ in the current memory space
+// with the given R, W, X, U and G flags. Unlike memory_alloc_and_map_page, the
+// page may also be mapped elsewhere (e.g. a page of a memory-mapped file shared
+// between processes).
+
+extern void memory_map_page(uintptr_t vma, void * pp, uint_fast8_t rwxug_flags);
+
+// void * memory_unmap_page(uintptr_t vma, uint_fast8_t * rwxug_flags)
+// Removes the mapping of the page at /vma/ from the current memory space and
+// returns the physical page, or NULL if nothing was mapped. The page is not
+// freed. If /rwxug_flags/ is not NULL, the flags of the mapping are stored
+// there.
+
+extern void * memory_unmap_page(uintptr_t vma, uint_fast8_t * rwxug_flags);
+
+// uintptr_t memory_translate_vptr(const void * vp, uint_fast8_t rwxug_flags)
+// Returns the physical address that /vp/ maps to in the current memory space,
+// or 0 if the page containing /vp/ is not mapped with at least the given
+// flags. Works with pages, megapages and gigapages.
+
+extern uintptr_t memory_translate_vptr(const void * vp, uint_fast8_t rwxug_flags);
+
 // void memory_unmap_and_free_range(void * vp, size_t size)
 
 // void memory_unmap_and_free_user(void)
@@ -162,6 +185,17 @@ extern int memory_validate_vptr_len (
 extern int memory_validate_vstr (
     const char * vs, uint_fast8_t ug_flags);
 
+// int memory_fault_in_range (
+//     const void * vp, size_t len, uint_fast8_t rwxug_flags)
+// Maps every page of a range in the user region with at least the given
+// flags, resolving the faults a user access would take (mapped file pages,
+// copy-on-write and zero-filled pages). Used on user buffers before the kernel
+// accesses them. Returns 0 on success, or a negative error code if a page of
+// the range cannot be mapped with the flags.
+
+extern int memory_fault_in_range (
+    const void * vp, size_t len, uint_fast8_t rwxug_flags);
+
 // Called from excp.c to handle a page fault at the specified address. Either
 // maps a page containing the faulting address, or calls process_exit().
 
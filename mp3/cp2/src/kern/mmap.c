@@ -0,0 +1,249 @@
+// mmap.c - Memory-mapped files
+//
+
+#ifdef MMAP_TRACE
+#define TRACE
+#endif
+
+#ifdef MMAP_DEBUG
+#define DEBUG
+#endif
+
+#include "mmap.h"
+#include "config.h"
+#include "console.h"
+#include "error.h"
+#include "kfs.h"
+#include "memory.h"
+#include "process.h"
+#include "string.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static struct mmap_region * find_region(uintptr_t vma);
+static uintptr_t find_free_range(size_t len);
+static void release_region(struct mmap_region * region);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+int mmap_file (
+    struct io_intf * io, size_t off, size_t len, int flags, uintptr_t * vma)
+{
+    // input:
+    //  io: an open kfs file
+    //  off: the file offset to map from, page-aligned
+    //  len: the number of bytes to map, all within the file
+    //  flags: MAP_SHARED or MAP_PRIVATE
+    //  vma: returns the start of the mapping
+    //
+    // output:
+    //  return 0 on success, relative errcode on failure
+    //
+    // side effect:
+    //  Records the mapping in the current process. No page is mapped yet.
+
+    struct process * proc = current_process();
+    struct mmap_region * region = NULL;
+    uint64_t flen;
+    uint32_t ino;
+    uintptr_t start;
+    int result;
+    int i;
+
+    trace("%s(io=%p,off=%zu,len=%zu,flags=%d)", __func__, io, off, len, flags);
+
+    if (len == 0 || off % PAGE_SIZE != 0 ||
+        (flags != MAP_SHARED && flags != MAP_PRIVATE))
+        return -EINVAL;
+
+    result = fs_file_ino(io, &ino);
+    if (result != 0)
+        return result;
+
+    result = ioctl(io, IOCTL_GETLEN, &flen);
+    if (result != 0)
+        return result;
+    if (len > SIZE_MAX - off || off + len > flen)
+        return -EINVAL;
+
+    for (i = 0; i < MMAP_MAX; i++) {
+        if (proc->mmaps[i].start == 0) {
+            region = &proc->mmaps[i];
+            break;
+        }
+    }
+
+    if (region == NULL)
+        return -EMFILE;
+
+    len = (len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    start = find_free_range(len);
+    if (start == 0)
+        return -ENOSPC;
+
+    region->start = start;
+    region->len = len;
+    region->ino = ino;
+    region->pgoff = off / PAGE_SIZE;
+    region->flags = flags;
+
+    *vma = start;
+    return 0;
+}
+
+int mmap_unmap(uintptr_t vma) {
+    // input:
+    //  vma: the start of a mapping returned by mmap_file
+    //
+    // output:
+    //  return 0 on success, -EINVAL if there is no such mapping
+    //
+    // side effect:
+    //  Unmaps the pages of the mapping and releases them.
+
+    struct mmap_region * region = find_region(vma);
+
+    trace("%s(%p)", __func__, vma);
+
+    if (region == NULL || region->start != vma)
+        return -EINVAL;
+
+    release_region(region);
+    return 0;
+}
+
+int mmap_handle_fault(uintptr_t vma) {
+    // input:
+    //  vma: the faulting address
+    //
+    // output:
+    //  1 if handled, 0 if vma is not mapped from a file, relative errcode if
+    //  the access is not allowed
+    //
+    // side effect:
+    //  Maps the page of the file, shared and read-only, on the first access.
+    //  A write to such a page of a private mapping replaces it with a
+    //  writable copy.
+
+    struct mmap_region * region = find_region(vma);
+    uint_fast8_t flags;
+    uint32_t pgidx;
+    void * copy;
+    void * pp;
+    int result;
+
+    trace("%s(%p)", __func__, vma);
+
+    if (region == NULL)
+        return 0;
+
+    vma = vma / PAGE_SIZE * PAGE_SIZE;
+    pgidx = region->pgoff + (vma - region->start) / PAGE_SIZE;
+    pp = memory_unmap_page(vma, &flags);
+
+    if (pp == NULL) {
+        result = fs_get_page(region->ino, pgidx, &pp);
+        if (result != 0)
+            return result;
+        memory_map_page(vma, pp, PTE_R | PTE_U);
+        return 1;
+    }
+
+    if (region->flags == MAP_PRIVATE && !(flags & PTE_W)) {
+        copy = memory_alloc_page();
+        memcpy(copy, pp, PAGE_SIZE);
+        fs_put_page(pp);
+        memory_map_page(vma, copy, PTE_R | PTE_W | PTE_U);
+        return 1;
+    }
+
+    // the page is there, the access itself is not allowed
+    memory_map_page(vma, pp, flags);
+    return -EACCESS;
+}
+
+void mmap_release_all(struct process * proc) {
+    uintptr_t saved_mtag;
+    int i;
+
+    // the pages are unmapped from the active memory space
+    saved_mtag = memory_space_switch(proc->mtag);
+
+    for (i = 0; i < MMAP_MAX; i++) {
+        if (proc->mmaps[i].start != 0)
+            release_region(&proc->mmaps[i]);
+    }
+
+    memory_space_switch(saved_mtag);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+struct mmap_region * find_region(uintptr_t vma) {
+    struct process * proc = current_process();
+    int i;
+
+    for (i = 0; i < MMAP_MAX; i++) {
+        if (proc->mmaps[i].start != 0 && proc->mmaps[i].start <= vma &&
+            vma - proc->mmaps[i].start < proc->mmaps[i].len)
+        {
+            return &proc->mmaps[i];
+        }
+    }
+
+    return NULL;
+}
+
+uintptr_t find_free_range(size_t len) {
+    // Returns the lowest address in [USER_MMAP_VMA,USER_MMAP_END_VMA) where
+    // /len/ bytes do not overlap another mapping, or 0 if there is none.
+
+    struct process * proc = current_process();
+    uintptr_t start = USER_MMAP_VMA;
+    int moved = 1;
+    int i;
+
+    while (moved) {
+        moved = 0;
+        for (i = 0; i < MMAP_MAX; i++) {
+            const struct mmap_region * r = &proc->mmaps[i];
+            if (r->start != 0 && r->start < start + len &&
+                start < r->start + r->len)
+            {
+                start = r->start + r->len;
+                moved = 1;
+            }
+        }
+        if (USER_MMAP_END_VMA - start < len)
+            return 0;
+    }
+
+    return start;
+}
+
+void release_region(struct mmap_region * region) {
+    // Unmaps every page of the region. Read-only pages come from the kfs page
+    // cache and are handed back to it; writable pages are private copies.
+
+    uint_fast8_t flags;
+    uintptr_t vma;
+    void * pp;
+
+    for (vma = region->start; vma < region->start + region->len; vma += PAGE_SIZE) {
+        pp = memory_unmap_page(vma, &flags);
+        if (pp == NULL)
+            continue;
+        if (flags & PTE_W)
+            memory_free_page(pp);
+        else
+            fs_put_page(pp);
+    }
+
+    region->start = 0;
+}
@@ -0,0 +1,83 @@
+// mmap.h - Memory-mapped files
+//
+
+#ifndef _MMAP_H_
+#define _MMAP_H_
+
+#include "io.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// MMAP_MAX is the maximum number of file mappings of a process.
+
+#ifndef MMAP_MAX
+#define MMAP_MAX 8
+#endif
+
+// CONSTANT DEFINITIONS
+//
+
+// Mapping flags. A shared mapping is read-only and maps the pages of the kfs
+// page cache directly, so all processes mapping the same file share them. A
+// private mapping starts out the same way but copies a page on the first write
+// to it (copy-on-write); the changes are not written back to the file.
+
+#define MAP_SHARED  0
+#define MAP_PRIVATE 1
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+// A file mapping of a process. The mapping covers /len/ bytes (a multiple of
+// the page size) at /start/ and maps the file starting at page /pgoff/. An
+// unused entry has start == 0.
+
+struct mmap_region {
+    uintptr_t start;
+    size_t len;
+    uint32_t ino;
+    uint32_t pgoff;
+    int flags;
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+struct process;
+
+// int mmap_file (
+//     struct io_intf * io, size_t off, size_t len, int flags, uintptr_t * vma)
+// Maps /len/ bytes of the kfs file /io/, starting at the page-aligned offset
+// /off/, into the user region of the current process. The range must lie
+// within the file. Nothing is read yet;
+// pages are filled by mmap_handle_fault when they are first touched. Returns 0
+// and the address of the mapping in /vma/, or a negative error code.
+
+extern int mmap_file (
+    struct io_intf * io, size_t off, size_t len, int flags, uintptr_t * vma);
+
+// int mmap_unmap(uintptr_t vma)
+// Removes the mapping of the current process starting at /vma/.
+
+extern int mmap_unmap(uintptr_t vma);
+
+// int mmap_handle_fault(uintptr_t vma)
+// Called by memory_handle_page_fault and memory_fault_in_range for a fault in
+// the user region. Returns 1 if the fault was resolved by mapping a file page,
+// 0 if /vma/ is not in a file mapping, or a negative error code if the access
+// is not allowed (e.g. a write to a shared mapping).
+
+extern int mmap_handle_fault(uintptr_t vma);
+
+// void mmap_release_all(struct process * proc)
+// Removes all mappings of process /proc/. Must be called before the user
+// pages of the process are freed, since shared pages belong to the kfs page
+// cache.
+
+extern void mmap_release_all(struct process * proc);
+
+#endif // _MMAP_H_
@@ -99,6 +99,8 @@ int process_exec(struct io_intf * exeio){
 
     // Executing a loaded program with process exec has 4 main requirements:
     // (a) First any virtual memory mappings belonging to other user processes should be unmapped.
+    // Pages of mapped files belong to the kfs page cache, so drop them first.
+    mmap_release_all(current_process());
     memory_unmap_and_free_user();
 
     // (b) Then a fresh 2nd level (root) page table should be created and initialized with the default mappings for a user process.
@@ -149,6 +151,7 @@ extern void process_terminate(int pid){
     assert(proctab[pid] != NULL);
     struct process * proc = proctab[pid];
     // free all memory associated with the process
+    mmap_release_all(proc);
     memory_space_reclaim();
     for(int i = 1; i < PROCESS_IOMAX; i++){
         if(proc->iotab[i] != NULL){
@@ -13,6 +13,7 @@
 #include "thread.h"
 #include "error.h"
 #include "memory.h"
+#include "mmap.h"
 #include "csr.h"
 #include "intr.h"
 #include "string.h"
@@ -25,6 +26,7 @@ struct process {
     int tid; // thread id of associated thread
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct mmap_region mmaps[MMAP_MAX]; // memory-mapped files
 };
 
 // EXPORTED VARIABLES DECLARATIONS
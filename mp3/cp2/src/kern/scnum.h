@@ -14,9 +14,13 @@
 #define SYSCALL_READ    21
 #define SYSCALL_WRITE   22
 #define SYSCALL_IOCTL   23
+#define SYSCALL_READDIR 24
 
 #define SYSCALL_EXEC    30
 #define SYSCALL_FORK    31
 
+#define SYSCALL_MMAP    40
+#define SYSCALL_MUNMAP  41
+
 
 #endif // _SCNUM_H_
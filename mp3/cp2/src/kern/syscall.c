@@ -15,6 +15,7 @@
 #include "kfs.h"
 #include "device.h"
 #include "process.h"
+#include "mmap.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -31,6 +32,9 @@ static int sysclose(int fd);
 static long sysread(int fd, void * buf, size_t bufsz);
 static long syswrite(int fd, const void * buf, size_t len);
 static int sysioctl(int fd, int cmd, void * arg);
+static long sysreaddir(uint32_t * cookie, struct fs_dirent * ents, size_t n);
+static long sysmmap(int fd, size_t off, size_t len, int flags);
+static int sysmunmap(void * addr);
 
 
 //           EXPORTED FUNCTION DEFINITIONS
@@ -83,6 +87,12 @@ int64_t syscall(struct trap_frame * tfr) {
             return syswrite((int)a[0], (const void *)a[1], (size_t)a[2]);
         case SYSCALL_IOCTL:
             return sysioctl((int)a[0], (int)a[1], (void *)a[2]);
+        case SYSCALL_READDIR:
+            return sysreaddir((uint32_t *)a[0], (struct fs_dirent *)a[1], (size_t)a[2]);
+        case SYSCALL_MMAP:
+            return sysmmap((int)a[0], (size_t)a[1], (size_t)a[2], (int)a[3]);
+        case SYSCALL_MUNMAP:
+            return sysmunmap((void *)a[0]);
         default:
             kprintf("syscall: invalid syscall %d\n", tfr->x[TFR_A7]);
             return -ENOTSUP;
@@ -255,6 +265,11 @@ static long sysread(int fd, void *buf, size_t bufsz){
         kprintf("sysread: file descriptor %d not open\n", fd);
         return -EBADFD;
     }
+    // map the buffer writable before the kernel (or the device) fills it
+    if (memory_fault_in_range(buf, bufsz, PTE_U | PTE_W) != 0){
+        kprintf("sysread: invalid buffer at %p\n", buf);
+        return -EINVAL;
+    }
 
     return io->ops->read(io, buf, bufsz);
 }
@@ -277,6 +292,11 @@ static long syswrite(int fd, const void *buf, size_t len){
         kprintf("syswrite: file descriptor %d not open\n", fd);
         return -EBADFD;
     }
+    // map the buffer before the kernel (or the device) reads it
+    if (memory_fault_in_range(buf, len, PTE_U | PTE_R) != 0){
+        kprintf("syswrite: invalid buffer at %p\n", buf);
+        return -EINVAL;
+    }
 
     return io->ops->write(io, buf, len);
 }
@@ -302,6 +322,37 @@ static int sysioctl(int fd, int cmd, void *arg){
     return io->ops->ctl(io, cmd, arg);
 }
 
+static long sysreaddir(uint32_t * cookie, struct fs_dirent * ents, size_t n){
+    // input: cookie - directory position, 0 to start, updated for the next call
+    //        ents - array of records to fill
+    //        n - number of records in ents
+    //
+    // output: return the number of records filled, 0 at the end of the directory,
+    //         relative errcode on failure
+    //
+    // side effect: list the files of the mounted file system
+    //
+    trace("%s(cookie=%p, ents=%p, n=%d)", __func__, cookie, ents, n);
+    if (cookie == NULL || ents == NULL){
+        return -EINVAL;
+    }
+    if (n > MAX_FILES){
+        n = MAX_FILES;
+    }
+    // fs_readdir writes through both pointers, so they must be writable user
+    // memory; pages of the buffers the process has not touched yet (e.g. on
+    // its stack) are mapped first, and the call fails unless every page then
+    // is mapped writable
+    if (memory_fault_in_range(cookie, sizeof *cookie, PTE_U | PTE_W) != 0
+        || memory_fault_in_range(ents, n * sizeof *ents, PTE_U | PTE_W) != 0)
+    {
+        kprintf("sysreaddir: invalid buffer at %p\n", ents);
+        return -EINVAL;
+    }
+
+    return fs_readdir(cookie, ents, n);
+}
+
 static int sysexec(int fd){
     // input: fd - file descriptor
     //
@@ -321,3 +372,46 @@ static int sysexec(int fd){
 
     return process_exec(io);
 }
+
+static long sysmmap(int fd, size_t off, size_t len, int flags){
+    // input: fd - file descriptor of an open kfs file
+    //        off - file offset to map from, page-aligned
+    //        len - number of bytes to map
+    //        flags - MAP_SHARED (read-only) or MAP_PRIVATE (copy-on-write)
+    //
+    // output: return the address of the mapping on success, relative errcode on failure
+    //
+    // side effect: map a file into the user region, pages are read on first access
+    //
+    trace("%s(fd=%d, off=%d, len=%d, flags=%d)", __func__, fd, off, len, flags);
+    if (fd < 0 || fd >= PROCESS_IOMAX){
+        kprintf("sysmmap: invalid file descriptor %d\n", fd);
+        return -EBADFD;
+    }
+    // get the io_intf from current process
+    struct process* proc = current_process();
+    struct io_intf *io = proc->iotab[fd];
+    if (io == NULL){
+        kprintf("sysmmap: file descriptor %d not open\n", fd);
+        return -EBADFD;
+    }
+
+    uintptr_t vma;
+    int result = mmap_file(io, off, len, flags, &vma);
+    if (result != 0){
+        kprintf("sysmmap: failed to map file, err code: %d\n", result);
+        return result;
+    }
+    return vma;
+}
+
+static int sysmunmap(void * addr){
+    // input: addr - address returned by sysmmap
+    //
+    // output: return 0 on success, relative errcode on failure
+    //
+    // side effect: remove a file mapping
+    //
+    trace("%s(addr=%p)", __func__, addr);
+    return mmap_unmap((uintptr_t)addr);
+}
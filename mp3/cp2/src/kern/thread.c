@@ -378,6 +378,15 @@ void condition_wait(struct condition * cond) {
     suspend_self();
 }
 
+void condition_wait_until(struct condition * cond, const volatile int * flag) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+    while (!*flag)
+        condition_wait(cond);
+    intr_restore(saved_intr_state);
+}
+
 void condition_broadcast(struct condition * cond) {
     int saved_intr_state;
     struct thread * thr;
@@ -408,6 +417,34 @@ void condition_broadcast(struct condition * cond) {
     intr_restore(saved_intr_state);
 }
 
+void lock_init(struct lock * lock, const char * name) {
+    lock->owner = NULL;
+    condition_init(&lock->released, name);
+}
+
+void lock_acquire(struct lock * lock) {
+    trace("%s(lock=<%s>) in %s", __func__, lock->released.name, CURTHR->name);
+
+    assert (lock->owner != CURTHR);
+
+    // Kernel code is only switched out while it waits, so the test and the
+    // assignment below cannot be interleaved with another acquirer.
+
+    while (lock->owner != NULL)
+        condition_wait(&lock->released);
+
+    lock->owner = CURTHR;
+}
+
+void lock_release(struct lock * lock) {
+    trace("%s(lock=<%s>) in %s", __func__, lock->released.name, CURTHR->name);
+
+    assert (lock->owner == CURTHR);
+
+    lock->owner = NULL;
+    condition_broadcast(&lock->released);
+}
+
 // INTERNAL FUNCTION DEFINITIONS
 //
 
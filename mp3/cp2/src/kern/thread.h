@@ -25,6 +25,15 @@ struct condition {
 	struct thread_list wait_list;
 };
 
+// A sleeping mutex. A thread that finds the lock held waits on the /released/
+// condition until the owner releases it. Locks are not recursive and must not
+// be used from an ISR.
+
+struct lock {
+    struct thread * owner; // NULL when the lock is free
+    struct condition released;
+};
+
 // EXPORTED GLOBAL VARIABLES
 // 
 
@@ -105,6 +114,13 @@ extern void condition_init(struct condition * cond, const char * name);
 
 extern void condition_wait(struct condition * cond);
 
+// void condition_wait_until(struct condition * cond, const volatile int * flag)
+// Waits on /cond/ until *flag is nonzero. The flag is tested with interrupts
+// disabled, so a flag set by an ISR just before it signals /cond/ is not
+// missed. Returns at once if the flag is already set.
+
+extern void condition_wait_until(struct condition * cond, const volatile int * flag);
+
 // void condition_broadcast(struct condition * cond)
 
 // Wakes up all threads waiting on a condition. This function may be called from
@@ -115,4 +131,22 @@ extern void condition_wait(struct condition * cond);
 
 extern void condition_broadcast(struct condition * cond);
 
+// void lock_init(struct lock * lock, const char * name)
+// Initializes a lock in the released state. Argument /name/ names the lock
+// and may be NULL. It is valid to initialize a struct lock with all zeroes.
+
+extern void lock_init(struct lock * lock, const char * name);
+
+// void lock_acquire(struct lock * lock)
+// Acquires a lock, suspending the current thread while another thread holds
+// it. The calling thread must not already hold the lock.
+
+extern void lock_acquire(struct lock * lock);
+
+// void lock_release(struct lock * lock)
+// Releases a lock held by the current thread and wakes up the threads waiting
+// for it.
+
+extern void lock_release(struct lock * lock);
+
 #endif // _THREAD_H_
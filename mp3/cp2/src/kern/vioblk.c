@@ -12,11 +12,17 @@
 #include "error.h"
 #include "string.h"
 #include "thread.h"
+#include "memory.h"
+#include "config.h"
 
 //           COMPILE-TIME PARAMETERS
 //          
 
 #define VIOBLK_IRQ_PRIO 1
+#define VIOBLK_QUEUE_LEN 16     // requests in flight per queue, a power of two
+#define VIOBLK_MAX_QUEUES 4     // virtqueues used with VIRTIO_BLK_F_MQ
+#define VIOBLK_MAX_SEGS 16      // data segments per request, one page each
+#define VIOBLK_BOUNCE_PAGES 32  // bounce pages per queue, at least VIOBLK_MAX_SEGS
 
 //           INTERNAL CONSTANT DEFINITIONS
 //          
@@ -64,10 +70,11 @@ struct vioblk_request_header {
 #define VIOBLK_INTR_PRIO 1
 #define DIRECT_DESC_NUM 3
 
-#define VQ_INDIRECT_DESC 0
-#define VQ_HEADER_DESC 1
-#define VQ_DATA_DESC 2
-#define VQ_STATUS_DESC 3
+//           Descriptors in the indirect table of a request slot. The data segments
+//           start at VQ_DATA_DESC and the status descriptor follows the last one.
+
+#define VQ_HEADER_DESC 0
+#define VQ_DATA_DESC 1
 
 #define USED_BUFFER_INTR_NOTIFY 1
 #define VIO_DEV_CONF_NOTIFY 1<<1
@@ -77,6 +84,87 @@ struct vioblk_request_header {
 //           FIXME You may modify this structure in any way you want. It is given as a
 //           hint to help you, but you may have your own (better!) way of doing things.
 
+//           A request slot. The ring descriptor of slot i is the indirect descriptor
+//           desc[i] of its queue, which points at the slot's own header, data and status
+//           descriptors, so the id the device returns in the used ring is the slot. The
+//           indirect table is in the layout of the ring, split or packed.
+//           A request covers a contiguous range of blocks with up to seg_max data
+//           descriptors, which point straight into the caller's buffer, one per
+//           physical page, or at bounce pages when the buffer cannot be translated.
+
+struct vioblk_slot {
+    struct virtq_desc ind[VIOBLK_MAX_SEGS + 2] __attribute__((aligned(16)));
+    struct vioblk_request_header header;
+    uint8_t status;
+    //           set by the ISR when the device has returned the slot
+    uint8_t done;
+    //           next slot on the free list, -1 at its end
+    int16_t next_free;
+    struct condition completed;
+    //           bytes of data the request transfers, a multiple of blksz
+    uint32_t len;
+    //           bounce pages taken from the queue's pool, one per data segment; none if
+    //           the data descriptors point into the caller's buffer
+    uint16_t npages;
+    char * pages[VIOBLK_MAX_SEGS];
+    //           the asynchronous request the slot carries a part of, NULL for vioblk_rw,
+    //           and the offset of that part in the request's buffer
+    struct io_request * req;
+    unsigned long off;
+};
+
+//           A virtqueue and the request slots posted to it. Every queue has its own free
+//           lists, bounce pages and asynchronous requests, and the slots of a queue are
+//           only ever posted to it, so threads steered to different queues do not wait
+//           on one another.
+
+struct vioblk_queue {
+    //           state of the virtqueue, packed if the device offers it and split
+    //           otherwise; ring.len is the number of slots given to the device, a
+    //           power of two
+    struct virtq ring;
+    //           asynchronous requests not yet fully queued, oldest first; the ISR
+    //           queues more of them as slots are freed
+    struct io_request * async_head;
+    struct io_request * async_tail;
+    //           first free slot, -1 if every slot is in flight
+    int16_t free_head;
+    //           signaled when a slot and its bounce pages go back to the free lists
+    struct condition slot_freed;
+    //           free bounce pages are bounce[0..bounce_free); pages are allocated on
+    //           first use, up to VIOBLK_BOUNCE_PAGES in total
+    uint16_t bounce_free;
+    uint16_t bounce_alloc;
+    char * bounce[VIOBLK_BOUNCE_PAGES];
+
+    //           the memory shared with the device: the avail and used rings of a split
+    //           queue, whose descriptor table is desc, or the descriptor ring and event
+    //           areas of a packed queue, for which desc only holds the chain heads
+    union {
+        struct {
+            union {
+                struct virtq_avail avail;
+                char _avail_filler[VIRTQ_AVAIL_SIZE(VIOBLK_QUEUE_LEN)];
+            };
+
+            union {
+                volatile struct virtq_used used;
+                char _used_filler[VIRTQ_USED_SIZE(VIOBLK_QUEUE_LEN)];
+            };
+        };
+
+        struct {
+            volatile struct virtq_packed_desc packed[VIOBLK_QUEUE_LEN]
+                __attribute__((aligned(16)));
+            struct virtq_event driver_event;
+            volatile struct virtq_event device_event;
+        };
+    };
+
+    struct virtq_desc desc[VIOBLK_QUEUE_LEN] __attribute__((aligned(16)));
+    struct vioblk_slot * slots[VIOBLK_QUEUE_LEN];
+};
+
 struct vioblk_device {
     volatile struct virtio_mmio_regs * regs;
     struct io_intf io_intf;
@@ -87,42 +175,25 @@ struct vioblk_device {
 
     // optimal block size
     uint32_t blksz;
-    // current position
+    // current position of read and write; readat and writeat do not use it
     uint64_t pos;
     // sizeo of device in bytes
     uint64_t size;
     // size of device in blksz blocks
     uint64_t blkcnt;
-
-    struct {
-        // signaled from ISR
-        struct condition used_updated;
-
-        // We use a simple scheme of one transaction at a time.
-
-        union {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
-        };
-
-        union {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(1)];
-        };
-
-        // The first descriptor is an indirect descriptor and is the one used in
-        // the avail and used rings. The second descriptor points to the header,
-        // the third points to the data, and the fourth to the status byte.
-
-        struct virtq_desc desc[4];
-        struct vioblk_request_header req_header;
-        uint8_t req_status;
-    } vq;
-
-    //           Block currently in block buffer
-    uint64_t bufblkno;
-    //           Block buffer
-    char * blkbuf;
+    // bytes per data segment and segments per request, within the device's
+    // size_max and seg_max
+    uint32_t seg_size;
+    uint16_t seg_max;
+    // polling budget of a wait (IOCTL_SETPOLL), 0 to always sleep, and the
+    // counters of polled waits
+    uint32_t poll_spins;
+    struct io_poll_stats poll_stats;
+
+    // the virtqueues, one unless the device offers VIRTIO_BLK_F_MQ; a thread
+    // posts its requests to vq[running_thread() % nq]
+    uint16_t nq;
+    struct vioblk_queue * vq[VIOBLK_MAX_QUEUES];
 };
 
 //           INTERNAL FUNCTION DECLARATIONS
@@ -142,16 +213,77 @@ static long vioblk_write (
     const void * restrict buf,
     unsigned long n);
 
+static long vioblk_readat (
+    struct io_intf * restrict io,
+    uint64_t pos,
+    void * restrict buf,
+    unsigned long bufsz);
+
+static long vioblk_writeat (
+    struct io_intf * restrict io,
+    uint64_t pos,
+    const void * restrict buf,
+    unsigned long n);
+
 static int vioblk_ioctl (
     struct io_intf * restrict io, int cmd, void * restrict arg);
 
+static int vioblk_submit(struct io_intf * io, struct io_request * req);
+
 static void vioblk_isr(int irqno, void * aux);
+static void vioblk_reap(struct vioblk_device * dev, struct vioblk_queue * vq);
+
+static long vioblk_rw (
+    struct vioblk_device * dev, uint32_t type,
+    uint64_t pos, void * buf, unsigned long n);
+
+static struct vioblk_queue * vioblk_select_queue(struct vioblk_device * dev);
+
+static int vioblk_queue (
+    struct vioblk_device * dev, struct vioblk_queue * vq, uint32_t type,
+    uint64_t pos, const struct io_seg * data, unsigned long off, unsigned long n,
+    int wait, unsigned long * lenptr);
+
+static void vioblk_start_async (
+    struct vioblk_device * dev, struct vioblk_queue * vq);
+static void vioblk_finish_async (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot);
+
+static int vioblk_get_slot (
+    struct vioblk_queue * vq, unsigned int npages, int wait);
+static void vioblk_put_slot (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot);
+
+static void vioblk_bounce (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot,
+    const struct io_seg * data, unsigned long off, unsigned long n, int out);
+
+static unsigned long vioblk_map_direct (
+    struct vioblk_device * dev, const struct io_seg * data, unsigned long off,
+    unsigned long n, uint_fast8_t flags,
+    struct virtq_desc * seg, unsigned int * nsegptr);
+
+static unsigned int vioblk_map_bounce (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot,
+    struct virtq_desc * seg);
+
+static void vioblk_post (
+    struct vioblk_queue * vq, int slot, uint32_t type, uint64_t sector,
+    const struct virtq_desc * seg, unsigned int nseg);
+
+static int vioblk_wait_slot (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot);
 
 //           IOCTLs
 
 static int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr);
 static int vioblk_getpos(const struct vioblk_device * dev, uint64_t * posptr);
 static int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr);
+static int vioblk_getpoll(const struct vioblk_device * dev, uint32_t * spinsptr);
+static int vioblk_setpoll(struct vioblk_device * dev, const uint32_t * spinsptr);
+static int vioblk_getpollstats (
+    const struct vioblk_device * dev, struct io_poll_stats * statsptr);
+
 static int vioblk_getblksz (
     const struct vioblk_device * dev, uint32_t * blkszptr);
 
@@ -173,6 +305,7 @@ extern void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     virtio_featset_t enabled_features, wanted_features, needed_features;
     struct vioblk_device * dev;
     uint_fast32_t blksz, capacity, ro;
+    uint_fast16_t qlen;
     int result;
 
     assert (regs->device_id == VIRTIO_ID_BLOCK);
@@ -191,16 +324,25 @@ extern void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     //            - VIRTIO_F_RING_RESET and
     //            - VIRTIO_F_INDIRECT_DESC
     //           We want:
-    //            - VIRTIO_BLK_F_BLK_SIZE and
-    //            - VIRTIO_BLK_F_TOPOLOGY.
+    //            - VIRTIO_F_EVENT_IDX,
+    //            - VIRTIO_BLK_F_BLK_SIZE,
+    //            - VIRTIO_BLK_F_SEG_MAX,
+    //            - VIRTIO_BLK_F_SIZE_MAX,
+    //            - VIRTIO_BLK_F_TOPOLOGY and
+    //            - VIRTIO_BLK_F_MQ.
 
     virtio_featset_init(needed_features);
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
     virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
+    virtio_featset_add(wanted_features, VIRTIO_F_RING_PACKED);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SEG_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SIZE_MAX);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_RO);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_MQ);
     result = virtio_negotiate_features(regs,
         enabled_features, wanted_features, needed_features);
 
@@ -220,7 +362,7 @@ extern void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     // Allocate initialize device struct
 
-    dev = kmalloc(sizeof(struct vioblk_device) + blksz);
+    dev = kmalloc(sizeof(struct vioblk_device));
     memset(dev, 0, sizeof(struct vioblk_device));
 
     // FIXME Finish initialization of vioblk device here
@@ -242,7 +384,10 @@ extern void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
         .close = vioblk_close,
         .read = vioblk_read,
         .write = vioblk_write,
-        .ctl = vioblk_ioctl
+        .ctl = vioblk_ioctl,
+        .readat = vioblk_readat,
+        .writeat = vioblk_writeat,
+        .submit = vioblk_submit
     };
 
     dev->regs = regs;
@@ -254,43 +399,98 @@ extern void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     dev->size = capacity*blksz;
     dev->blkcnt = capacity;
     dev->io_intf.ops = &vioblk_ops;
-    dev->blkbuf = (void*)((void*)dev + sizeof(struct vioblk_device));
-    // fills out the descriptors in the virtq struct
-    condition_init(&dev->vq.used_updated, "vq_used_updated");
-    // desc[0] -> desc[1], desc[2], desc[3] indirect, and uses the avail and used rings in vq
-    // first one is the indirect descriptor
-    dev->vq.desc[VQ_INDIRECT_DESC] = (struct virtq_desc) {
-        .addr = (uint64_t)&(dev->vq.desc[1]),
-        .len = sizeof(dev->vq.desc[1]) + sizeof(dev->vq.desc[2]) + sizeof(dev->vq.desc[3]),
-        .flags = VIRTQ_DESC_F_INDIRECT,
-    };
-    // second one is the header - first direct
-    dev->vq.desc[VQ_HEADER_DESC] = (struct virtq_desc) {
-        .addr = (uint64_t)&(dev->vq.req_header),
-        .len = sizeof(dev->vq.req_header),
-        .flags = VIRTQ_DESC_F_NEXT,
-        .next = VQ_DATA_DESC - 1 // we have first one indirect
-    };
-    // third one is the data
-    dev->vq.desc[VQ_DATA_DESC] = (struct virtq_desc) {
-        // data put in latest block buffer
-        .addr = (uint64_t)(dev->blkbuf),
-        .len = blksz,
-        .flags = VIRTQ_DESC_F_NEXT, // we need to modifythis based on request
-        .next = VQ_STATUS_DESC - 1
-    };
-    // fourth one is the status
-    dev->vq.desc[VQ_STATUS_DESC] = (struct virtq_desc) {
-        .addr = (uint64_t)&dev->vq.req_status,
-        .len = sizeof(uint8_t),
-        .flags = VIRTQ_DESC_F_WRITE,
-        .next = 0   // no need
-    };
-    __sync_synchronize();
 
-    // initialize the indirect virtq, which usues the avail and used rings in vq
-    virtio_attach_virtq(dev->regs, 0, 1, (uint64_t)&dev->vq.desc[0], (uint64_t)&dev->vq.used, (uint64_t)&dev->vq.avail);
-    __sync_synchronize();
+    //           a data segment is one bounce page, or less if the device limits the
+    //           segment size; a request has at most seg_max segments
+    dev->seg_size = PAGE_SIZE;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SIZE_MAX)
+        && regs->config.blk.size_max < dev->seg_size)
+        dev->seg_size = regs->config.blk.size_max / blksz * blksz;
+    if (dev->seg_size < blksz)
+        dev->seg_size = blksz;
+    dev->seg_max = VIOBLK_MAX_SEGS;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SEG_MAX)
+        && regs->config.blk.seg_max != 0
+        && regs->config.blk.seg_max < dev->seg_max)
+        dev->seg_max = regs->config.blk.seg_max;
+    debug("%p: virtio block device takes %u segments of %u bytes per request",
+        regs, (unsigned int)dev->seg_max, (unsigned int)dev->seg_size);
+
+    //           with VIRTIO_BLK_F_MQ the device serves num_queues virtqueues, of which
+    //           we use up to VIOBLK_MAX_QUEUES
+    dev->nq = 1;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_MQ)
+        && regs->config.blk.num_queues > 1)
+    {
+        dev->nq = regs->config.blk.num_queues;
+        if (dev->nq > VIOBLK_MAX_QUEUES)
+            dev->nq = VIOBLK_MAX_QUEUES;
+    }
+
+    for (int q = 0; q < dev->nq; q++) {
+        struct vioblk_queue * const vq = kmalloc(sizeof(struct vioblk_queue));
+
+        memset(vq, 0, sizeof(struct vioblk_queue));
+        dev->vq[q] = vq;
+        condition_init(&vq->slot_freed, "vioblk_slot_freed");
+
+        //           use as many slots as the device allows, keeping a power of two
+        regs->queue_sel = q;
+        //           fence o,i
+        __sync_synchronize();
+        qlen = VIOBLK_QUEUE_LEN;
+        while (qlen > regs->queue_num_max)
+            qlen /= 2;
+        if (qlen == 0) {
+            kprintf("%p: virtio block device has no queue %d\n", regs, q);
+            if (q == 0)
+                return;
+            dev->nq = q;
+            break;
+        }
+        if (virtio_featset_test(enabled_features, VIRTIO_F_RING_PACKED)) {
+            virtq_init_packed(&vq->ring, regs, q, qlen, vq->desc,
+                vq->packed, &vq->driver_event, &vq->device_event,
+                virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX));
+        } else {
+            virtq_init(&vq->ring, regs, q, qlen, vq->desc,
+                &vq->avail, &vq->used,
+                virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX));
+        }
+        debug("%p: virtio block device uses a %s virtqueue", regs,
+            vq->ring.packed ? "packed" : "split");
+
+        //           every slot gets its indirect table once; a request fills in the
+        //           header, the data segments and the status descriptor after them
+        vq->free_head = -1;
+        for (int i = qlen - 1; i >= 0; i--) {
+            struct vioblk_slot * const slot = kmalloc(sizeof(struct vioblk_slot));
+
+            memset(slot, 0, sizeof(struct vioblk_slot));
+            vq->slots[i] = slot;
+            condition_init(&slot->completed, "vioblk_slot");
+            virtq_set_indirect(&vq->ring, slot->ind, VQ_HEADER_DESC,
+                (uint64_t)&slot->header, sizeof(slot->header), VIRTQ_DESC_F_NEXT);
+            vq->desc[i] = (struct virtq_desc) {
+                .addr = (uint64_t)slot->ind,
+                .len = 0,
+                .flags = VIRTQ_DESC_F_INDIRECT,
+            };
+            slot->next_free = vq->free_head;
+            vq->free_head = i;
+        }
+        __sync_synchronize();
+
+        // initialize the indirect virtq, which usues the avail and used rings in vq
+        //           (or, packed, the descriptor ring and the event areas)
+        if (vq->ring.packed)
+            virtio_attach_virtq(dev->regs, q, qlen, (uint64_t)&vq->packed[0], (uint64_t)&vq->device_event, (uint64_t)&vq->driver_event);
+        else
+            virtio_attach_virtq(dev->regs, q, qlen, (uint64_t)&vq->desc[0], (uint64_t)&vq->used, (uint64_t)&vq->avail);
+        __sync_synchronize();
+    }
+    debug("%p: virtio block device uses %u queues", regs, (unsigned int)dev->nq);
+
     // register the interrupt handler and device to the system
     intr_register_isr(dev->irqno, VIOBLK_INTR_PRIO, vioblk_isr, dev);
     dev->instno = device_register("blk", &vioblk_open, dev);
@@ -318,7 +518,8 @@ int vioblk_open(struct io_intf ** ioptr, void * aux) {
         return -EBUSY;
 
     // Sets the virtq_avail and virtq used queues such that they are available for use
-    virtio_enable_virtq(dev->regs, 0);
+    for(int q = 0; q < dev->nq; q++)
+        virtio_enable_virtq(dev->regs, q);
     __sync_synchronize();
     // Enables the interupt line for the virtio device
     intr_enable_irq(dev->irqno);
@@ -346,8 +547,9 @@ void vioblk_close(struct io_intf * io) {
     struct vioblk_device * dev = (void*)io - offsetof(struct vioblk_device, io_intf);
     if(!dev->opened)
         return;
-    // reset the queue
-    virtio_reset_virtq(dev->regs, 0);
+    // reset the queues
+    for(int q = 0; q < dev->nq; q++)
+        virtio_reset_virtq(dev->regs, q);
     __sync_synchronize();
     // set flags
     dev->opened = 0;
@@ -379,94 +581,54 @@ long vioblk_read (
     //     reads bufsz bytes from the blk associated with io into buf.
     //     Updates metadata in the blk struct as appropriate.
 
+    struct vioblk_device * dev = (void*)io - offsetof(struct vioblk_device, io_intf);
+    long bytes_read = vioblk_readat(io, dev->pos, buf, bufsz);
+    if(bytes_read > 0)
+        dev->pos += bytes_read;
+    return bytes_read;
+}
+
+long vioblk_readat (
+    struct io_intf * restrict io,
+    uint64_t pos,
+    void * restrict buf,
+    unsigned long bufsz)
+{
+    //           input:
+    //               io: the io interface to the blk to read
+    //               pos: the byte offset to read from
+    //               buf: the buffer to read into
+    //               bufsz: the number of bytes to read
+    //           output:
+    //               return the number of bytes read on success, relative errcode on failure
+    //           side effect:
+    //               reads bufsz bytes at pos from the blk associated with io into buf.
+    //               The current position of the device is not used or changed.
+
 
 
-    // here we assume the read operation is aligned with the block size
-    // which is assured in fs
+    //           here we assume the read operation is aligned with the block size
+    //           which is assured in fs
 
 
-    // get device and block number and offset    
+    //           get device and block number and offset
     struct vioblk_device * dev = (void*)io - offsetof(struct vioblk_device, io_intf);
-    
-    // sanity check
-    if(dev->pos > dev->size)
+
+    //           sanity check
+    if(pos > dev->size)
         return -EINVAL;
-    else if(dev->pos + bufsz > dev->size)
-        bufsz = dev->size - dev->pos;
+    else if(pos + bufsz > dev->size)
+        bufsz = dev->size - pos;
     if(bufsz == 0){
         kprintf("vioblk_read: bufsz is 0");
-        return 0;   
-    }
-
-    // read the block one by one
-    long bytes_read = 0;
-    int s = intr_disable();
-
-    uint64_t start_blk = dev->pos / dev->blksz;
-    uint64_t end_blk = (dev->pos + bufsz - 1) / dev->blksz;
-    dev->bufblkno = start_blk;
-    while(dev->bufblkno <= end_blk){
-        // first one is the indirect descriptor
-        dev->vq.desc[VQ_INDIRECT_DESC] = (struct virtq_desc) {
-            .addr = (uint64_t)&(dev->vq.desc[1]),
-            .len = sizeof(dev->vq.desc[1]) + sizeof(dev->vq.desc[2]) + sizeof(dev->vq.desc[3]),
-            .flags = VIRTQ_DESC_F_INDIRECT,
-        };
-        // second one is the header - first direct
-        dev->vq.desc[VQ_HEADER_DESC] = (struct virtq_desc) {
-            .addr = (uint64_t)&(dev->vq.req_header),
-            .len = sizeof(dev->vq.req_header),
-            .flags = VIRTQ_DESC_F_NEXT,
-            .next = VQ_DATA_DESC - 1 // we have first one indirect
-        };
-        // third one is the data
-        dev->vq.desc[VQ_DATA_DESC] = (struct virtq_desc) {
-            // data put in latest block buffer
-            .addr = (uint64_t)(dev->blkbuf),
-            .len = dev->blksz,
-            .flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE, // we need to modifythis based on request
-            .next = VQ_STATUS_DESC - 1
-        };
-        // fourth one is the status
-        dev->vq.desc[VQ_STATUS_DESC] = (struct virtq_desc) {
-            .addr = (uint64_t)&dev->vq.req_status,
-            .len = sizeof(uint8_t),
-            .flags = VIRTQ_DESC_F_WRITE,
-            .next = 0   // no need
-        };
-        __sync_synchronize();
-
-        // set registers to request read the block
-        // set vq.req_header
-        dev->vq.req_header = (struct vioblk_request_header) {
-            .type = VIRTIO_BLK_T_IN,
-            .reserved = 0,
-            .sector = dev->bufblkno
-        };
-        // send request to the available ring via indirect descriptor
-        dev->vq.avail.ring[0] = 0; // 0 - index of the first descriptor, 0 for direct index
-        dev->vq.avail.idx++;
-        __sync_synchronize();
-        // notify the device
-        virtio_notify_avail(dev->regs, 0);
-
-        // please wait until all request processed
-        while(dev->vq.used.idx != dev->vq.avail.idx){
-            condition_wait(&dev->vq.used_updated);
-        }
-        // check the status
-        if(dev->vq.req_status != VIRTIO_BLK_S_OK){
-            debug("vioblk_read: request failed");
-            return -EIO;
-        }
-        // copy the data to the buffer
-        memcpy(buf + bytes_read, dev->blkbuf, dev->blksz);
-        dev->pos += dev->blksz;
-        bytes_read += dev->blksz;
-        dev->bufblkno++;
+        return 0;
     }
-    intr_restore(s);
-    return bytes_read;
+    if(pos%dev->blksz != 0){
+        debug("vioblk_read: pos not aligned with block size");
+        return -EIO;
+    }
+
+    return vioblk_rw(dev, VIRTIO_BLK_T_IN, pos, buf, bufsz);
 }
 
 long vioblk_write (
@@ -484,98 +646,54 @@ long vioblk_write (
     // side effect:
     //     writes n bytes from the blk associated with io into buf.
 
-    // here we assume the write operation is aligned with the block size
-    // which is assured in fs
+    struct vioblk_device * dev = (void*)io - offsetof(struct vioblk_device, io_intf);
+    long bytes_written = vioblk_writeat(io, dev->pos, buf, n);
+    if(bytes_written > 0)
+        dev->pos += bytes_written;
+    return bytes_written;
+}
 
-    // get device and block number and offset
+long vioblk_writeat (
+    struct io_intf * restrict io,
+    uint64_t pos,
+    const void * restrict buf,
+    unsigned long n)
+{
+    //           input:
+    //               io: the io interface to the blk to write
+    //               pos: the byte offset to write at
+    //               buf: the buffer to write from
+    //               n: the number of bytes to write
+    //           output:
+    //               return the number of bytes written on success, relative errcode on failure
+    //           side effect:
+    //               writes n bytes from buf at pos of the blk associated with io.
+    //               The current position of the device is not used or changed.
+
+    //           here we assume the write operation is aligned with the block size
+    //           which is assured in fs
+
+    //           get device and block number and offset
     struct vioblk_device * dev = (void*)io - offsetof(struct vioblk_device, io_intf);
 
-    // is ro?
+    //           is ro?
     if(dev->readonly)
         return -ENOTSUP;
-    // sanity check
-    if(dev->pos > dev->size)
+    //           sanity check
+    if(pos > dev->size)
         return -EINVAL;
-    else if(dev->pos + n > dev->size)
-        n = dev->size - dev->pos;
+    else if(pos + n > dev->size)
+        n = dev->size - pos;
     if(n == 0){
         debug("vioblk_write: n is 0");
         return 0;
     }
-    if(n%dev->blksz != 0 || dev->pos%dev->blksz != 0){
+    if(n%dev->blksz != 0 || pos%dev->blksz != 0){
         debug("vioblk_write: n or pos not aligned with block size");
         return -EIO;
     }
-    // reset vq avail for the new request
-    // write the block one by one
-    long bytes_written = 0;
-    int s = intr_disable();
-    uint64_t start_blk = dev->pos / dev->blksz;
-    uint64_t end_blk = (dev->pos + n - 1) / dev->blksz; // eg 0-4095, 4096-8191, we have 4096 blks! so -1
-
-    dev->bufblkno = start_blk;
-    while(dev->bufblkno <= end_blk){
-        // prepare the buffer
-        memcpy(dev->blkbuf, buf + bytes_written, dev->blksz);
-        // first one is the indirect descriptor
-        dev->vq.desc[VQ_INDIRECT_DESC] = (struct virtq_desc) {
-            .addr = (uint64_t)&(dev->vq.desc[1]),
-            .len = sizeof(dev->vq.desc[1]) + sizeof(dev->vq.desc[2]) + sizeof(dev->vq.desc[3]),
-            .flags = VIRTQ_DESC_F_INDIRECT,
-        };
-        // second one is the header - first direct
-        dev->vq.desc[VQ_HEADER_DESC] = (struct virtq_desc) {
-            .addr = (uint64_t)&(dev->vq.req_header),
-            .len = sizeof(dev->vq.req_header),
-            .flags = VIRTQ_DESC_F_NEXT,
-            .next = VQ_DATA_DESC - 1 // we have first one indirect
-        };
-        // third one is the data
-        dev->vq.desc[VQ_DATA_DESC] = (struct virtq_desc) {
-            // data put in latest block buffer
-            .addr = (uint64_t)(dev->blkbuf),
-            .len = dev->blksz,
-            .flags = VIRTQ_DESC_F_NEXT, // we need to modifythis based on request
-            .next = VQ_STATUS_DESC - 1
-        };
-        // fourth one is the status
-        dev->vq.desc[VQ_STATUS_DESC] = (struct virtq_desc) {
-            .addr = (uint64_t)&dev->vq.req_status,
-            .len = sizeof(uint8_t),
-            .flags = VIRTQ_DESC_F_WRITE,
-            .next = 0   // no need
-        };
-        __sync_synchronize();
-
-        // set registers to request read the block
-        // set vq.req_header
-        dev->vq.req_header = (struct vioblk_request_header) {
-            .type = VIRTIO_BLK_T_OUT,
-            .reserved = 0,
-            .sector = dev->bufblkno
-        };
-        // send request to the available ring via indirect descriptor
-        dev->vq.avail.ring[0] = 0; // 0 - index of the first descriptor, 0 for direct index
-        dev->vq.avail.idx++;
-        __sync_synchronize();
-        // notify the device
-        virtio_notify_avail(dev->regs, 0);
 
-        // please wait until all request processed
-        while(dev->vq.used.idx != dev->vq.avail.idx){
-            condition_wait(&dev->vq.used_updated);
-        }
-        // check the status
-        if(dev->vq.req_status != VIRTIO_BLK_S_OK){
-            debug("vioblk_write: request failed");
-            return -EIO;
-        }
-        dev->pos += dev->blksz;
-        bytes_written += dev->blksz;
-        dev->bufblkno++;
-    }
-    intr_restore(s);
-    return bytes_written;
+    return vioblk_rw(dev, VIRTIO_BLK_T_OUT, pos, (void*)buf, n);
 }
 
 int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
@@ -593,11 +711,79 @@ int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
         return vioblk_setpos(dev, arg);
     case IOCTL_GETBLKSZ:
         return vioblk_getblksz(dev, arg);
+    case IOCTL_GETPOLL:
+        return vioblk_getpoll(dev, arg);
+    case IOCTL_SETPOLL:
+        return vioblk_setpoll(dev, arg);
+    case IOCTL_GETPOLLSTATS:
+        return vioblk_getpollstats(dev, arg);
     default:
         return -ENOTSUP;
     }
 }
 
+int vioblk_submit(struct io_intf * io, struct io_request * req) {
+    //           input:
+    //               io: the io interface of the blk
+    //               req: the request to start; pos and len must be multiples of blksz
+    //                   and its data at kernel addresses
+    //           output:
+    //               return 0 if the request was started, relative errcode otherwise
+    //           side effect:
+    //               Queues as much of the request as there are free slots on the queue
+    //               of the calling thread and notifies the device. The rest is queued by the ISR as slots are freed, and
+    //               the ISR completes the request once every part has been returned. A
+    //               request reaching past the end of the device is cut short there.
+
+    struct vioblk_device * dev = (void*)io - offsetof(struct vioblk_device, io_intf);
+    const struct io_seg whole = { .buf = req->buf, .len = req->len };
+    const struct io_seg * const data = (req->nsegs != 0) ? req->segs : &whole;
+    const unsigned int ndata = (req->nsegs != 0) ? req->nsegs : 1;
+    struct vioblk_queue * vq;
+    unsigned long total = 0;
+    unsigned int i;
+    int s;
+
+    if(req->op != IO_REQ_READ && req->op != IO_REQ_WRITE)
+        return -EINVAL;
+    if(req->op == IO_REQ_WRITE && dev->readonly)
+        return -ENOTSUP;
+    if(req->pos > dev->size || req->pos % dev->blksz != 0
+        || req->len % dev->blksz != 0)
+        return -EINVAL;
+    //          the device reads and writes physical memory, so the data must be in RAM
+    for(i = 0; i < ndata; i++){
+        if(data[i].buf < RAM_START || data[i].buf >= RAM_END
+            || data[i].len > (unsigned long)(RAM_END - data[i].buf))
+            return -EINVAL;
+        total += data[i].len;
+    }
+    if(total != req->len)
+        return -EINVAL;
+    if(req->len > dev->size - req->pos)
+        req->len = dev->size - req->pos;
+
+    req->result = 0;
+    req->next = NULL;
+    req->queued = 0;
+    req->inflight = 0;
+    if(req->len == 0){
+        iocomplete(req, 0);
+        return 0;
+    }
+
+    s = intr_disable();
+    vq = vioblk_select_queue(dev);
+    if(vq->async_tail != NULL)
+        vq->async_tail->next = req;
+    else
+        vq->async_head = req;
+    vq->async_tail = req;
+    vioblk_start_async(dev, vq);
+    intr_restore(s);
+    return 0;
+}
+
 void vioblk_isr(int irqno, void * aux) {
     //           FIXME your code here
     // input:
@@ -607,7 +793,7 @@ void vioblk_isr(int irqno, void * aux) {
     //     none
     // side effect:
     //     sets the appropriate device registers and
-    //     wakes the thread up after waiting for the disk to finish servicing a request.
+    //     wakes up the threads whose requests the device has completed.
     struct vioblk_device * dev = aux;
     if(dev == NULL || aux == NULL){
         debug("vioblk_isr: invalid input");
@@ -620,9 +806,17 @@ void vioblk_isr(int irqno, void * aux) {
     uint32_t status = dev->regs->interrupt_status;
     // check intrupt status
     if(status & USED_BUFFER_INTR_NOTIFY){
-        // clear the interrupt and wake up the thread
+        // clear the interrupt and wake up the owner of every returned slot.
+        // The interrupt does not tell which queue was used, so all of them are
+        // reaped. Completions that arrive before the next interrupt is
+        // requested are handled too, since with event indices they may not
+        // raise one.
         dev->regs->interrupt_ack |= USED_BUFFER_INTR_NOTIFY;
-        condition_broadcast(&dev->vq.used_updated);
+        for(int q = 0; q < dev->nq; q++){
+            do{
+                vioblk_reap(dev, dev->vq[q]);
+            }while(virtq_enable_intr(&dev->vq[q]->ring));
+        }
     }
 
     if(status & VIO_DEV_CONF_NOTIFY){
@@ -633,6 +827,32 @@ void vioblk_isr(int irqno, void * aux) {
 
 }
 
+void vioblk_reap(struct vioblk_device * dev, struct vioblk_queue * vq) {
+    // input:
+    //     dev: the vioblk device, interrupts disabled
+    //     vq: the queue to reap
+    // output:
+    //     none
+    // side effect:
+    //     takes every returned slot off the used ring, finishing the slots of
+    //     asynchronous requests and waking up the owners of the others.
+
+    uint32_t id;
+
+    while(virtq_pop_used(&vq->ring, &id, NULL)){
+        if(id >= vq->ring.len){
+            debug("vioblk_reap: bad used id %u", (unsigned int)id);
+            continue;
+        }
+        if(vq->slots[id]->req != NULL){
+            vioblk_finish_async(dev, vq, id);
+            continue;
+        }
+        vq->slots[id]->done = 1;
+        condition_broadcast(&vq->slots[id]->completed);
+    }
+}
+
 int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr) {
     //           FIXME your code here
     // input:
@@ -695,6 +915,53 @@ int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr) {
     return 0;
 }
 
+int vioblk_getpoll(const struct vioblk_device * dev, uint32_t * spinsptr) {
+    // input:
+    //     dev: the vioblk device
+    //     spinsptr: receives the polling budget
+    // output:
+    //     return 0 on success, -EINVAL if spinsptr is NULL
+    // side effect:
+    //     none
+
+    if(spinsptr == NULL)
+        return -EINVAL;
+    *spinsptr = dev->poll_spins;
+    return 0;
+}
+
+int vioblk_setpoll(struct vioblk_device * dev, const uint32_t * spinsptr) {
+    // input:
+    //     dev: the vioblk device
+    //     spinsptr: the new polling budget, 0 to always sleep
+    // output:
+    //     return 0 on success, -EINVAL if spinsptr is NULL
+    // side effect:
+    //     sets the number of times a wait polls the used ring before sleeping.
+
+    if(spinsptr == NULL)
+        return -EINVAL;
+    dev->poll_spins = *spinsptr;
+    return 0;
+}
+
+int vioblk_getpollstats (
+    const struct vioblk_device * dev, struct io_poll_stats * statsptr)
+{
+    // input:
+    //     dev: the vioblk device
+    //     statsptr: receives the polling counters
+    // output:
+    //     return 0 on success, -EINVAL if statsptr is NULL
+    // side effect:
+    //     none
+
+    if(statsptr == NULL)
+        return -EINVAL;
+    *statsptr = dev->poll_stats;
+    return 0;
+}
+
 int vioblk_getblksz (
     const struct vioblk_device * dev, uint32_t * blkszptr)
 {
@@ -713,4 +980,494 @@ int vioblk_getblksz (
     *blkszptr = dev->blksz;
     return 0;
 }
+
+long vioblk_rw (
+    struct vioblk_device * dev, uint32_t type,
+    uint64_t pos, void * buf, unsigned long n)
+{
+    //           input:
+    //               dev: the vioblk device
+    //               type: VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT
+    //               pos: the byte offset on the device, a multiple of blksz
+    //               buf: the buffer to read into or write from
+    //               n: the number of bytes to transfer, within the device
+    //           output:
+    //               return the number of bytes transferred on success, -EIO on failure
+    //           side effect:
+    //               Transfers the blocks covering [pos, pos + n). Each request covers
+    //               up to seg_max segments of contiguous blocks. The device reads or
+    //               writes buf directly where its pages are mapped in the current memory
+    //               space with the access it needs. That includes user buffers: sysread
+    //               faults its buffer in writable, and syswrite readable, before the call
+    //               gets here. A request for which that covers no whole block (a page still
+    //               not mapped so, or a partial last block) goes through bounce pages, and
+    //               the copy to or from buf faults a missing user page in through the
+    //               S-mode page fault handler. As many requests as there
+    //               are free slots and pages are queued before the device is notified,
+    //               and requests of other threads may be in flight at the same time; the
+    //               requests of this call complete in order. They all go to the queue of
+    //               the calling thread.
+
+    const struct io_seg data = { .buf = buf, .len = n };
+    struct vioblk_queue * vq;
+    int inflight[VIOBLK_QUEUE_LEN]; // our slots, oldest first
+    unsigned int head = 0;
+    unsigned int cnt = 0;
+    unsigned long done = 0;
+    unsigned long queued = 0;
+    long result = 0;
+    int s;
+
+    s = intr_disable();
+    vq = vioblk_select_queue(dev);
+    while(cnt > 0 || (result == 0 && queued < n)){
+        //           wait for a free slot only when none of ours is in flight, since
+        //           ours are not returned to the free lists until we retire them
+        int posted = 0;
+        while(result == 0 && queued < n && cnt < vq->ring.len){
+            unsigned long len;
+            int slot = vioblk_queue(dev, vq, type, pos + queued, &data, queued,
+                n - queued, cnt == 0, &len);
+            if(slot < 0)
+                break;
+            inflight[(head + cnt) % VIOBLK_QUEUE_LEN] = slot;
+            cnt++;
+            queued += len;
+            posted = 1;
+        }
+        if(posted)
+            virtq_notify(&vq->ring);
+
+        //           retire the oldest request
+        int slot = inflight[head];
+        head = (head + 1) % VIOBLK_QUEUE_LEN;
+        cnt--;
+        if(vioblk_wait_slot(dev, vq, slot) == 0 && result == 0){
+            unsigned long len = vq->slots[slot]->len;
+            if(len > n - done)
+                len = n - done;
+            if(type == VIRTIO_BLK_T_IN && vq->slots[slot]->npages > 0)
+                vioblk_bounce(dev, vq, slot, &data, done, len, 0);
+            done += len;
+        }else{
+            debug("vioblk_rw: request failed");
+            result = -EIO;
+        }
+        vioblk_put_slot(dev, vq, slot);
+    }
+    intr_restore(s);
+
+    return (result != 0) ? result : (long)done;
+}
+
+struct vioblk_queue * vioblk_select_queue(struct vioblk_device * dev) {
+    //           input:
+    //               dev: the vioblk device
+    //           output:
+    //               return the queue the calling thread posts its requests to
+    //           side effect:
+    //               none. Threads are spread over the queues by their id, so a thread
+    //               always uses the same queue and its requests complete in order.
+
+    return dev->vq[running_thread() % dev->nq];
+}
+
+int vioblk_queue (
+    struct vioblk_device * dev, struct vioblk_queue * vq, uint32_t type,
+    uint64_t pos, const struct io_seg * data, unsigned long off, unsigned long n,
+    int wait, unsigned long * lenptr)
+{
+    //           input:
+    //               dev: the vioblk device, interrupts disabled
+    //               vq: the queue to post the request to
+    //               type: VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT
+    //               pos: the byte offset on the device, a multiple of blksz
+    //               data: the segments to read into or write from
+    //               off: the offset in the data of the bytes to transfer
+    //               n: the number of bytes left to transfer
+    //               wait: whether to wait for a slot and bounce pages
+    //               lenptr: receives the number of bytes of the data the request covers
+    //           output:
+    //               return the slot of the request, or -1 if there is none and wait is 0
+    //           side effect:
+    //               Posts one request for the start of [pos, pos + n), without notifying
+    //               the device. It points at the data where its pages can be translated
+    //               and at bounce pages otherwise; the data of a write is copied into them.
+
+    const unsigned long max_req = (unsigned long)dev->seg_max * dev->seg_size;
+    struct virtq_desc seg[VIOBLK_MAX_SEGS];
+    unsigned int nseg;
+    unsigned long len;
+    uint32_t xfer;
+    int slot;
+
+    //           the device writes into the data on reads and reads from it on writes
+    len = vioblk_map_direct(dev, data, off, n,
+        (type == VIRTIO_BLK_T_IN) ? PTE_W : PTE_R, seg, &nseg);
+    if(len > 0){
+        slot = vioblk_get_slot(vq, 0, wait);
+        if(slot < 0)
+            return -1;
+        vq->slots[slot]->len = len;
+    }else{
+        len = (n < max_req) ? n : max_req;
+        xfer = (len + dev->blksz - 1) / dev->blksz * dev->blksz;
+        slot = vioblk_get_slot(vq,
+            (xfer + dev->seg_size - 1) / dev->seg_size, wait);
+        if(slot < 0)
+            return -1;
+        vq->slots[slot]->len = xfer;
+        nseg = vioblk_map_bounce(dev, vq, slot, seg);
+        if(type == VIRTIO_BLK_T_OUT)
+            vioblk_bounce(dev, vq, slot, data, off, len, 1);
+    }
+    vioblk_post(vq, slot, type, pos / dev->blksz, seg, nseg);
+    *lenptr = len;
+    return slot;
+}
+
+void vioblk_start_async(struct vioblk_device * dev, struct vioblk_queue * vq) {
+    //           input:
+    //               dev: the vioblk device, interrupts disabled
+    //               vq: the queue whose pending requests to start
+    //           output:
+    //               none
+    //           side effect:
+    //               queues parts of the pending asynchronous requests, oldest first,
+    //               until they are all queued or no slot or bounce pages are free, and
+    //               notifies the device if anything was queued.
+
+    struct io_request * req;
+    int posted = 0;
+
+    while((req = vq->async_head) != NULL){
+        const uint32_t type = (req->op == IO_REQ_READ) ?
+            VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+        const struct io_seg whole = { .buf = req->buf, .len = req->len };
+
+        while(req->queued < req->len){
+            unsigned long len;
+            int slot = vioblk_queue(dev, vq, type, req->pos + req->queued,
+                (req->nsegs != 0) ? req->segs : &whole, req->queued,
+                req->len - req->queued, 0, &len);
+            if(slot < 0)
+                goto out;
+            vq->slots[slot]->req = req;
+            vq->slots[slot]->off = req->queued;
+            req->queued += len;
+            req->inflight++;
+            posted = 1;
+        }
+        vq->async_head = req->next;
+        if(vq->async_head == NULL)
+            vq->async_tail = NULL;
+    }
+
+out:
+    if(posted)
+        virtq_notify(&vq->ring);
+}
+
+void vioblk_finish_async (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot)
+{
+    //           input:
+    //               dev: the vioblk device, interrupts disabled
+    //               vq: the queue of the slot
+    //               slot: a returned slot carrying part of an asynchronous request
+    //           output:
+    //               none
+    //           side effect:
+    //               copies the data of a bounced read into the request's data, frees
+    //               the slot and completes the request if this was its last part.
+
+    struct vioblk_slot * const sl = vq->slots[slot];
+    struct io_request * const req = sl->req;
+    const struct io_seg whole = { .buf = req->buf, .len = req->len };
+
+    sl->req = NULL;
+    if(sl->status != VIRTIO_BLK_S_OK)
+        req->result = -EIO;
+    else if(req->op == IO_REQ_READ && sl->npages > 0){
+        vioblk_bounce(dev, vq, slot, (req->nsegs != 0) ? req->segs : &whole,
+            sl->off, sl->len, 0);
+    }
+    req->inflight--;
+    vioblk_put_slot(dev, vq, slot);
+
+    if(req->inflight == 0 && req->queued == req->len)
+        iocomplete(req, (req->result < 0) ? req->result : (long)req->len);
+}
+
+int vioblk_get_slot (
+    struct vioblk_queue * vq, unsigned int npages, int wait)
+{
+    //           input:
+    //               vq: the queue to take the slot from, interrupts disabled
+    //               npages: the number of bounce pages the request needs
+    //               wait: whether to wait when no slot or too few pages are free
+    //           output:
+    //               return a free slot, or -1 if there is none and wait is 0
+    //           side effect:
+    //               takes the slot off the free list and gives it npages bounce pages,
+    //               allocating pages the pool has not handed out yet.
+
+    struct vioblk_slot * sl;
+    int slot;
+
+    while(vq->free_head < 0 || vq->bounce_free
+        + (VIOBLK_BOUNCE_PAGES - vq->bounce_alloc) < npages)
+    {
+        if(!wait)
+            return -1;
+        condition_wait(&vq->slot_freed);
+    }
+    slot = vq->free_head;
+    sl = vq->slots[slot];
+    vq->free_head = sl->next_free;
+
+    for(sl->npages = 0; sl->npages < npages; sl->npages++){
+        if(vq->bounce_free > 0)
+            sl->pages[sl->npages] = vq->bounce[--vq->bounce_free];
+        else{
+            sl->pages[sl->npages] = memory_alloc_page();
+            vq->bounce_alloc++;
+        }
+    }
+    return slot;
+}
+
+void vioblk_put_slot (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot)
+{
+    //           input:
+    //               dev: the vioblk device, interrupts disabled
+    //               vq: the queue of the slot
+    //               slot: a slot the device has returned
+    //           output:
+    //               none
+    //           side effect:
+    //               puts the slot and its bounce pages back on the free lists, wakes
+    //               threads waiting for them and queues pending asynchronous requests.
+
+    struct vioblk_slot * const sl = vq->slots[slot];
+
+    while(sl->npages > 0)
+        vq->bounce[vq->bounce_free++] = sl->pages[--sl->npages];
+    sl->next_free = vq->free_head;
+    vq->free_head = slot;
+    condition_broadcast(&vq->slot_freed);
+    if(vq->async_head != NULL)
+        vioblk_start_async(dev, vq);
+}
+
+void vioblk_bounce (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot,
+    const struct io_seg * data, unsigned long off, unsigned long n, int out)
+{
+    //           input:
+    //               dev: the vioblk device
+    //               vq: the queue of the slot
+    //               slot: a slot holding bounce pages for at least n bytes
+    //               data: the caller's segments
+    //               off: the offset in the data of the bytes to copy
+    //               n: the number of bytes to copy
+    //               out: 1 to copy the data into the pages, 0 to copy the pages into it
+    //           output:
+    //               none
+    //           side effect:
+    //               copies n bytes between the data and the bounce pages of the slot,
+    //               which hold seg_size bytes each.
+
+    struct vioblk_slot * const sl = vq->slots[slot];
+    unsigned long done, len;
+    char * page;
+    void * p;
+
+    for(done = 0; done < n; done += len){
+        p = ioseg_at(data, off + done, &len);
+        page = sl->pages[done / dev->seg_size] + done % dev->seg_size;
+        if(len > n - done)
+            len = n - done;
+        if(len > dev->seg_size - done % dev->seg_size)
+            len = dev->seg_size - done % dev->seg_size;
+        if(out)
+            memcpy(page, p, len);
+        else
+            memcpy(p, page, len);
+    }
+}
+
+unsigned long vioblk_map_direct (
+    struct vioblk_device * dev, const struct io_seg * data, unsigned long off,
+    unsigned long n, uint_fast8_t flags,
+    struct virtq_desc * seg, unsigned int * nsegptr)
+{
+    //           input:
+    //               dev: the vioblk device
+    //               data: the caller's segments, virtual addresses in the current space
+    //               off: the offset in the data of the bytes to transfer
+    //               n: the number of bytes left to transfer
+    //               flags: the PTE flags the pages of the data must be mapped with
+    //               seg: receives the address and length of up to seg_max segments
+    //               nsegptr: receives the number of segments
+    //           output:
+    //               return the number of bytes the segments cover, a multiple of blksz,
+    //               or 0 if not even one block of the data can be translated
+    //           side effect:
+    //               none. Pieces of the data that are also physically contiguous share a
+    //               segment as long as it stays within seg_size.
+
+    unsigned long len = 0;
+    unsigned long trim;
+    unsigned int nseg = 0;
+
+    while(len < n){
+        unsigned long avail;
+        void * const p = ioseg_at(data, off + len, &avail);
+        const uintptr_t pa = memory_translate_vptr(p, flags);
+        unsigned long piece = PAGE_SIZE - ((uintptr_t)p & (PAGE_SIZE - 1));
+
+        if(pa == 0)
+            break;
+        if(piece > avail)
+            piece = avail;
+        if(piece > n - len)
+            piece = n - len;
+        if(piece > dev->seg_size)
+            piece = dev->seg_size;
+        if(nseg > 0 && seg[nseg-1].addr + seg[nseg-1].len == pa
+            && seg[nseg-1].len + piece <= dev->seg_size)
+            seg[nseg-1].len += piece;
+        else if(nseg < dev->seg_max){
+            seg[nseg].addr = pa;
+            seg[nseg].len = piece;
+            nseg++;
+        }else
+            break;
+        len += piece;
+    }
+
+    //           a request transfers whole blocks, so drop the partial one at the end
+    trim = len % dev->blksz;
+    len -= trim;
+    while(trim > 0){
+        if(seg[nseg-1].len <= trim){
+            trim -= seg[nseg-1].len;
+            nseg--;
+        }else{
+            seg[nseg-1].len -= trim;
+            trim = 0;
+        }
+    }
+
+    *nsegptr = nseg;
+    return len;
+}
+
+unsigned int vioblk_map_bounce (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot,
+    struct virtq_desc * seg)
+{
+    //           input:
+    //               dev: the vioblk device
+    //               vq: the queue of the slot
+    //               slot: a slot holding bounce pages for its len bytes
+    //               seg: receives the address and length of each segment
+    //           output:
+    //               return the number of segments, one per bounce page
+    //           side effect:
+    //               none
+
+    const struct vioblk_slot * const sl = vq->slots[slot];
+    uint32_t left = sl->len;
+    unsigned int i;
+
+    for(i = 0; left > 0; i++){
+        seg[i].addr = (uint64_t)sl->pages[i];
+        seg[i].len = (left < dev->seg_size) ? left : dev->seg_size;
+        left -= seg[i].len;
+    }
+    return i;
+}
+
+void vioblk_post (
+    struct vioblk_queue * vq, int slot, uint32_t type, uint64_t sector,
+    const struct virtq_desc * seg, unsigned int nseg)
+{
+    //           input:
+    //               vq: the queue of the slot, interrupts disabled
+    //               slot: a slot taken with vioblk_get_slot
+    //               type: VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT
+    //               sector: the first block to transfer
+    //               seg: the address and length of each data segment
+    //               nseg: the number of data segments, at most seg_max
+    //           output:
+    //               none
+    //           side effect:
+    //               fills in the request of the slot and adds it to the avail ring. The
+    //               device is not notified; the caller does that once per batch.
+
+    struct vioblk_slot * const sl = vq->slots[slot];
+    const uint16_t dflags = VIRTQ_DESC_F_NEXT |
+        ((type == VIRTIO_BLK_T_IN) ? VIRTQ_DESC_F_WRITE : 0);
+    unsigned int i;
+
+    sl->header = (struct vioblk_request_header) {
+        .type = type,
+        .reserved = 0,
+        .sector = sector
+    };
+    for(i = 0; i < nseg; i++){
+        virtq_set_indirect(&vq->ring, sl->ind, VQ_DATA_DESC + i,
+            seg[i].addr, seg[i].len, dflags);
+    }
+    virtq_set_indirect(&vq->ring, sl->ind, VQ_DATA_DESC + i,
+        (uint64_t)&sl->status, sizeof(sl->status), VIRTQ_DESC_F_WRITE);
+    vq->desc[slot].len = (VQ_DATA_DESC + i + 1) * sizeof(struct virtq_desc);
+    sl->status = VIRTIO_BLK_S_IOERR;
+    sl->done = 0;
+
+    virtq_push_avail(&vq->ring, slot);
+}
+
+int vioblk_wait_slot (
+    struct vioblk_device * dev, struct vioblk_queue * vq, int slot)
+{
+    //           input:
+    //               dev: the vioblk device, interrupts disabled
+    //               vq: the queue of the slot
+    //               slot: a posted slot
+    //           output:
+    //               return 0 if the request succeeded, -EIO otherwise
+    //           side effect:
+    //               Polls the used ring of the queue for up to poll_spins iterations with
+    //               its interrupts suppressed, then sleeps until the ISR reports the slot
+    //               as completed. Polling also retires the slots of other requests.
+
+    struct vioblk_slot * const sl = vq->slots[slot];
+    uint32_t spins;
+
+    if(!sl->done && dev->poll_spins > 0){
+        dev->poll_stats.polls++;
+        virtq_disable_intr(&vq->ring);
+        for(spins = 0; !sl->done && spins < dev->poll_spins; spins++)
+            vioblk_reap(dev, vq);
+        dev->poll_stats.spins += spins;
+        //           completions that arrive while interrupts are turned back on are
+        //           not announced, so take them now
+        while(virtq_enable_intr(&vq->ring))
+            vioblk_reap(dev, vq);
+        if(sl->done)
+            dev->poll_stats.poll_hits++;
+        else
+            dev->poll_stats.poll_misses++;
+    }
+
+    if(!sl->done)
+        dev->poll_stats.sleeps++;
+    while(!sl->done)
+        condition_wait(&sl->completed);
+    return (sl->status == VIRTIO_BLK_S_OK) ? 0 : -EIO;
+}
 #endif
\ No newline at end of file
@@ -12,6 +12,12 @@
 
 #define VIRTIO_MAGIC 0x74726976
 
+//           INTERNAL FUNCTION DECLARATIONS
+//          
+
+static int virtq_packed_used(const struct virtq * vq);
+static int virtq_packed_need_notify(const struct virtq * vq);
+
 //           EXPORTED FUNCTION DEFINITIONS
 //          
 
@@ -80,16 +86,17 @@ int virtio_negotiate_features (
         }
     }
 
-    //           All required features are available. Now request the desired ones (which
-    //           should be a superset of the required ones).
+    //           All required features are available. Now request them together with
+    //           the desired ones.
 
     for (i = 0; i < VIRTIO_FEATLEN; i++) {
-        if (wanted[i] != 0) {
+        enabled[i] = 0;
+        if ((wanted[i] | needed[i]) != 0) {
             regs->device_features_sel = i;
             regs->driver_features_sel = i;
             //           fence o,i
             __sync_synchronize();
-            enabled[i] = regs->device_features & wanted[i];
+            enabled[i] = regs->device_features & (wanted[i] | needed[i]);
             regs->driver_features = enabled[i];
             //           fence o,o
             __sync_synchronize();
@@ -117,8 +124,229 @@ void virtio_attach_virtq (
     __sync_synchronize();
 }
 
+void virtq_init (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid,
+    uint_fast16_t len, struct virtq_desc * desc, struct virtq_avail * avail,
+    volatile struct virtq_used * used, int event_idx)
+{
+    vq->regs = regs;
+    vq->qid = qid;
+    vq->len = len;
+    vq->last_used = 0;
+    vq->notified = 0;
+    vq->event_idx = event_idx;
+    vq->packed = 0;
+    vq->desc = desc;
+    vq->avail = avail;
+    vq->used = used;
+
+    memset(avail, 0, VIRTQ_AVAIL_SIZE(len));
+    memset((void *)used, 0, VIRTQ_USED_SIZE(len));
+}
+
+void virtq_init_packed (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid,
+    uint_fast16_t len, struct virtq_desc * desc,
+    volatile struct virtq_packed_desc * ring, struct virtq_event * driver_event,
+    volatile struct virtq_event * device_event, int event_idx)
+{
+    vq->regs = regs;
+    vq->qid = qid;
+    vq->len = len;
+    vq->last_used = 0;
+    vq->notified = 0;
+    vq->event_idx = event_idx;
+    vq->packed = 1;
+    vq->desc = desc;
+    vq->avail = NULL;
+    vq->used = NULL;
+
+    //           both wrap counters start at 1, so a zeroed ring holds no available and
+    //           no used descriptors
+    vq->avail_wrap = 1;
+    vq->used_wrap = 1;
+    vq->next_avail = 0;
+    vq->added = 0;
+    vq->ring = ring;
+    vq->driver_event = driver_event;
+    vq->device_event = device_event;
+
+    memset((void *)ring, 0, len * sizeof(struct virtq_packed_desc));
+    memset(driver_event, 0, sizeof(struct virtq_event));
+    memset((void *)device_event, 0, sizeof(struct virtq_event));
+}
+
+void virtq_push_avail(struct virtq * vq, uint16_t head) {
+    if (vq->packed) {
+        volatile struct virtq_packed_desc * const d = &vq->ring[vq->next_avail];
+
+        d->addr = vq->desc[head].addr;
+        d->len = vq->desc[head].len;
+        d->id = head;
+        //           the descriptor must be visible before the flags that hand it over
+        __sync_synchronize();
+        d->flags = (vq->desc[head].flags & ~(VIRTQ_DESC_F_NEXT
+            | VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED))
+            | (vq->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+        __sync_synchronize();
+
+        if (++vq->next_avail == vq->len) {
+            vq->next_avail = 0;
+            vq->avail_wrap ^= 1;
+        }
+        vq->added++;
+        return;
+    }
+
+    vq->avail->ring[vq->avail->idx % vq->len] = head;
+    //           the ring entry must be visible before the new index
+    __sync_synchronize();
+    vq->avail->idx++;
+    __sync_synchronize();
+}
+
+void virtq_notify(struct virtq * vq) {
+    uint16_t old_idx;
+    uint16_t new_idx;
+    int needed;
+
+    if (vq->packed) {
+        if (vq->added == 0)
+            return;
+        __sync_synchronize();
+        needed = virtq_packed_need_notify(vq);
+        vq->added = 0;
+        if (needed)
+            virtio_notify_avail(vq->regs, vq->qid);
+        return;
+    }
+
+    old_idx = vq->notified;
+    new_idx = vq->avail->idx;
+    if (new_idx == old_idx)
+        return;
+
+    //           the new avail index must be visible before the device's wishes are read
+    __sync_synchronize();
+    if (vq->event_idx) {
+        //           avail_event follows the used ring
+        const uint16_t event = *(volatile uint16_t *)&vq->used->ring[vq->len];
+        needed = virtq_need_event(event, new_idx, old_idx);
+    } else
+        needed = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+
+    vq->notified = new_idx;
+    if (needed)
+        virtio_notify_avail(vq->regs, vq->qid);
+}
+
+int virtq_pop_used(struct virtq * vq, uint32_t * idptr, uint32_t * lenptr) {
+    volatile struct virtq_used_elem * elem;
+
+    if (vq->packed) {
+        volatile struct virtq_packed_desc * const d = &vq->ring[vq->last_used];
+
+        if (!virtq_packed_used(vq))
+            return 0;
+        //           read the descriptor only after the flags that hand it back
+        __sync_synchronize();
+        *idptr = d->id;
+        if (lenptr != NULL)
+            *lenptr = d->len;
+        if (++vq->last_used == vq->len) {
+            vq->last_used = 0;
+            vq->used_wrap ^= 1;
+        }
+        return 1;
+    }
+
+    if (vq->last_used == vq->used->idx)
+        return 0;
+
+    //           read the entry only after the index that covers it
+    __sync_synchronize();
+    elem = &vq->used->ring[vq->last_used % vq->len];
+    *idptr = elem->id;
+    if (lenptr != NULL)
+        *lenptr = elem->len;
+    vq->last_used++;
+    return 1;
+}
+
+int virtq_enable_intr(struct virtq * vq) {
+    if (vq->packed) {
+        //           ask for an interrupt once the descriptor at last_used is used
+        if (vq->event_idx) {
+            vq->driver_event->off_wrap = vq->last_used | (vq->used_wrap << 15);
+            __sync_synchronize();
+            vq->driver_event->flags = VIRTQ_EVENT_F_DESC;
+        } else
+            vq->driver_event->flags = VIRTQ_EVENT_F_ENABLE;
+        __sync_synchronize();
+        return virtq_packed_used(vq);
+    }
+
+    //           used_event follows the avail ring; the device interrupts once used->idx
+    //           moves past it
+    if (vq->event_idx)
+        *(volatile uint16_t *)&vq->avail->ring[vq->len] = vq->last_used;
+    else
+        vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    //           fence w,r: the device must see used_event before used->idx is checked
+    __sync_synchronize();
+    return (vq->used->idx != vq->last_used);
+}
+
+void virtq_disable_intr(struct virtq * vq) {
+    if (vq->packed) {
+        vq->driver_event->flags = VIRTQ_EVENT_F_DISABLE;
+        __sync_synchronize();
+        return;
+    }
+
+    //           a used_event the device has already passed is never crossed again
+    //           before the driver moves it
+    if (vq->event_idx)
+        *(volatile uint16_t *)&vq->avail->ring[vq->len] = vq->last_used - 1;
+    else
+        vq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    __sync_synchronize();
+}
+
 void __attribute__ ((weak)) viocons_attach (
     volatile struct virtio_mmio_regs * regs, int irqno)
 {
     panic("viocons not included!");
 }
+
+//           INTERNAL FUNCTION DEFINITIONS
+//          
+
+int virtq_packed_used(const struct virtq * vq) {
+    //           a used descriptor has both flags equal to the driver's used wrap counter
+    const uint16_t flags = vq->ring[vq->last_used].flags;
+    const int avail = (flags & VIRTQ_DESC_F_AVAIL) != 0;
+    const int used = (flags & VIRTQ_DESC_F_USED) != 0;
+
+    return (avail == used && used == vq->used_wrap);
+}
+
+int virtq_packed_need_notify(const struct virtq * vq) {
+    //           flags and off_wrap are read together, as the device updates them
+    const uint32_t ev = *(volatile uint32_t *)vq->device_event;
+    const uint16_t flags = ev >> 16;
+    const uint16_t off_wrap = ev & 0xffff;
+    uint16_t event;
+
+    if (flags == VIRTQ_EVENT_F_DISABLE)
+        return 0;
+    if (flags != VIRTQ_EVENT_F_DESC || !vq->event_idx)
+        return 1;
+
+    //           offsets are compared within the current lap of next_avail; an event in
+    //           the previous lap lies a ring length behind its offset
+    event = off_wrap & 0x7fff;
+    if ((off_wrap >> 15) != vq->avail_wrap)
+        event -= vq->len;
+    return virtq_need_event(event, vq->next_avail, vq->next_avail - vq->added);
+}
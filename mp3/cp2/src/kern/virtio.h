@@ -22,6 +22,7 @@
 #define VIRTIO_F_EVENT_IDX			29
 #define VIRTIO_F_ANY_LAYOUT			27
 #define VIRTIO_F_RING_RESET         40
+#define VIRTIO_F_RING_PACKED        34
 
 #define VIRTQ_LEN_MAX 32768
 
@@ -31,6 +32,13 @@
 #define VIRTQ_DESC_F_NEXT       	(1 << 0)
 #define VIRTQ_DESC_F_WRITE      	(1 << 1)
 #define VIRTQ_DESC_F_INDIRECT		(1 << 2)
+#define VIRTQ_DESC_F_AVAIL      	(1 << 7)
+#define VIRTQ_DESC_F_USED       	(1 << 15)
+
+//           event suppression flags of a packed virtqueue
+#define VIRTQ_EVENT_F_ENABLE    	0
+#define VIRTQ_EVENT_F_DISABLE   	1
+#define VIRTQ_EVENT_F_DESC      	2
 
 //           length of feature vector
 #define VIRTIO_FEATLEN 4
@@ -126,10 +134,10 @@ struct virtq_avail {
 
 //           VIRTQ_AVAIL_SIZE(n)
 //           Evaluates to a compile-time constant giving the size of a virtq avail ring
-//           sized for /n/ elements.
+//           sized for /n/ elements, including the used_event field after the ring.
 
 #define VIRTQ_AVAIL_SIZE(n) \
-    (sizeof(struct virtq_avail)+(n)*sizeof(uint16_t))
+    (sizeof(struct virtq_avail)+(n)*sizeof(uint16_t)+sizeof(uint16_t))
 
 struct virtq_used_elem {
     uint32_t id;
@@ -144,10 +152,71 @@ struct virtq_used {
 
 //           VIRTQ_USED_SIZE(n)
 //           Evaluates to a compile-time constant giving the size of a virtq used ring
-//           sized for /n/ elements.
+//           sized for /n/ elements, including the avail_event field after the ring.
 
 #define VIRTQ_USED_SIZE(n) \
-    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem))
+    (sizeof(struct virtq_used)+(n)*sizeof(struct virtq_used_elem) \
+        +sizeof(uint16_t))
+
+//           A descriptor of a packed virtqueue. The driver makes it available by setting
+//           VIRTQ_DESC_F_AVAIL to its wrap counter and VIRTQ_DESC_F_USED to the inverse;
+//           the device writes the used descriptor back in place, with both bits equal to
+//           its wrap counter. The same layout is used in indirect tables, where only
+//           VIRTQ_DESC_F_WRITE is valid and entries follow one another without a next
+//           link.
+
+struct virtq_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+//           Event suppression area of a packed virtqueue. The driver's area tells the
+//           device when to interrupt and the device's area tells the driver when to
+//           notify: never, always, or (VIRTQ_EVENT_F_DESC, with VIRTIO_F_EVENT_IDX) once
+//           the descriptor at ring offset off_wrap & 0x7fff with wrap counter
+//           off_wrap >> 15 has been made available or used.
+
+struct virtq_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+//           Driver state of a split or packed virtqueue whose descriptor table and rings
+//           are owned by the driver. The virtq functions below add chains to the avail
+//           ring, take them back from the used ring and decide when the device must be
+//           notified. With VIRTIO_F_EVENT_IDX negotiated, notifications and interrupts
+//           are only requested when the other side has caught up: the driver rings the
+//           doorbell once the device has consumed everything it knew about, and the
+//           device interrupts once the driver has handled every completion it saw.
+//           Without it, every batch is notified and every completion may interrupt.
+//           With VIRTIO_F_RING_PACKED negotiated, chains go to a single descriptor ring
+//           instead; /desc/ then holds the driver's copy of each chain head, which is
+//           written to the ring when it is pushed, so a chain must be a single (usually
+//           indirect) descriptor. The functions must be called with interrupts disabled.
+
+struct virtq {
+    volatile struct virtio_mmio_regs * regs;
+    uint16_t qid;
+    uint16_t len;
+    uint16_t last_used;     //           used->idx up to which entries have been taken
+    uint16_t notified;      //           avail->idx when the device was last notified
+    uint8_t event_idx;      //           VIRTIO_F_EVENT_IDX was negotiated
+    uint8_t packed;         //           VIRTIO_F_RING_PACKED was negotiated
+    struct virtq_desc * desc;
+    struct virtq_avail * avail;
+    volatile struct virtq_used * used;
+
+    //           packed ring only; last_used is the ring offset of the next used entry
+    uint8_t avail_wrap;     //           wrap counter of next_avail
+    uint8_t used_wrap;      //           wrap counter of last_used
+    uint16_t next_avail;    //           ring offset the next chain is written to
+    uint16_t added;         //           chains pushed since the last notification
+    volatile struct virtq_packed_desc * ring;
+    struct virtq_event * driver_event;
+    volatile struct virtq_event * device_event;
+};
 
 
 //           EXPORTED FUNCTION DEFINITIONS
@@ -174,6 +243,72 @@ extern void virtio_attach_virtq (
     volatile struct virtio_mmio_regs * regs, int qid, uint_fast16_t len,
     uint64_t desc_addr, uint64_t used_addr, uint64_t avail_addr);
 
+//           Initializes /vq/ for queue /qid/ of the device and clears its rings. The
+//           rings must be sized with VIRTQ_AVAIL_SIZE and VIRTQ_USED_SIZE for /len/
+//           elements. /event_idx/ tells whether VIRTIO_F_EVENT_IDX was negotiated. The
+//           queue is still attached with virtio_attach_virtq.
+
+extern void virtq_init (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid,
+    uint_fast16_t len, struct virtq_desc * desc, struct virtq_avail * avail,
+    volatile struct virtq_used * used, int event_idx);
+
+//           Initializes /vq/ for packed queue /qid/ of the device and clears its ring
+//           of /len/ descriptors and both event suppression areas. /desc/ holds /len/
+//           chain heads filled in by the driver (see struct virtq). The queue is still
+//           attached with virtio_attach_virtq, with the ring as its descriptor table,
+//           the driver's event area in place of the avail ring and the device's in place
+//           of the used ring.
+
+extern void virtq_init_packed (
+    struct virtq * vq, volatile struct virtio_mmio_regs * regs, int qid,
+    uint_fast16_t len, struct virtq_desc * desc,
+    volatile struct virtq_packed_desc * ring, struct virtq_event * driver_event,
+    volatile struct virtq_event * device_event, int event_idx);
+
+//           Fills in entry /i/ of an indirect descriptor table in the layout of the
+//           queue's ring. In a split table the entry is linked to entry /i/+1, which the
+//           device follows if /flags/ has VIRTQ_DESC_F_NEXT.
+
+static inline void virtq_set_indirect (
+    const struct virtq * vq, struct virtq_desc * tbl, uint_fast16_t i,
+    uint64_t addr, uint32_t len, uint16_t flags);
+
+//           Makes the chain starting at descriptor /head/ available to the device. The
+//           device is not notified; call virtq_notify once per batch.
+
+extern void virtq_push_avail(struct virtq * vq, uint16_t head);
+
+//           Notifies the device of the chains pushed since the last notification,
+//           unless the device has said it does not need to be told. Safe to call from
+//           an ISR.
+
+extern void virtq_notify(struct virtq * vq);
+
+//           Takes the next entry off the used ring. Returns 1 and stores the head of the
+//           chain and the number of bytes the device wrote (if /lenptr/ is not NULL),
+//           or returns 0 if the used ring has no new entries.
+
+extern int virtq_pop_used (
+    struct virtq * vq, uint32_t * idptr, uint32_t * lenptr);
+
+//           Asks the device to interrupt on its next completion. Returns 1 if entries
+//           arrived on the used ring in the meantime, in which case the caller must
+//           take them with virtq_pop_used, since they may not raise an interrupt.
+
+extern int virtq_enable_intr(struct virtq * vq);
+
+//           Asks the device not to interrupt on completions until virtq_enable_intr is
+//           called, e.g. while the driver polls the used ring itself.
+
+extern void virtq_disable_intr(struct virtq * vq);
+
+//           Returns 1 if an index moving from /old_idx/ to /new_idx/ passed /event/,
+//           the test both sides of an event-index virtqueue use.
+
+static inline int virtq_need_event (
+    uint16_t event, uint16_t new_idx, uint16_t old_idx);
+
 static inline void virtio_enable_virtq (
     volatile struct virtio_mmio_regs * regs, int qid);
 
@@ -281,6 +416,32 @@ static inline void virtio_reset_virtq (
     regs->queue_reset = 1;
 }
 
+static inline int virtq_need_event (
+    uint16_t event, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static inline void virtq_set_indirect (
+    const struct virtq * vq, struct virtq_desc * tbl, uint_fast16_t i,
+    uint64_t addr, uint32_t len, uint16_t flags)
+{
+    if (vq->packed) {
+        ((struct virtq_packed_desc *)tbl)[i] = (struct virtq_packed_desc) {
+            .addr = addr,
+            .len = len,
+            .flags = flags & VIRTQ_DESC_F_WRITE
+        };
+    } else {
+        tbl[i] = (struct virtq_desc) {
+            .addr = addr,
+            .len = len,
+            .flags = flags,
+            .next = i + 1
+        };
+    }
+}
+
 static inline void virtio_featset_init(virtio_featset_t fts) {
     uint_fast8_t i;
 
@@ -66,9 +66,28 @@ struct io_term {
 //   some devices (e.g. UART). See ioseek() functions, which is a wrapper around
 //   this ioctl operation.
 //
-//   IOCTL_FLUSH - Current not supported (do not need to implement).
+//   IOCTL_FLUSH - Writes buffered data back to the underlying device. Files
+//   cache writes until they are flushed, closed or evicted from the cache.
 //
 //   IOCTL_GETBLKSZ - Returns the block size. Optional.
+//
+//   IOCTL_GETBCSTATS - Returns the kernel block cache hit/miss counters.
+//   Supported by files.
+//
+//   IOCTL_GETRA - Gets the maximum readahead window of a file, in blocks.
+//
+//   IOCTL_SETRA - Sets the maximum readahead window of a file, in blocks. A
+//   value of 0 disables readahead.
+//
+//   IOCTL_GETPOLL - Gets the polling budget of the block device a file lives
+//   on, in spin iterations.
+//
+//   IOCTL_SETPOLL - Sets the polling budget of the block device a file lives
+//   on. A thread waiting for a request polls the device for up to that many
+//   iterations before it sleeps. A value of 0 (the default) always sleeps.
+//
+//   IOCTL_GETPOLLSTATS - Returns the polling counters of the block device a
+//   file lives on.
 
 #define IOCTL_GETLEN        1   // arg is pointer to uint64_t
 #define IOCTL_SETLEN        2   // arg is pointer to uint64_t
@@ -76,6 +95,37 @@ struct io_term {
 #define IOCTL_SETPOS        4   // arg is pointer to uint64_t
 #define IOCTL_FLUSH         5   // arg is ignored
 #define IOCTL_GETBLKSZ      6   // arg is pointer to uint32_t
+#define IOCTL_GETBCSTATS    8   // arg is pointer to struct bcache_stats
+#define IOCTL_GETRA         9   // arg is pointer to uint32_t
+#define IOCTL_SETRA         10  // arg is pointer to uint32_t
+#define IOCTL_GETPOLL       11  // arg is pointer to uint32_t
+#define IOCTL_SETPOLL       12  // arg is pointer to uint32_t
+#define IOCTL_GETPOLLSTATS  13  // arg is pointer to struct io_poll_stats
+
+// Block cache counters returned by IOCTL_GETBCSTATS.
+
+struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t prefetched;
+    uint64_t fill_waits;
+    uint64_t direct;
+    uint64_t zeroed;
+    uint64_t dev_reads;
+    uint64_t dev_writes;
+    uint64_t writebacks;
+};
+
+// Polling counters returned by IOCTL_GETPOLLSTATS.
+
+struct io_poll_stats {
+    uint64_t polls;
+    uint64_t poll_hits;
+    uint64_t poll_misses;
+    uint64_t spins;
+    uint64_t sleeps;
+};
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -5,6 +5,7 @@
 #define _SYSCALL_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 extern void __attribute__ ((noreturn)) _exit(void);
 extern void _msgout(const char * msg);
@@ -16,4 +17,33 @@ extern int _devopen(int fd, const char * name, int instno);
 extern int _fsopen(int fd, const char * name);
 extern int _exec(int fd);
 
+// A directory record filled in by _readdir; /size/ is the file length in
+// bytes.
+
+struct dirent {
+    char name[33]; // NUL-terminated
+    uint32_t inode;
+    uint32_t size;
+};
+
+// _readdir fills up to /n/ records of the file system directory, starting at
+// *cookie (0 for the first call), and advances *cookie. Returns the number of
+// records filled, 0 once the whole directory was listed, or a negative error
+// code.
+
+extern long _readdir(uint32_t * cookie, struct dirent * ents, size_t n);
+
+// Flags for _mmap. A MAP_SHARED mapping is read-only; a MAP_PRIVATE mapping
+// may be written, but the changes are private to the process.
+
+#define MAP_SHARED  0
+#define MAP_PRIVATE 1
+
+// _mmap maps /len/ bytes of the open file /fd/, starting at the page-aligned
+// offset /off/, and returns the address of the mapping. On failure the
+// returned value, cast to long, is a negative error code.
+
+extern void * _mmap(int fd, size_t off, size_t len, int flags);
+extern int _munmap(void * addr);
+
 #endif // _SYSCALL_H_
@@ -0,0 +1,339 @@
+// alloctest.c - Host test of the kfs block allocator and append reservations
+//
+// Usage: ./alloctest [mkfs]
+//
+// Makes small v1 and v2 images with mkfs, leaves free space after their data
+// blocks and grows their files through the kernel's kfs, checking the data
+// read back, that appends stay in few extents, that no data block is given to
+// two files, that a reservation lasts until the last descriptor of a file is
+// closed and is returned then, and that a full device fails writes with
+// -ENOSPC. Exits with 0 if every check passes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kfs_shim.h"
+#include "kfs.h"
+#include "error.h"
+
+#define NFILES 4
+#define MAX_RUNS 1024
+
+struct run {
+    uint32_t start;
+    uint32_t len;
+};
+
+static const char * const names[NFILES] = { "a", "b", "c", "d" };
+static const long sizes[NFILES] = { 5000, 100, 3 * SIZE_OF_4K_BLK, 10 };
+
+static struct host_dev dev;
+static struct io_intf * devio;
+static char dir[] = "/tmp/alloctestXXXXXX";
+static char img[64];
+static char blk[SIZE_OF_4K_BLK];
+static int fails;
+
+static void check(int ok, const char * test, const char * what) {
+    if (!ok) {
+        printf("FAIL %s: %s\n", test, what);
+        fails++;
+    }
+}
+
+static char pattern(int file, long pos) {
+    return (char)(pos * 7 + pos / 4093 + file * 31);
+}
+
+// Makes an image of /version/ holding the files a to d, followed by /spare/
+// free blocks, and mounts it. mkfs takes the file names as they are to be
+// stored, so it runs in /dir/.
+
+static void mount_image(const char * mkfs, int version, long spare) {
+    char cmd[1024];
+    char * prog;
+    FILE * f;
+    long pos;
+    int k;
+
+    for (k = 0; k < NFILES; k++) {
+        snprintf(cmd, sizeof(cmd), "%s/%s", dir, names[k]);
+        f = fopen(cmd, "wb");
+        if (f == NULL) {
+            perror(cmd);
+            exit(1);
+        }
+        for (pos = 0; pos < sizes[k]; pos++)
+            fputc(pattern(k, pos), f);
+        fclose(f);
+    }
+
+    prog = realpath(mkfs, NULL);
+    if (prog == NULL) {
+        perror(mkfs);
+        exit(1);
+    }
+    snprintf(cmd, sizeof(cmd), "cd %s && %s %s img a b c d > /dev/null",
+        dir, prog, (version == KFS_VERSION_2) ? "-v2" : "");
+    free(prog);
+    f = (system(cmd) == 0) ? fopen(img, "ab") : NULL;
+    if (f == NULL) {
+        fprintf(stderr, "alloctest: %s failed\n", mkfs);
+        exit(1);
+    }
+    memset(blk, 0, sizeof(blk));
+    for (pos = 0; pos < spare; pos++)
+        fwrite(blk, 1, sizeof(blk), f);
+    fclose(f);
+
+    devio = hostdev_open(&dev, img, 1);
+    if (devio == NULL || fs_mount(devio) != 0) {
+        fprintf(stderr, "alloctest: cannot mount %s\n", img);
+        exit(1);
+    }
+}
+
+static void unmount_image(void) {
+    ioclose(devio);
+    devio = NULL;
+}
+
+// Collects the data block runs of file /k/ from its on-disk inode, which is
+// current once the file has been closed. Returns the number of runs.
+
+static int file_runs(int k, struct run * runs) {
+    const struct boot_blk * boot = (const struct boot_blk *)dev.mem;
+    struct io_intf * io;
+    uint32_t ino, j, n;
+    int nruns = 0;
+
+    if (fs_open(names[k], &io) != 0)
+        return 0;
+    fs_file_ino(io, &ino);
+    ioclose(io);
+
+    if (boot->magic == KFS_MAGIC) {
+        const struct inode_v2 * inode = (const struct inode_v2 *)
+            (dev.mem + (START_IDX_OF_INODE + ino / KFS2_INODES_PER_BLK) *
+            SIZE_OF_4K_BLK) + ino % KFS2_INODES_PER_BLK;
+        for (j = 0; j < inode->num_extents; j++) {
+            runs[j].start = inode->extents[j].start;
+            runs[j].len = inode->extents[j].len;
+        }
+        return inode->num_extents;
+    }
+
+    const struct inode * inode = (const struct inode *)
+        (dev.mem + (START_IDX_OF_INODE + ino) * SIZE_OF_4K_BLK);
+    n = (inode->length + SIZE_OF_4K_BLK - 1) / SIZE_OF_4K_BLK;
+    for (j = 0; j < n; j++) {
+        if (j == 0 || inode->data_blks[j] != inode->data_blks[j - 1] + 1) {
+            runs[nruns].start = inode->data_blks[j];
+            runs[nruns++].len = 0;
+        }
+        runs[nruns - 1].len++;
+    }
+    return nruns;
+}
+
+// Checks that no data block belongs to two files or twice to one.
+
+static void check_disjoint(const char * test) {
+    static struct run runs[NFILES][MAX_RUNS];
+    int nruns[NFILES];
+    int k, l, i, j;
+
+    for (k = 0; k < NFILES; k++)
+        nruns[k] = file_runs(k, runs[k]);
+    for (k = 0; k < NFILES; k++)
+        for (l = k; l < NFILES; l++)
+            for (i = 0; i < nruns[k]; i++)
+                for (j = (k == l) ? i + 1 : 0; j < nruns[l]; j++)
+                    if (runs[k][i].start < runs[l][j].start + runs[l][j].len &&
+                        runs[l][j].start < runs[k][i].start + runs[k][i].len)
+                    {
+                        check(0, test, "data block allocated twice");
+                        return;
+                    }
+}
+
+// Checks that file /k/ holds /len/ bytes of its pattern.
+
+static void check_data(const char * test, int k, long len) {
+    struct io_intf * io;
+    uint64_t flen;
+    char * got;
+    long pos;
+
+    if (fs_open(names[k], &io) != 0) {
+        check(0, test, "open");
+        return;
+    }
+    ioctl(io, IOCTL_GETLEN, &flen);
+    got = malloc(len + 1);
+    if (flen != (uint64_t)len || ioread_full(io, got, len) != len)
+        check(0, test, "length");
+    else
+        for (pos = 0; pos < len; pos++)
+            if (got[pos] != pattern(k, pos)) {
+                check(0, test, "data mismatch");
+                break;
+            }
+    free(got);
+    ioclose(io);
+}
+
+// Appends up to /n/ bytes of the pattern of file /k/ through /io/, whose
+// position is at the end of the file, with a single call of the write op, so
+// that a short write is seen. Returns the result of the write.
+
+static long append(struct io_intf * io, int k, long n) {
+    uint64_t pos;
+    long i;
+
+    ioctl(io, IOCTL_GETPOS, &pos);
+    for (i = 0; i < n && i < (long)sizeof(blk); i++)
+        blk[i] = pattern(k, pos + i);
+    return io->ops->write(io, blk, n);
+}
+
+// Appends to a and b in turn, a block at a time. Each file must grow in
+// runs of the reservation, not a block per extent.
+
+static void test_interleaved(const char * mkfs, int version) {
+    const char * test = (version == KFS_VERSION_2) ? "interleaved v2" : "interleaved v1";
+    struct run runs[MAX_RUNS];
+    struct io_intf * io[2];
+    long len[2];
+    int i, k;
+
+    mount_image(mkfs, version, 256);
+    for (k = 0; k < 2; k++) {
+        fs_open(names[k], &io[k]);
+        len[k] = sizes[k];
+        ioseek(io[k], len[k]);
+    }
+    for (i = 0; i < 64; i++)
+        for (k = 0; k < 2; k++) {
+            check(append(io[k], k, SIZE_OF_4K_BLK) == SIZE_OF_4K_BLK, test, "append");
+            len[k] += SIZE_OF_4K_BLK;
+        }
+    for (k = 0; k < 2; k++) {
+        ioclose(io[k]);
+        check(file_runs(k, runs) <= 64 / PREALLOC_BLKS + 2, test, "too many extents");
+    }
+
+    fs_mount(devio);
+    for (k = 0; k < 2; k++)
+        check_data(test, k, len[k]);
+    check_data(test, 2, sizes[2]);
+    check_data(test, 3, sizes[3]);
+    check_disjoint(test);
+    unmount_image();
+}
+
+// Closing one of two descriptors of d must keep the reservation of d, so
+// that a block taken by c in between does not split d. d is the last file of
+// the image, c the one before it.
+
+static void test_shared_reservation(const char * mkfs) {
+    const char * test = "shared reservation";
+    struct run runs[MAX_RUNS];
+    struct io_intf * d1, * d2, * c;
+    long dlen = sizes[3];
+
+    mount_image(mkfs, KFS_VERSION_2, 64);
+    fs_open("d", &d1);
+    fs_open("d", &d2);
+    fs_open("c", &c);
+    ioseek(d1, dlen);
+    ioseek(c, sizes[2]);
+
+    // the second sequential append makes the reservation
+    dlen += append(d1, 3, SIZE_OF_4K_BLK);
+    dlen += append(d1, 3, SIZE_OF_4K_BLK);
+    ioclose(d2);
+    append(c, 2, SIZE_OF_4K_BLK);
+    dlen += append(d1, 3, SIZE_OF_4K_BLK);
+    ioclose(d1);
+    ioclose(c);
+
+    check(file_runs(3, runs) == 1, test, "file split by another file's append");
+    check_data(test, 3, dlen);
+    check_disjoint(test);
+    unmount_image();
+}
+
+// With just enough free space for a and b, the reservation a holds after
+// its appends must be returned by its last close for b to fit. Once the
+// device is full, appends fail with -ENOSPC and the data stays intact.
+
+static void test_full(const char * mkfs) {
+    const char * test = "full device";
+    struct io_intf * io;
+    long alen = sizes[0];
+    long blen = sizes[1];
+    long r;
+    int i;
+
+    mount_image(mkfs, KFS_VERSION_2, 20);
+    fs_open("a", &io);
+    ioseek(io, alen);
+    // a ends inside its second block; three appends take two more blocks
+    for (i = 0; i < 3; i++) {
+        r = append(io, 0, 3000);
+        check(r == 3000, test, "append to a");
+        alen += r;
+    }
+    ioclose(io);
+
+    fs_open("b", &io);
+    ioseek(io, blen);
+    // b has one block and room for 20 - 2 = 18 more
+    for (i = 0; i < 18; i++) {
+        r = append(io, 1, SIZE_OF_4K_BLK);
+        check(r == SIZE_OF_4K_BLK, test, "append to b");
+        blen += (r > 0) ? r : 0;
+    }
+    // only the tail of the last block of b is left
+    r = append(io, 1, SIZE_OF_4K_BLK);
+    check(r == SIZE_OF_4K_BLK - 100, test, "short append");
+    blen += (r > 0) ? r : 0;
+    r = append(io, 1, SIZE_OF_4K_BLK);
+    check(r == -ENOSPC, test, "append past a full device");
+    ioclose(io);
+
+    fs_mount(devio);
+    check_data(test, 0, alen);
+    check_data(test, 1, blen);
+    check_disjoint(test);
+    unmount_image();
+}
+
+int main(int argc, char * argv[]) {
+    const char * mkfs = (argc > 1) ? argv[1] : "./mkfs";
+    int k;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("alloctest");
+        exit(1);
+    }
+    snprintf(img, sizeof(img), "%s/img", dir);
+
+    test_interleaved(mkfs, 1);
+    test_interleaved(mkfs, KFS_VERSION_2);
+    test_shared_reservation(mkfs);
+    test_full(mkfs);
+
+    for (k = 0; k < NFILES; k++) {
+        snprintf(blk, sizeof(blk), "%s/%s", dir, names[k]);
+        unlink(blk);
+    }
+    unlink(img);
+    rmdir(dir);
+
+    printf("alloctest: %d failure(s)\n", fails);
+    return fails != 0;
+}
@@ -0,0 +1,329 @@
+// kfs_shim.c - Host environment for running kfs outside the kernel
+//
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kfs_shim.h"
+#include "console.h"
+#include "error.h"
+#include "halt.h"
+#include "heap.h"
+#include "memory.h"
+#include "thread.h"
+#include "timer.h"
+
+int shim_verbose = 0;
+
+// The kernel timer is not running on the host; the kfs flusher thread is
+// never started (see thread_spawn below), so these are never signalled.
+
+struct condition tick_1Hz;
+struct condition tick_10Hz;
+uint64_t tick_1Hz_count;
+uint64_t tick_10Hz_count;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void hostdev_close(struct io_intf * io);
+static long hostdev_read(struct io_intf * io, void * buf, unsigned long bufsz);
+static long hostdev_write(struct io_intf * io, const void * buf, unsigned long n);
+static int hostdev_ioctl(struct io_intf * io, int cmd, void * arg);
+static long hostdev_readat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz);
+static long hostdev_writeat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long n);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+struct io_intf * hostdev_open (
+    struct host_dev * dev, const char * path, int in_memory)
+{
+    static const struct io_ops ops = {
+        .close = hostdev_close,
+        .read = hostdev_read,
+        .write = hostdev_write,
+        .ctl = hostdev_ioctl,
+        .readat = hostdev_readat,
+        .writeat = hostdev_writeat
+    };
+
+    struct stat st;
+    int fd;
+
+    fd = open(path, in_memory ? O_RDONLY : O_RDWR);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return NULL;
+    }
+
+    *dev = (struct host_dev){ 0 };
+    dev->io_intf.ops = &ops;
+    dev->size = st.st_size;
+    dev->fd = fd;
+
+    if (in_memory) {
+        dev->mem = malloc(dev->size);
+        if (dev->mem == NULL
+            || pread(fd, dev->mem, dev->size, 0) != (ssize_t)dev->size)
+        {
+            perror(path);
+            close(fd);
+            return NULL;
+        }
+        close(fd);
+        dev->fd = -1;
+    }
+
+    return &dev->io_intf;
+}
+
+void hostdev_reset_counts(struct host_dev * dev) {
+    dev->reads = 0;
+    dev->writes = 0;
+    dev->bytes_read = 0;
+    dev->bytes_written = 0;
+}
+
+// Kernel services used by kfs.c, bcache.c and io.c
+
+size_t kprintf(const char * fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (!shim_verbose)
+        return 0;
+
+    va_start(ap, fmt);
+    n = vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+void console_labeled_printf (
+    const char * label, const char * src_flname, int src_lineno,
+    const char * fmt, ...)
+{
+    va_list ap;
+
+    if (!shim_verbose)
+        return;
+
+    fprintf(stderr, "%s %s:%d: ", label, src_flname, src_lineno);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+// Used by ioprintf in io.c; kern/string.h is not included here since its
+// snprintf clashes with the host's.
+
+size_t vgprintf (
+    void (*putcfn)(char, void *), void * aux, const char * fmt, va_list ap)
+{
+    char line[512];
+    int n, i;
+
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    if (n > (int)sizeof(line) - 1)
+        n = sizeof(line) - 1;
+    for (i = 0; i < n; i++)
+        putcfn(line[i], aux);
+    return n;
+}
+
+void panic(const char * msg) {
+    fprintf(stderr, "PANIC %s\n", (msg != NULL) ? msg : "");
+    abort();
+}
+
+void * kmalloc(size_t size) {
+    return calloc(1, size);
+}
+
+void * kcalloc(size_t n, size_t size) {
+    return calloc(n, size);
+}
+
+void kfree(void * ptr) {
+    free(ptr);
+}
+
+void * memory_alloc_page(void) {
+    void * pp = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+    if (pp == NULL)
+        panic("memory_alloc_page: out of memory");
+    return pp;
+}
+
+void memory_free_page(void * pp) {
+    free(pp);
+}
+
+// There is a single thread on the host, so a lock is never contended and a
+// thread never waits.
+
+int running_thread(void) {
+    return 0;
+}
+
+int thread_spawn(const char * name, void (*start)(void *), void * arg) {
+    return -ENOTSUP;
+}
+
+void condition_init(struct condition * cond, const char * name) {
+    cond->name = name;
+}
+
+void condition_wait(struct condition * cond) {
+    panic("condition_wait: would block forever");
+}
+
+void condition_wait_until(struct condition * cond, const volatile int * flag) {
+    if (!*flag)
+        condition_wait(cond);
+}
+
+void condition_broadcast(struct condition * cond) { }
+
+void lock_init(struct lock * lock, const char * name) {
+    lock->owner = NULL;
+    condition_init(&lock->released, name);
+}
+
+void lock_acquire(struct lock * lock) {
+    if (lock->owner != NULL)
+        panic("lock_acquire: lock already held");
+    lock->owner = (struct thread *)lock;
+}
+
+void lock_release(struct lock * lock) {
+    if (lock->owner == NULL)
+        panic("lock_release: lock not held");
+    lock->owner = NULL;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void hostdev_close(struct io_intf * io) {
+    struct host_dev * const dev =
+        (void*)io - offsetof(struct host_dev, io_intf);
+
+    if (dev->fd >= 0)
+        close(dev->fd);
+    free(dev->mem);
+    dev->fd = -1;
+    dev->mem = NULL;
+}
+
+long hostdev_read(struct io_intf * io, void * buf, unsigned long bufsz) {
+    struct host_dev * const dev =
+        (void*)io - offsetof(struct host_dev, io_intf);
+    long n;
+
+    n = hostdev_readat(io, dev->pos, buf, bufsz);
+    if (n > 0)
+        dev->pos += n;
+    return n;
+}
+
+long hostdev_write(struct io_intf * io, const void * buf, unsigned long n) {
+    struct host_dev * const dev =
+        (void*)io - offsetof(struct host_dev, io_intf);
+    long cnt;
+
+    cnt = hostdev_writeat(io, dev->pos, buf, n);
+    if (cnt > 0)
+        dev->pos += cnt;
+    return cnt;
+}
+
+long hostdev_readat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long bufsz)
+{
+    struct host_dev * const dev =
+        (void*)io - offsetof(struct host_dev, io_intf);
+    long n;
+
+    if (pos > dev->size)
+        return -EINVAL;
+    if (bufsz > dev->size - pos)
+        bufsz = dev->size - pos;
+
+    dev->reads++;
+
+    if (dev->mem != NULL) {
+        memcpy(buf, dev->mem + pos, bufsz);
+        n = bufsz;
+    } else {
+        n = pread(dev->fd, buf, bufsz, pos);
+        if (n < 0)
+            return -EIO;
+    }
+
+    dev->bytes_read += n;
+    return n;
+}
+
+long hostdev_writeat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long n)
+{
+    struct host_dev * const dev =
+        (void*)io - offsetof(struct host_dev, io_intf);
+    long cnt;
+
+    if (pos > dev->size)
+        return -EINVAL;
+    if (n > dev->size - pos)
+        n = dev->size - pos;
+
+    dev->writes++;
+
+    if (dev->mem != NULL) {
+        memcpy(dev->mem + pos, buf, n);
+        cnt = n;
+    } else {
+        cnt = pwrite(dev->fd, buf, n, pos);
+        if (cnt < 0)
+            return -EIO;
+    }
+
+    dev->bytes_written += cnt;
+    return cnt;
+}
+
+int hostdev_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct host_dev * const dev =
+        (void*)io - offsetof(struct host_dev, io_intf);
+
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t*)arg = dev->size;
+        return 0;
+    case IOCTL_GETPOS:
+        *(uint64_t*)arg = dev->pos;
+        return 0;
+    case IOCTL_SETPOS:
+        if (*(uint64_t*)arg > dev->size)
+            return -EINVAL;
+        dev->pos = *(uint64_t*)arg;
+        return 0;
+    case IOCTL_GETBLKSZ:
+        *(uint32_t*)arg = 512;
+        return 0;
+    case IOCTL_FLUSH:
+        return (dev->fd >= 0 && fsync(dev->fd) != 0) ? -EIO : 0;
+    default:
+        return -ENOTSUP;
+    }
+}
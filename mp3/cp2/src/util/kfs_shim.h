@@ -0,0 +1,48 @@
+// kfs_shim.h - Host environment for running kfs outside the kernel
+//
+// The kfs benchmark compiles kern/kfs.c, kern/bcache.c and kern/io.c
+// unchanged and links them against kfs_shim.c, which provides the few kernel
+// services they use (console, heap, page allocator, threads) and a block
+// device backed by a host file or a memory buffer.
+
+#ifndef _KFS_SHIM_H_
+#define _KFS_SHIM_H_
+
+#include "io.h"
+
+#include <stdint.h>
+
+// A block device on the host. Every call into the device is counted, so that
+// the number of device requests a kfs operation issues can be measured.
+
+struct host_dev {
+    struct io_intf io_intf;
+    int fd;         // backing file, -1 for a memory image
+    char * mem;     // backing buffer of a memory image
+    uint64_t size;
+    uint64_t pos;
+
+    uint64_t reads;         // read requests
+    uint64_t writes;        // write requests
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+};
+
+// Verbosity of kprintf: 0 drops kernel messages, 1 prints them to stderr.
+
+extern int shim_verbose;
+
+// struct io_intf * hostdev_open(struct host_dev * dev, const char * path, int in_memory)
+// Opens the image at /path/ as a block device. With /in_memory/ set the image
+// is read into memory and writes do not reach the file. Returns the io_intf
+// of the device, or NULL if the image cannot be opened.
+
+extern struct io_intf * hostdev_open (
+    struct host_dev * dev, const char * path, int in_memory);
+
+// void hostdev_reset_counts(struct host_dev * dev)
+// Clears the request and byte counters of the device.
+
+extern void hostdev_reset_counts(struct host_dev * dev);
+
+#endif // _KFS_SHIM_H_
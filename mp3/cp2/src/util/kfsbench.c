@@ -0,0 +1,314 @@
+// kfsbench.c - Host benchmark of kfs on images made by mkfs
+//
+// Usage: ./kfsbench [-m] [-w] [-c] [-v] [-n reps] [filesystem_image] [file1] [file2] ...
+//
+//   -m       keep the image in memory, so device time is only a memcpy
+//   -w       also run the write benchmarks (without -m they modify the image);
+//            compressed files are read-only and are skipped by them
+//   -c       compare the data of every read with the files given, which must
+//            be the ones the image was made from; the comparison is timed
+//            along with the reads
+//   -v       print the messages of the kernel code to stderr
+//   -n reps  number of times each benchmark is repeated (default 3)
+//
+// Every benchmark first remounts the file system, so the first repetition
+// starts with a cold block cache and the following ones run warm. For each
+// benchmark the driver prints the number of calls, the throughput and the
+// device requests issued per call.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kfs_shim.h"
+#include "kfs.h"
+#include "bcache.h"
+#include "error.h"
+
+#define MAX_BENCH_FILES 63
+#define OPEN_ITERS 1000
+#define APPEND_MAX (1024 * 1024)
+
+struct result {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t skipped; // files left out because they cannot be written
+};
+
+static struct host_dev dev;
+static struct io_intf * devio;
+static const char * names[MAX_BENCH_FILES];
+static int nfiles;
+static char * refs[MAX_BENCH_FILES]; // contents of the source files with -c
+static long ref_lens[MAX_BENCH_FILES];
+static char buf[64 * 1024];
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char * base_name(const char * path) {
+    const char * p = strrchr(path, '/');
+    return (p != NULL) ? p + 1 : path;
+}
+
+static void report (
+    const char * name, unsigned long chunk, int rep,
+    const struct result * r, double secs,
+    const struct bcache_stats * before, const struct bcache_stats * after)
+{
+    uint64_t calls = (r->calls != 0) ? r->calls : 1;
+
+    printf("%-8s %6lu %-4s %8lu %10lu %9.3f %9.1f %7lu %7lu %7.3f %7.3f %7lu %7lu\n",
+        name, chunk, (rep == 0) ? "cold" : "warm",
+        (unsigned long)r->calls, (unsigned long)r->bytes, secs * 1e3,
+        (secs > 0) ? r->bytes / secs / (1024 * 1024) : 0.0,
+        (unsigned long)dev.reads, (unsigned long)dev.writes,
+        (double)dev.reads / calls, (double)dev.writes / calls,
+        (unsigned long)(after->hits - before->hits),
+        (unsigned long)(after->misses - before->misses));
+}
+
+static char * load_file(const char * path, long * len) {
+    FILE * f;
+    char * data;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    rewind(f);
+    data = malloc(*len + 1);
+    if (data != NULL && fread(data, 1, *len, f) != (size_t)*len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+// The benchmarks return 0 on success and count their calls and bytes in /r/.
+
+static int bench_open(struct result * r, unsigned long chunk) {
+    struct io_intf * io;
+    int i, k;
+
+    for (i = 0; i < OPEN_ITERS; i++) {
+        for (k = 0; k < nfiles; k++) {
+            if (fs_open(names[k], &io) != 0)
+                return -1;
+            ioclose(io);
+            r->calls += 2;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_read(struct result * r, unsigned long chunk) {
+    struct io_intf * io;
+    long pos;
+    long n;
+    int k;
+
+    for (k = 0; k < nfiles; k++) {
+        if (fs_open(names[k], &io) != 0)
+            return -1;
+        pos = 0;
+        do {
+            n = ioread(io, buf, chunk);
+            r->calls++;
+            if (n < 0) {
+                ioclose(io);
+                return -1;
+            }
+            if (refs[k] != NULL && (ref_lens[k] - pos < n ||
+                memcmp(buf, refs[k] + pos, n) != 0))
+            {
+                fprintf(stderr, "kfsbench: %s differs from its source "
+                    "within bytes %ld to %ld\n", names[k], pos, pos + n);
+                ioclose(io);
+                return -1;
+            }
+            pos += n;
+            r->bytes += n;
+        } while (n > 0);
+        ioclose(io);
+        if (refs[k] != NULL && pos != ref_lens[k]) {
+            fprintf(stderr, "kfsbench: read %ld of the %ld bytes of %s\n",
+                pos, ref_lens[k], names[k]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int bench_write(struct result * r, unsigned long chunk) {
+    struct io_intf * io;
+    uint64_t len, pos;
+    long n;
+    int k;
+
+    for (k = 0; k < nfiles; k++) {
+        if (fs_open(names[k], &io) != 0)
+            return -1;
+        ioctl(io, IOCTL_GETLEN, &len);
+        for (pos = 0; pos < len; pos += n) {
+            n = iowrite(io, buf, (len - pos < chunk) ? len - pos : chunk);
+            if (n == -ENOTSUP && pos == 0) {
+                r->skipped++; // compressed
+                break;
+            }
+            r->calls++;
+            if (n <= 0) {
+                ioclose(io);
+                return -1;
+            }
+            r->bytes += n;
+        }
+        ioctl(io, IOCTL_FLUSH, NULL);
+        ioclose(io);
+    }
+
+    return 0;
+}
+
+static int bench_append(struct result * r, unsigned long chunk) {
+    struct io_intf * io;
+    uint64_t len;
+    long n;
+    int k;
+
+    // append to the first file that can be written
+
+    for (k = 0; k < nfiles; k++) {
+        if (fs_open(names[k], &io) != 0)
+            return -1;
+        ioctl(io, IOCTL_GETLEN, &len);
+        ioseek(io, len);
+        n = iowrite(io, buf, chunk);
+        if (n != -ENOTSUP)
+            break;
+        r->skipped++; // compressed
+        ioclose(io);
+    }
+
+    if (k == nfiles)
+        return 0;
+
+    for (;;) {
+        r->calls++;
+        if (n <= 0)
+            break; // out of space
+        r->bytes += n;
+        if (APPEND_MAX <= r->bytes)
+            break;
+        n = iowrite(io, buf, chunk);
+    }
+    ioctl(io, IOCTL_FLUSH, NULL);
+    ioclose(io);
+    return 0;
+}
+
+static void run (
+    const char * name, unsigned long chunk, int reps,
+    int (*bench)(struct result *, unsigned long))
+{
+    struct bcache_stats before, after;
+    struct result r;
+    double t0, t1;
+    int rep;
+
+    for (rep = 0; rep < reps; rep++) {
+        if (rep == 0 && fs_mount(devio) != 0) {
+            fprintf(stderr, "kfsbench: mount failed\n");
+            exit(1);
+        }
+
+        r = (struct result){ 0 };
+        bcache_get_stats(&before);
+        hostdev_reset_counts(&dev);
+        t0 = now();
+        if (bench(&r, chunk) != 0) {
+            fprintf(stderr, "kfsbench: %s failed\n", name);
+            exit(1);
+        }
+        t1 = now();
+        bcache_get_stats(&after);
+        report(name, chunk, rep, &r, t1 - t0, &before, &after);
+        if (rep == 0 && r.skipped != 0)
+            printf("%-8s %6lu skipped %lu compressed file(s)\n",
+                name, chunk, (unsigned long)r.skipped);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    static const unsigned long chunks[] = { 512, 4096, 65536 };
+    int in_memory = 0;
+    int writes = 0;
+    int verify = 0;
+    int reps = 3;
+    int first = 1;
+    unsigned int i;
+
+    while (first < argc && argv[first][0] == '-') {
+        if (strcmp(argv[first], "-m") == 0)
+            in_memory = 1;
+        else if (strcmp(argv[first], "-w") == 0)
+            writes = 1;
+        else if (strcmp(argv[first], "-c") == 0)
+            verify = 1;
+        else if (strcmp(argv[first], "-n") == 0 && first + 1 < argc)
+            reps = atoi(argv[++first]);
+        else if (strcmp(argv[first], "-v") == 0)
+            shim_verbose = 1;
+        else
+            break;
+        first++;
+    }
+
+    if (argc < first + 2 || argv[first][0] == '-' || reps < 1) {
+        fprintf(stderr, "Usage: ./kfsbench [-m] [-w] [-c] [-v] [-n reps] [filesystem_image] [file1] [file2] ...\n");
+        exit(1);
+    }
+
+    devio = hostdev_open(&dev, argv[first], in_memory);
+    if (devio == NULL)
+        exit(1);
+
+    for (i = first + 1; i < argc && nfiles < MAX_BENCH_FILES; i++) {
+        if (verify) {
+            refs[nfiles] = load_file(argv[i], &ref_lens[nfiles]);
+            if (refs[nfiles] == NULL) {
+                fprintf(stderr, "kfsbench: cannot read %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        names[nfiles++] = base_name(argv[i]);
+    }
+
+    memset(buf, 0x5a, sizeof(buf));
+
+    printf("%-8s %6s %-4s %8s %10s %9s %9s %7s %7s %7s %7s %7s %7s\n",
+        "bench", "chunk", "pass", "calls", "bytes", "ms", "MB/s",
+        "dev_rd", "dev_wr", "rd/call", "wr/call", "hits", "misses");
+
+    run("open", 0, reps, bench_open);
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+        run("read", chunks[i], reps, bench_read);
+
+    if (writes) {
+        for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+            run("write", chunks[i], reps, bench_write);
+        run("append", 4096, 1, bench_append);
+    }
+
+    ioclose(devio);
+    return 0;
+}
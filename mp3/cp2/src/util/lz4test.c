@@ -0,0 +1,305 @@
+// lz4test.c - Host round-trip test of the kfs LZ4 chunk decoder
+//
+// Usage: ./lz4test [mkfs]
+//
+// Writes files with data of different compressibility into a temporary
+// directory, stores them compressed in a v2 image with mkfs -Z, mounts the
+// image with the kernel's kfs and checks that reads of every size and
+// position, and the pages handed to memory mappings, return the original
+// bytes. Then corrupts the chunk table and a compressed chunk and checks that
+// reads fail with -EBADFMT. Exits with 0 if every check passes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kfs_shim.h"
+#include "kfs.h"
+#include "error.h"
+
+#define NPATTERNS 9
+
+struct pattern {
+    const char * name;
+    long len;
+    int compressible;   // 1 if mkfs should manage to shrink it
+    char * data;
+};
+
+static struct pattern patterns[NPATTERNS] = {
+    { "zeros",    65536, 1 },
+    { "period1",  40000, 1 },   // overlapping matches of distance 1 to 7
+    { "period7",  40000, 1 },
+    { "words",    50001, 1 },   // short literals and matches
+    { "literals", 12345, 1 },   // literal runs longer than 15 + 255
+    { "random",   20000, 0 },   // every chunk stored as is
+    { "mixed",    36864, 1 },   // alternating random and zero chunks
+    { "tiny",     10,    0 },
+    { "twochunk", 8192,  1 },   // ends exactly on a chunk boundary
+};
+
+static struct host_dev dev;
+static struct io_intf * devio;
+static char dir[] = "/tmp/lz4testXXXXXX";
+static char path[NPATTERNS + 1][64];
+static int fails;
+
+static void check(int ok, const char * what, const char * name) {
+    if (!ok) {
+        printf("FAIL %s: %s\n", name, what);
+        fails++;
+    }
+}
+
+static void fill(struct pattern * p) {
+    static const char * const words[] = {
+        "kernel ", "block ", "cache ", "inode ", "extent ", "the ", "of ",
+        "virtio ", "chunk ", "read ", "write ", "\n"
+    };
+    long i, n;
+
+    p->data = malloc(p->len);
+    if (p->data == NULL)
+        exit(1);
+
+    if (strcmp(p->name, "zeros") == 0)
+        memset(p->data, 0, p->len);
+    else if (strcmp(p->name, "period1") == 0)
+        memset(p->data, 'a', p->len);
+    else if (strcmp(p->name, "period7") == 0)
+        for (i = 0; i < p->len; i++)
+            p->data[i] = "abcdefg"[i % 7];
+    else if (strcmp(p->name, "words") == 0)
+        for (i = 0; i < p->len; i += n) {
+            const char * w = words[rand() % 12];
+            n = strlen(w);
+            if (p->len - i < n)
+                n = p->len - i;
+            memcpy(p->data + i, w, n);
+        }
+    else if (strcmp(p->name, "literals") == 0)
+        // 600 random bytes, then a long zero run, again and again
+        for (i = 0; i < p->len; i++)
+            p->data[i] = (i % 1200 < 600) ? rand() : 0;
+    else if (strcmp(p->name, "mixed") == 0)
+        for (i = 0; i < p->len; i++)
+            p->data[i] = (i / SIZE_OF_4K_BLK % 2 == 0) ? rand() : 0;
+    else if (strcmp(p->name, "twochunk") == 0)
+        for (i = 0; i < p->len; i++)
+            p->data[i] = i / 64;
+    else
+        for (i = 0; i < p->len; i++)
+            p->data[i] = rand();
+}
+
+static int write_file(const char * file, const char * data, long len) {
+    FILE * f = fopen(file, "wb");
+
+    if (f == NULL)
+        return -1;
+    if (fwrite(data, 1, len, f) != (size_t)len) {
+        fclose(f);
+        return -1;
+    }
+    return fclose(f);
+}
+
+// mkfs takes the file names as they are to be stored, so it runs in /dir/.
+
+static int make_image(const char * mkfs) {
+    char cmd[2048];
+    char * prog;
+    int k;
+
+    prog = realpath(mkfs, NULL);
+    if (prog == NULL)
+        return -1;
+    snprintf(cmd, sizeof(cmd), "cd %s && %s -v2 -Z img", dir, prog);
+    for (k = 0; k < NPATTERNS; k++) {
+        strcat(cmd, " ");
+        strcat(cmd, patterns[k].name);
+    }
+    strcat(cmd, " > /dev/null");
+    free(prog);
+    return system(cmd);
+}
+
+// Returns the on-disk inode of /name/ in the mounted image.
+
+static struct inode_v2 * disk_inode(const char * name) {
+    static struct inode_v2 inode;
+    struct io_intf * io;
+    uint32_t ino;
+
+    if (fs_open(name, &io) != 0)
+        return NULL;
+    fs_file_ino(io, &ino);
+    ioclose(io);
+    memcpy(&inode, dev.mem + (START_IDX_OF_INODE + ino / KFS2_INODES_PER_BLK) *
+        SIZE_OF_4K_BLK + ino % KFS2_INODES_PER_BLK * KFS2_INODE_SIZE, sizeof(inode));
+    return &inode;
+}
+
+// Returns the stored data of the compressed file /name/ inside the image.
+
+static char * stored_data(const char * name) {
+    const struct boot_blk * boot = (const struct boot_blk *)dev.mem;
+    struct inode_v2 * inode = disk_inode(name);
+    uint32_t data_start;
+
+    data_start = START_IDX_OF_INODE +
+        (boot->num_inodes + KFS2_INODES_PER_BLK - 1) / KFS2_INODES_PER_BLK;
+    return dev.mem + (data_start + inode->extents[0].start) * SIZE_OF_4K_BLK;
+}
+
+static void test_reads(const struct pattern * p) {
+    static const unsigned long sizes[] = { 1, 100, 4095, 4096, 5000, 65536 };
+    struct io_intf * io;
+    char * got;
+    uint64_t len, pos;
+    long n, want, tot;
+    unsigned int s;
+    int t;
+
+    if (fs_open(p->name, &io) != 0) {
+        check(0, "open", p->name);
+        return;
+    }
+    ioctl(io, IOCTL_GETLEN, &len);
+    check(len == (uint64_t)p->len, "length", p->name);
+
+    got = malloc(p->len + 65536);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        ioseek(io, 0);
+        tot = 0;
+        while ((n = ioread(io, got + tot, sizes[s])) > 0)
+            tot += n;
+        check(n == 0, "read error", p->name);
+        check(tot == p->len && memcmp(got, p->data, p->len) == 0,
+            "sequential read mismatch", p->name);
+    }
+
+    for (t = 0; t < 200; t++) {
+        pos = rand() % p->len;
+        want = rand() % 9000 + 1;
+        if (p->len - pos < want)
+            want = p->len - pos;
+        ioseek(io, pos);
+        n = ioread_full(io, got, want);
+        if (n != want || memcmp(got, p->data + pos, want) != 0) {
+            check(0, "random read mismatch", p->name);
+            break;
+        }
+    }
+    ioclose(io);
+    free(got);
+}
+
+static void test_pages(const struct pattern * p) {
+    struct io_intf * io;
+    uint32_t ino, pg;
+    long off, m;
+    void * page;
+
+    if (fs_open(p->name, &io) != 0)
+        return;
+    fs_file_ino(io, &ino);
+    ioclose(io);
+
+    for (pg = 0; pg * SIZE_OF_4K_BLK < (uint32_t)p->len; pg++) {
+        if (fs_get_page(ino, pg, &page) != 0) {
+            check(0, "get page", p->name);
+            return;
+        }
+        off = pg * SIZE_OF_4K_BLK;
+        m = (p->len - off < SIZE_OF_4K_BLK) ? p->len - off : SIZE_OF_4K_BLK;
+        check(memcmp(page, p->data + off, m) == 0, "page mismatch", p->name);
+        for (; m < SIZE_OF_4K_BLK; m++)
+            if (((char *)page)[m] != 0) {
+                check(0, "page tail not zero", p->name);
+                break;
+            }
+        fs_put_page(page);
+    }
+}
+
+static void test_corrupt(void) {
+    struct io_intf * io;
+    struct zchunk_hdr * hdr;
+    uint32_t * off;
+    char b[16];
+
+    // a chunk table that disagrees with the length of the file
+
+    hdr = (struct zchunk_hdr *)stored_data("zeros");
+    hdr->num_chunks++;
+    fs_mount(devio);
+    if (fs_open("zeros", &io) == 0) {
+        check(ioread(io, b, sizeof(b)) == -EBADFMT, "bad chunk table accepted", "zeros");
+        ioclose(io);
+    }
+    hdr->num_chunks--;
+
+    // a chunk whose literal length runs past the end of the chunk; the
+    // chunk before it must still read
+
+    off = (uint32_t *)(hdr + 1);
+    memset((char *)hdr + off[1], 0xff, off[2] - off[1]);
+    fs_mount(devio);
+    if (fs_open("zeros", &io) == 0) {
+        check(ioread(io, b, sizeof(b)) == sizeof(b), "good chunk rejected", "zeros");
+        ioseek(io, KFS_ZCHUNK_SIZE);
+        check(ioread(io, b, sizeof(b)) == -EBADFMT, "bad chunk accepted", "zeros");
+        ioclose(io);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    const char * mkfs = (argc > 1) ? argv[1] : "./mkfs";
+    struct inode_v2 * inode;
+    int k;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("lz4test");
+        exit(1);
+    }
+
+    srand(1);
+    for (k = 0; k < NPATTERNS; k++) {
+        fill(&patterns[k]);
+        snprintf(path[k], sizeof(path[k]), "%s/%s", dir, patterns[k].name);
+        if (write_file(path[k], patterns[k].data, patterns[k].len) != 0) {
+            perror(path[k]);
+            exit(1);
+        }
+    }
+    snprintf(path[NPATTERNS], sizeof(path[NPATTERNS]), "%s/img", dir);
+    if (make_image(mkfs) != 0) {
+        fprintf(stderr, "lz4test: %s failed\n", mkfs);
+        exit(1);
+    }
+
+    devio = hostdev_open(&dev, path[NPATTERNS], 1);
+    if (devio == NULL || fs_mount(devio) != 0) {
+        fprintf(stderr, "lz4test: cannot mount %s\n", path[NPATTERNS]);
+        exit(1);
+    }
+
+    for (k = 0; k < NPATTERNS; k++) {
+        inode = disk_inode(patterns[k].name);
+        check(inode != NULL && (inode->flags & KFS2_INODE_COMPRESSED) ==
+            (patterns[k].compressible ? KFS2_INODE_COMPRESSED : 0),
+            "compression flag", patterns[k].name);
+        test_reads(&patterns[k]);
+        test_pages(&patterns[k]);
+    }
+    test_corrupt();
+
+    for (k = 0; k <= NPATTERNS; k++)
+        unlink(path[k]);
+    rmdir(dir);
+
+    printf("lz4test: %d failure(s)\n", fails);
+    return fails != 0;
+}
@@ -8,6 +8,15 @@
 
 #define FS_BLKSZ      4096
 #define FS_NAMELEN    32
+#define FS_MAGIC      0x3253464b   // "KFS2"
+#define FS_VERSION_2  2
+#define FS_INODE2_SZ  256
+#define FS_INODES_PER_BLK (FS_BLKSZ / FS_INODE2_SZ)
+#define FS_MAX_EXTENTS 31
+#define FS_INODE_COMPRESSED 0x0001
+#define FS_ZCHUNK     FS_BLKSZ     // bytes of file data per compressed chunk
+#define FS_MAX_ZCHUNKS (FS_BLKSZ / 4 - 1)
+#define TRACE_TAG     "kfs_trace:" // prefix of the trace lines in a kernel log
 
 #ifndef static_assert
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
@@ -15,6 +24,28 @@
 
 // Disk layout:
 // [ boot block | inodes | data blocks ]
+//
+// v1 (default): one 4K inode per file holding a list of data blocks.
+// v2 (-v2): 256-byte inodes holding (start, length) extents, 16 per block.
+// The boot block of a v2 image carries FS_MAGIC and FS_VERSION_2.
+//
+// Files are laid out in command-line order unless an access trace is given
+// with -t. The trace is the console log of a kernel built with
+// KFS_ACCESS_TRACE, which prints a "kfs_trace: <name>" line whenever a file
+// is opened; all other lines of the log are ignored. Traced files come first,
+// in trace order, followed by the rest in command-line order. Inode numbers
+// follow the same order, so the inodes and the data of files used together
+// end up next to each other, near the start of the image.
+//
+// With -z (v2 only) ELF executables, and with -Z every file, are stored
+// compressed when that saves blocks. The file is cut into FS_ZCHUNK byte
+// chunks that are compressed separately in the LZ4 block format, so the
+// kernel can decompress any chunk on its own. The stored data starts with a
+// zhdr_t and a table of num_chunks + 1 byte offsets into the stored data;
+// chunk k occupies [off[k], off[k + 1]), and a chunk that does not shrink is
+// stored as is. The inode keeps the uncompressed length and is flagged with
+// FS_INODE_COMPRESSED; files of more than FS_MAX_ZCHUNKS chunks are never
+// compressed.
 
 typedef struct dentry_t{
     char file_name[FS_NAMELEN];
@@ -26,7 +57,9 @@ typedef struct boot_block_t{
     uint32_t num_dentry;
     uint32_t num_inodes;
     uint32_t num_data;
-    uint8_t reserved[52];
+    uint32_t magic;
+    uint32_t version;
+    uint8_t reserved[44];
     dentry_t dir_entries[63];
 }__attribute((packed)) boot_block_t;
 
@@ -35,11 +68,32 @@ typedef struct inode_t{
     uint32_t data_block_num[1023];
 }__attribute((packed)) inode_t;
 
+typedef struct extent_t{
+    uint32_t start;
+    uint32_t len;
+}__attribute((packed)) extent_t;
+
+typedef struct inode2_t{
+    uint32_t byte_len;
+    uint16_t num_extents;
+    uint16_t flags;
+    extent_t extents[FS_MAX_EXTENTS];
+}__attribute((packed)) inode2_t;
+
+typedef struct zhdr_t{
+    uint32_t chunk_size;
+    uint32_t num_chunks;
+}__attribute((packed)) zhdr_t;
+
 typedef struct data_block_t{
     uint8_t data[FS_BLKSZ];
 }__attribute((packed)) data_block_t;
 
 void die(const char *);
+const char *short_name(const char *);
+int read_trace(const char *, char **, int, int, int *);
+int compress_file(const uint8_t *, int, uint8_t **);
+int lz4_compress(const uint8_t *, int, uint8_t *, int);
 
 // convert to riscv byte order
 unsigned short
@@ -68,9 +122,32 @@ int
 main(int argc, char *argv[])
 {
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
+  static_assert(sizeof(inode2_t) == FS_INODE2_SZ, "v2 inode must be 256 bytes!");
+
+  int version = 1;
+  int compress = 0; // 1 for ELF files only, 2 for every file
+  const char *trace = NULL;
+  int first = 1; // index of the image argument
+  while(first < argc && argv[first][0] == '-'){
+    if(strcmp(argv[first], "-v2") == 0){
+      version = FS_VERSION_2;
+      first += 1;
+    } else if(strcmp(argv[first], "-z") == 0 || strcmp(argv[first], "-Z") == 0){
+      compress = (argv[first][1] == 'z') ? 1 : 2;
+      first += 1;
+    } else if(strcmp(argv[first], "-t") == 0 && first + 1 < argc){
+      trace = argv[first + 1];
+      first += 2;
+    } else
+      break;
+  }
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: ./mkfs [filesystem_image] [file1] [file2] ...\n");
+  if(argc < first + 1 || argv[first][0] == '-'){
+    fprintf(stderr, "Usage: ./mkfs [-v2] [-z|-Z] [-t trace] [filesystem_image] [file1] [file2] ...\n");
+    exit(1);
+  }
+  if(compress && version != FS_VERSION_2){
+    fprintf(stderr, "compression needs a v2 image, use -v2\n");
     exit(1);
   }
 
@@ -78,38 +155,52 @@ main(int argc, char *argv[])
 
   printf("Making fs\n");
 
-  int fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  int fsfd = open(argv[first], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
-    die(argv[1]);
-
-  int number_inodes = 0;
-  int i;
-  for(i = 2; i < argc; i++){ //Add all dentries
-    // get rid of "../user/bin/" or "user/bin/"
-    char *shortname;
-    if(strncmp(argv[i], "../user/bin/", 12) == 0)
-      shortname = argv[i] + 12;
-    else if(strncmp(argv[i], "user/bin/", 9) == 0)
-      shortname = argv[i] + 9;
-    else
-      shortname = argv[i];
+    die(argv[first]);
+
+  // layout[k] is the argv index of the file with inode number k
+  int number_inodes = argc - first - 1;
+  int *layout = calloc(number_inodes + 1, sizeof(int));
+  if(layout == NULL)
+    die("calloc");
+  int placed = 0;
+  if(trace != NULL)
+    placed = read_trace(trace, argv, first + 1, argc, layout);
+  int i, k;
+  for(i = first + 1; i < argc; i++){
+    for(k = 0; k < placed && layout[k] != i; k++)
+      ;
+    if(k == placed)
+      layout[placed++] = i;
+  }
 
+  for(i = first + 1; i < argc; i++){ //Add all dentries
+    const char *shortname = short_name(argv[i]);
     assert(index(shortname, '/') == 0);
 
+    for(k = 0; layout[k] != i; k++)
+      ;
     printf("File name is %s\n", shortname);
-    printf("Dentry index is %d\n", number_inodes);
-    printf("Inode number is %d\n", number_inodes);
-    strncpy(boot_block.dir_entries[number_inodes].file_name, shortname, FS_NAMELEN);
-    boot_block.dir_entries[number_inodes].inode = number_inodes;
-
-    number_inodes += 1;
+    printf("Dentry index is %d\n", i - first - 1);
+    printf("Inode number is %d\n", k);
+    strncpy(boot_block.dir_entries[i - first - 1].file_name, shortname, FS_NAMELEN);
+    boot_block.dir_entries[i - first - 1].inode = k;
   }
 
   int data_block_idx = 0;
   int inode_idx = 0;
-  inode_t inode_array[number_inodes];
-
-  for(i = 2; i < argc; i++){ //Add all inodes
+  inode_t *inode_array = calloc(number_inodes, sizeof(inode_t));
+  int number_inode_blocks = (number_inodes + FS_INODES_PER_BLK - 1) / FS_INODES_PER_BLK;
+  inode2_t *inode2_array = calloc(number_inode_blocks * FS_INODES_PER_BLK, sizeof(inode2_t));
+  // zdata[k] and zlen[k] hold the stored data of inode k if it is compressed
+  uint8_t **zdata = calloc(number_inodes + 1, sizeof(uint8_t *));
+  int *zlen = calloc(number_inodes + 1, sizeof(int));
+  if(inode_array == NULL || inode2_array == NULL || zdata == NULL || zlen == NULL)
+    die("calloc");
+
+  for(k = 0; k < number_inodes; k++){ //Add all inodes, in layout order
+    i = layout[k];
     FILE* fp;
     if((fp = fopen(argv[i], "r")) == NULL)
       die(argv[i]);
@@ -119,13 +210,50 @@ main(int argc, char *argv[])
     int num_data_blocks_for_file = (num_bytes / FS_BLKSZ) + 1;
     if(num_bytes%FS_BLKSZ == 0)
       num_data_blocks_for_file -= 1;
-    // we can do this since the inode index is the same as the dentry index
-    printf("Number of bytes for file %s: %d\n",boot_block.dir_entries[inode_idx].file_name, num_bytes); 
+    printf("Number of bytes for file %s: %d\n", short_name(argv[i]), num_bytes);
+
+    if(compress && num_bytes > 0){
+      uint8_t *raw = malloc(num_bytes);
+      if(raw == NULL)
+        die("malloc");
+      rewind(fp);
+      if(fread(raw, 1, num_bytes, fp) != (size_t)num_bytes)
+        die(argv[i]);
+      if(compress == 2 || (num_bytes >= 4 && memcmp(raw, "\177ELF", 4) == 0)){
+        zlen[inode_idx] = compress_file(raw, num_bytes, &zdata[inode_idx]);
+        int zblocks = (zlen[inode_idx] + FS_BLKSZ - 1) / FS_BLKSZ;
+        if(zlen[inode_idx] > 0 && zblocks < num_data_blocks_for_file){
+          printf("Compressed %s: %d -> %d blocks\n", short_name(argv[i]), num_data_blocks_for_file, zblocks);
+          inode2_array[inode_idx].flags = FS_INODE_COMPRESSED;
+          num_data_blocks_for_file = zblocks;
+        } else {
+          free(zdata[inode_idx]);
+          zdata[inode_idx] = NULL;
+        }
+      }
+      free(raw);
+    }
 
-    int j;
-    for (j = 0; j < num_data_blocks_for_file; ++j){
-      inode_array[inode_idx].data_block_num[j] = data_block_idx;
-      data_block_idx += 1; 
+    if(version == FS_VERSION_2){
+      // data blocks are laid out back to back, so one extent covers the file
+      inode2_array[inode_idx].byte_len = num_bytes;
+      if(num_data_blocks_for_file > 0){
+        inode2_array[inode_idx].num_extents = 1;
+        inode2_array[inode_idx].extents[0].start = data_block_idx;
+        inode2_array[inode_idx].extents[0].len = num_data_blocks_for_file;
+      }
+      data_block_idx += num_data_blocks_for_file;
+    } else {
+      if(num_data_blocks_for_file > 1023){
+        fprintf(stderr, "%s is too large for a v1 image, use -v2\n", argv[i]);
+        exit(1);
+      }
+
+      int j;
+      for (j = 0; j < num_data_blocks_for_file; ++j){
+        inode_array[inode_idx].data_block_num[j] = data_block_idx;
+        data_block_idx += 1; 
+      }
     }
 
     inode_array[inode_idx].byte_len = num_bytes;
@@ -137,6 +265,10 @@ main(int argc, char *argv[])
   boot_block.num_dentry = number_inodes;
   boot_block.num_inodes = number_inodes;
   boot_block.num_data = data_block_idx;
+  if(version == FS_VERSION_2){
+    boot_block.magic = FS_MAGIC;
+    boot_block.version = FS_VERSION_2;
+  }
 
   printf("Total number of dentries: %d\n", boot_block.num_dentry);
   printf("Total number of inodes: %d\n", boot_block.num_inodes);
@@ -144,12 +276,29 @@ main(int argc, char *argv[])
 
   write(fsfd, &boot_block, sizeof(boot_block_t)); 
 
-  for (i = 0; i < number_inodes; ++i) {
-    write(fsfd, &inode_array[i], sizeof(inode_t));
-    printf("Wrote Inode %d, Program: %s\n", i, boot_block.dir_entries[i].file_name);
+  if(version == FS_VERSION_2){
+    write(fsfd, inode2_array, number_inode_blocks * FS_BLKSZ);
+    printf("Wrote %d inodes in %d blocks\n", number_inodes, number_inode_blocks);
+  } else {
+    for (i = 0; i < number_inodes; ++i) {
+      write(fsfd, &inode_array[i], sizeof(inode_t));
+      printf("Wrote Inode %d, Program: %s\n", i, short_name(argv[layout[i]]));
+    }
   }
 
-  for(i = 2; i < argc; i++){ //Add all data blocks
+  for(k = 0; k < number_inodes; k++){ //Add all data blocks, in layout order
+    i = layout[k];
+    if(zdata[k] != NULL){
+      // pad the stored data to whole blocks
+      int padded = (zlen[k] + FS_BLKSZ - 1) / FS_BLKSZ * FS_BLKSZ;
+      zdata[k] = realloc(zdata[k], padded);
+      if(zdata[k] == NULL)
+        die("realloc");
+      memset(zdata[k] + zlen[k], 0, padded - zlen[k]);
+      write(fsfd, zdata[k], padded);
+      continue;
+    }
+
     int fd;
     if((fd = open(argv[i], 0)) < 0)
       die(argv[i]);
@@ -157,9 +306,10 @@ main(int argc, char *argv[])
     char buf[FS_BLKSZ] = {0};
     while(read(fd, buf, sizeof(buf)) > 0)
       write(fsfd, buf, FS_BLKSZ);
+    close(fd);
   }
 
-  printf("Wrote filesystem image to %s\n", argv[1]);
+  printf("Wrote filesystem image to %s (v%d)\n", argv[first], version);
 
   close(fsfd);
 }
@@ -170,3 +320,179 @@ die(const char *s)
   perror(s);
   exit(1);
 }
+
+// get rid of "../user/bin/" or "user/bin/"
+const char *
+short_name(const char *path)
+{
+  if(strncmp(path, "../user/bin/", 12) == 0)
+    return path + 12;
+  else if(strncmp(path, "user/bin/", 9) == 0)
+    return path + 9;
+  else
+    return path;
+}
+
+// Reads the access trace at /path/ and stores the argv indices of the files
+// named by its "kfs_trace:" lines, in order of first access, into /layout/.
+// Names that are not among argv[lo..hi-1] are ignored. Returns the number of
+// files stored.
+int
+read_trace(const char *path, char **argv, int lo, int hi, int *layout)
+{
+  FILE *fp;
+  char line[256];
+  int placed = 0;
+  int i, k;
+
+  if((fp = fopen(path, "r")) == NULL)
+    die(path);
+
+  while(fgets(line, sizeof(line), fp) != NULL){
+    // the rest of the log is other kernel output
+    if(strncmp(line, TRACE_TAG, strlen(TRACE_TAG)) != 0)
+      continue;
+    char *end = line + strlen(line);
+    while(end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+      *--end = '\0';
+    char *name = line + strlen(TRACE_TAG);
+    while(*name == ' ' || *name == '\t')
+      name++;
+    if(*name == '\0')
+      continue;
+
+    for(i = lo; i < hi; i++){
+      if(strncmp(short_name(argv[i]), name, FS_NAMELEN) == 0)
+        break;
+    }
+    if(i == hi)
+      continue;
+    for(k = 0; k < placed && layout[k] != i; k++)
+      ;
+    if(k == placed){
+      layout[placed++] = i;
+      printf("Trace places %s at inode %d\n", name, k);
+    }
+  }
+
+  fclose(fp);
+  return placed;
+}
+
+// Compresses the /len/ bytes at /raw/ chunk by chunk into the stored format
+// described at the top and returns its size, with the data in *out. Returns 0
+// if the file has too many chunks.
+int
+compress_file(const uint8_t *raw, int len, uint8_t **out)
+{
+  int num_chunks = (len + FS_ZCHUNK - 1) / FS_ZCHUNK;
+  int head = sizeof(zhdr_t) + (num_chunks + 1) * 4;
+  int k;
+
+  *out = NULL;
+  if(num_chunks > FS_MAX_ZCHUNKS)
+    return 0;
+
+  // no chunk is stored bigger than it is
+  uint8_t *buf = malloc(head + len);
+  if(buf == NULL)
+    die("malloc");
+  zhdr_t *hdr = (zhdr_t *)buf;
+  uint32_t *off = (uint32_t *)(buf + sizeof(zhdr_t));
+  hdr->chunk_size = FS_ZCHUNK;
+  hdr->num_chunks = num_chunks;
+
+  int pos = head;
+  for(k = 0; k < num_chunks; k++){
+    const uint8_t *chunk = raw + k * FS_ZCHUNK;
+    int raw_len = (len - k * FS_ZCHUNK < FS_ZCHUNK) ? len - k * FS_ZCHUNK : FS_ZCHUNK;
+    off[k] = pos;
+    int n = lz4_compress(chunk, raw_len, buf + pos, raw_len - 1);
+    if(n == 0){
+      memcpy(buf + pos, chunk, raw_len);
+      n = raw_len;
+    }
+    pos += n;
+  }
+  off[num_chunks] = pos;
+
+  *out = buf;
+  return pos;
+}
+
+static uint32_t
+read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// appends the LZ4 length extension of /n/ at dst[*op]
+static void
+put_len(uint8_t *dst, int *op, int n)
+{
+  while(n >= 255){
+    dst[(*op)++] = 255;
+    n -= 255;
+  }
+  dst[(*op)++] = n;
+}
+
+// Compresses /len/ bytes at /src/ into an LZ4 block at /dst/, which has room
+// for /cap/ bytes. Greedy matching over a hash of the last position of every
+// 4-byte sequence. Returns the size of the block, or 0 if it does not fit.
+int
+lz4_compress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+  int table[1 << 12]; // position + 1 of the last sequence with a hash, 0 if none
+  int anchor = 0, ip = 0, op = 0;
+  // the format wants the last match to start 12 bytes and end 5 bytes
+  // before the end of the input
+  int mflimit = len - 12;
+  int matchlimit = len - 5;
+
+  memset(table, 0, sizeof(table));
+  while(ip < mflimit){
+    uint32_t seq = read32(src + ip);
+    uint32_t h = (seq * 2654435761u) >> 20;
+    int ref = table[h] - 1;
+    table[h] = ip + 1;
+    if(ref < 0 || ip - ref > 65535 || read32(src + ref) != seq){
+      ip++;
+      continue;
+    }
+    int mlen = 4;
+    while(ip + mlen < matchlimit && src[ref + mlen] == src[ip + mlen])
+      mlen++;
+
+    int lit = ip - anchor;
+    if(op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > cap)
+      return 0;
+    uint8_t *token = &dst[op++];
+    *token = ((lit < 15) ? lit : 15) << 4;
+    if(lit >= 15)
+      put_len(dst, &op, lit - 15);
+    memcpy(dst + op, src + anchor, lit);
+    op += lit;
+    dst[op++] = (ip - ref) & 0xff;
+    dst[op++] = (ip - ref) >> 8;
+    *token |= (mlen - 4 < 15) ? mlen - 4 : 15;
+    if(mlen - 4 >= 15)
+      put_len(dst, &op, mlen - 4 - 15);
+
+    ip += mlen;
+    anchor = ip;
+  }
+
+  // the rest goes out as literals
+  int lit = len - anchor;
+  if(op + 1 + lit / 255 + 1 + lit > cap)
+    return 0;
+  dst[op++] = ((lit < 15) ? lit : 15) << 4;
+  if(lit >= 15)
+    put_len(dst, &op, lit - 15);
+  memcpy(dst + op, src + anchor, lit);
+  op += lit;
+  return op;
+}